@@ -0,0 +1,46 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Highlight pass over the baked highlight mesh (see hlmesh.h). Each
+ * vertex picks its alpha by the index of the highlight it belongs to.
+ *
+ * MAX_HL must match HLMESH_MAX_ENTS in hlmesh.h.
+ */
+#version 460 core
+
+#define	MAX_HL	32
+
+layout(location = 0) uniform mat4	pvm;
+layout(location = 60) uniform float	hl_alpha[MAX_HL];
+layout(location = 0) in vec3		vtx_pos;
+layout(location = 1) in float		vtx_slot;
+
+layout(location = 0) out float		alpha;
+
+void
+main()
+{
+	alpha = hl_alpha[int(vtx_slot)];
+	gl_Position = pvm * vec4(vtx_pos, 1.0);
+}
@@ -24,11 +24,12 @@
 #version 460
 
 layout(location = 50) uniform float	manip_idx;
+layout(location = 51) uniform float	obj_idx;
 
 layout(location = 0) out vec4		color_out;
 
 void
 main()
 {
-	color_out = vec4(manip_idx / 65535.0, 0, 0, 1);
+	color_out = vec4(manip_idx / 65535.0, obj_idx / 65535.0, 0, 1);
 }
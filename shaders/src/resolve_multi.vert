@@ -0,0 +1,54 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Batched pick pass. Every instance resolves one pick point into its
+ * own pixel of an n_pts x 1 strip. The pick matrix maps the pixel under
+ * the point onto the whole clip volume, which we then squeeze into the
+ * instance's column and clip away everything outside of it.
+ *
+ * MAX_PICK_PTS must match PICK_MAX_PTS in manipdraw.c.
+ */
+#version 460 core
+
+#define	MAX_PICK_PTS	32
+
+layout(location = 0) uniform mat4	pvm;
+layout(location = 1) uniform int	n_pts;
+layout(location = 2) uniform mat4	pick[MAX_PICK_PTS];
+layout(location = 0) in vec3		vtx_pos;
+layout(location = 1) in float		vtx_manip;
+
+layout(location = 0) flat out float	manip_idx;
+
+void
+main()
+{
+	vec4 pos = pick[gl_InstanceID] * (pvm * vec4(vtx_pos, 1.0));
+	float col = float(2 * gl_InstanceID + 1 - n_pts);
+
+	manip_idx = vtx_manip;
+	gl_ClipDistance[0] = pos.w + pos.x;
+	gl_ClipDistance[1] = pos.w - pos.x;
+	gl_Position = vec4((pos.x + pos.w * col) / float(n_pts), pos.yzw);
+}
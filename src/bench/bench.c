@@ -0,0 +1,502 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Offline replay benchmark for the manipulator resolve and paint
+ * pipeline. Hosts the plugin on a headless EGL context with a fake
+ * XPLM, replays recordings made with manipdraw/record through each
+ * picking backend and reports throughput, per-frame latency and whether
+ * the backends agreed on the picked manipulator.
+ *
+ * Usage: manipdraw_bench [-i iterations] <plugindir> <recording>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+
+#include <XPLMDefs.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/glew.h>
+#include <acfutils/glutils.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/time.h>
+
+#include "record.h"
+#include "xplm_fake.h"
+
+#define	DFL_ITERATIONS	10
+#define	LOAD_TIMEOUT	SEC2USEC(120)
+#define	MAX_MISMATCHES	10
+
+PLUGIN_API int XPluginStart(char *name, char *sig, char *desc);
+PLUGIN_API void XPluginStop(void);
+PLUGIN_API int XPluginEnable(void);
+PLUGIN_API void XPluginDisable(void);
+
+typedef struct {
+	const char	*name;
+	int		backend;	/* value of manipdraw/backend */
+	int		scrcache_div;
+} bench_cfg_t;
+
+static const bench_cfg_t cfgs[] = {
+    { "gpu", 0, 0 },
+    { "gpu+scrcache", 0, 2 },
+    { "bvh", 1, 0 },
+    { "compute", 2, 0 }
+};
+#define	NUM_CFGS	ARRAY_NUM_ELEM(cfgs)
+
+typedef struct {
+	rec_dr_t	*drs;
+	unsigned	n_drs;
+	rec_frame_t	*frames;
+	unsigned	n_frames;
+} recording_t;
+
+static EGLDisplay	egl_dpy = EGL_NO_DISPLAY;
+static EGLContext	egl_ctx = EGL_NO_CONTEXT;
+static EGLSurface	egl_surf = EGL_NO_SURFACE;
+static GLuint		screen_tex[2] = {};
+static GLuint		screen_fbo = 0;
+static int		screen_vp[4] = {};
+static bool		plugin_enabled = false;
+static bool		plugin_rev_z = false;
+
+static bool
+egl_init(void)
+{
+	static const EGLint cfg_attrs[] = {
+	    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+	    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+	    EGL_DEPTH_SIZE, 24,
+	    EGL_NONE
+	};
+	static const EGLint pbuf_attrs[] = {
+	    EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE
+	};
+	EGLConfig cfg;
+	EGLint n_cfgs;
+
+	egl_dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (egl_dpy == EGL_NO_DISPLAY ||
+	    !eglInitialize(egl_dpy, NULL, NULL)) {
+		fprintf(stderr, "Can't initialize EGL\n");
+		return (false);
+	}
+	if (!eglChooseConfig(egl_dpy, cfg_attrs, &cfg, 1, &n_cfgs) ||
+	    n_cfgs == 0 || !eglBindAPI(EGL_OPENGL_API)) {
+		fprintf(stderr, "No suitable EGL config for desktop GL\n");
+		return (false);
+	}
+	/*
+	 * The plugin expects a compatibility context, same as X-Plane
+	 * gives it, so don't ask for any particular profile.
+	 */
+	egl_ctx = eglCreateContext(egl_dpy, cfg, EGL_NO_CONTEXT, NULL);
+	egl_surf = eglCreatePbufferSurface(egl_dpy, cfg, pbuf_attrs);
+	if (egl_ctx == EGL_NO_CONTEXT || egl_surf == EGL_NO_SURFACE ||
+	    !eglMakeCurrent(egl_dpy, egl_surf, egl_surf, egl_ctx)) {
+		fprintf(stderr, "Can't create EGL context\n");
+		return (false);
+	}
+	return (true);
+}
+
+static void
+egl_fini(void)
+{
+	if (egl_dpy == EGL_NO_DISPLAY)
+		return;
+	eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+	    EGL_NO_CONTEXT);
+	if (egl_surf != EGL_NO_SURFACE)
+		eglDestroySurface(egl_dpy, egl_surf);
+	if (egl_ctx != EGL_NO_CONTEXT)
+		eglDestroyContext(egl_dpy, egl_ctx);
+	eglTerminate(egl_dpy);
+}
+
+/*
+ * Stands in for X-Plane's window framebuffer, which the plugin returns
+ * to after its offscreen passes and paints the highlight into.
+ */
+static void
+screen_init(unsigned w, unsigned h)
+{
+	glGenTextures(2, screen_tex);
+	setup_texture(screen_tex[0], GL_RGBA8, w, h, GL_RGBA,
+	    GL_UNSIGNED_BYTE, NULL);
+	setup_texture(screen_tex[1], GL_DEPTH_COMPONENT32F, w, h,
+	    GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glGenFramebuffers(1, &screen_fbo);
+	VERIFY(setup_color_fbo_for_tex(screen_fbo, screen_tex[0],
+	    screen_tex[1], 0, true));
+	fake_set_dr("sim/graphics/view/current_gl_fbo", 0, screen_fbo);
+	fake_set_drv("sim/graphics/view/viewport",
+	    (float[4]){ 0, 0, w, h }, 4);
+}
+
+static void
+screen_fini(void)
+{
+	if (screen_fbo != 0)
+		glDeleteFramebuffers(1, &screen_fbo);
+	if (screen_tex[0] != 0)
+		glDeleteTextures(2, screen_tex);
+}
+
+static bool
+recording_load(const char *path, recording_t *rec)
+{
+	rec_reader_t *r = rec_reader_open(path);
+	unsigned cap = 0;
+
+	memset(rec, 0, sizeof (*rec));
+	if (r == NULL)
+		return (false);
+	rec->n_drs = rec_reader_num_drs(r);
+	rec->drs = safe_calloc(MAX(rec->n_drs, 1), sizeof (*rec->drs));
+	for (unsigned i = 0; i < rec->n_drs; i++)
+		rec->drs[i] = *rec_reader_dr(r, i);
+	for (;;) {
+		rec_frame_t *frame;
+
+		if (rec->n_frames == cap) {
+			cap = MAX(cap * 2, 1024);
+			rec->frames = safe_realloc(rec->frames,
+			    cap * sizeof (*rec->frames));
+		}
+		frame = &rec->frames[rec->n_frames];
+		frame->dr_values = safe_calloc(MAX(rec->n_drs, 1),
+		    sizeof (*frame->dr_values));
+		if (!rec_reader_next(r, frame)) {
+			free(frame->dr_values);
+			break;
+		}
+		rec->n_frames++;
+	}
+	rec_reader_close(r);
+
+	return (true);
+}
+
+static void
+recording_free(recording_t *rec)
+{
+	for (unsigned i = 0; i < rec->n_frames; i++)
+		free(rec->frames[i].dr_values);
+	free(rec->frames);
+	free(rec->drs);
+	memset(rec, 0, sizeof (*rec));
+}
+
+static void
+apply_frame(const recording_t *rec, const rec_frame_t *frame)
+{
+	float vp[4];
+
+	for (int i = 0; i < 4; i++)
+		vp[i] = frame->data.vp[i];
+	memcpy(screen_vp, frame->data.vp, sizeof (screen_vp));
+	fake_set_mouse(frame->data.mouse_x, frame->data.mouse_y);
+	fake_set_drv("sim/graphics/view/viewport", vp, 4);
+	fake_set_drv("sim/graphics/view/acf_matrix",
+	    frame->data.acf_matrix, 16);
+	fake_set_drv("sim/graphics/view/projection_matrix_3d",
+	    frame->data.proj_matrix, 16);
+	/* the reverse-Z mode is latched in plugin_enable() instead */
+	for (unsigned i = 0; i < rec->n_drs; i++) {
+		const rec_dr_t *dr = &rec->drs[i];
+
+		fake_set_dr(dr->name, dr->is_array ? dr->arr_idx : 0,
+		    frame->dr_values[i]);
+	}
+}
+
+/*
+ * Runs one simulated X-Plane frame and waits for the GPU to finish it,
+ * so the measured time covers all of the work we caused.
+ */
+static uint64_t
+run_frame(void)
+{
+	uint64_t start = microclock();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, screen_fbo);
+	glViewport(screen_vp[0], screen_vp[1], screen_vp[2], screen_vp[3]);
+	fake_draw(xplm_Phase_Window);
+	glFinish();
+
+	return (microclock() - start);
+}
+
+static int
+u64_compar(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return (ua < ub ? -1 : (ua > ub ? 1 : 0));
+}
+
+static void
+select_cfg(const bench_cfg_t *cfg)
+{
+	VERIFY(fake_set_dr_i("manipdraw/backend", cfg->backend));
+	VERIFY(fake_set_dr_i("manipdraw/scrcache_div", cfg->scrcache_div));
+	/* we want to measure every resolve, not have some deferred */
+	VERIFY(fake_set_dr_i("manipdraw/sched/enable", 0));
+}
+
+/*
+ * Determines the settled pick result for every frame. The GPU backend
+ * returns its result a frame late, so we run each frame twice with the
+ * same inputs: the second run collects what the first one rendered.
+ */
+static void
+bench_results(const recording_t *rec, const bench_cfg_t *cfg, int *results)
+{
+	select_cfg(cfg);
+	for (unsigned i = 0; i < rec->n_frames; i++) {
+		apply_frame(rec, &rec->frames[i]);
+		run_frame();
+		run_frame();
+		VERIFY(fake_get_dr_i("manipdraw/manip_idx", &results[i]));
+	}
+}
+
+static void
+bench_timing(const recording_t *rec, const bench_cfg_t *cfg,
+    unsigned iterations)
+{
+	unsigned n = rec->n_frames * iterations;
+	uint64_t *lat = safe_calloc(MAX(n, 1), sizeof (*lat));
+	uint64_t total = 0;
+
+	select_cfg(cfg);
+	for (unsigned it = 0, k = 0; it < iterations; it++) {
+		for (unsigned i = 0; i < rec->n_frames; i++, k++) {
+			apply_frame(rec, &rec->frames[i]);
+			lat[k] = run_frame();
+			total += lat[k];
+		}
+	}
+	qsort(lat, n, sizeof (*lat), u64_compar);
+	printf("  %-14s %9.0f picks/s  latency us: min %6.1f  avg %6.1f  "
+	    "p50 %6.1f  p99 %6.1f  max %7.1f\n", cfg->name,
+	    n / USEC2SEC(MAX(total, 1)), (double)lat[0],
+	    (double)total / n, (double)lat[n / 2],
+	    (double)lat[(unsigned)(n * 0.99)], (double)lat[n - 1]);
+	free(lat);
+}
+
+static bool
+wait_ready(void)
+{
+	uint64_t start = microclock();
+	int ready = 0;
+
+	/* keep the mouse off-screen, so the plugin does nothing else */
+	fake_set_mouse(-1, -1);
+	while (microclock() - start < LOAD_TIMEOUT) {
+		run_frame();
+		if (fake_get_dr_i("manipdraw/ready", &ready) && ready)
+			return (true);
+		usleep(1000);
+	}
+	fprintf(stderr, "Timed out waiting for the plugin to load\n");
+	return (false);
+}
+
+/*
+ * The plugin latches the reverse-Z mode in XPluginEnable(), just like
+ * the sim can't change it without a restart. So we set it from the
+ * recording before enabling, and re-enable the plugin whenever the
+ * next recording was made in the other mode.
+ */
+static bool
+plugin_enable(bool rev_z)
+{
+	int pub_rev_z;
+
+	if (plugin_enabled && plugin_rev_z == rev_z)
+		return (true);
+	if (plugin_enabled) {
+		XPluginDisable();
+		plugin_enabled = false;
+	}
+	fake_set_dr("sim/graphics/view/is_reverse_float_z", 0, rev_z);
+	if (!XPluginEnable()) {
+		fprintf(stderr, "XPluginEnable failed\n");
+		return (false);
+	}
+	plugin_enabled = true;
+	plugin_rev_z = rev_z;
+	if (!wait_ready())
+		return (false);
+	VERIFY(fake_get_dr_i("manipdraw/dev/rev_z", &pub_rev_z));
+	VERIFY3S(pub_rev_z, ==, rev_z);
+
+	return (true);
+}
+
+static bool
+bench_recording(const char *path, unsigned iterations)
+{
+	recording_t rec;
+	int *results[NUM_CFGS];
+	bool rev_z;
+
+	if (!recording_load(path, &rec))
+		return (true);
+	printf("%s: %d frames, %d animation datarefs\n", path, rec.n_frames,
+	    rec.n_drs);
+	if (rec.n_frames == 0) {
+		recording_free(&rec);
+		return (true);
+	}
+	rev_z = (rec.frames[0].data.rev_float_z != 0);
+	for (unsigned i = 1; i < rec.n_frames; i++) {
+		if ((rec.frames[i].data.rev_float_z != 0) != rev_z) {
+			fprintf(stderr, "%s: frame %d changes the reverse-Z "
+			    "mode, skipping recording\n", path, i);
+			recording_free(&rec);
+			return (true);
+		}
+	}
+	if (!plugin_enable(rev_z)) {
+		recording_free(&rec);
+		return (false);
+	}
+	for (unsigned c = 0; c < NUM_CFGS; c++) {
+		results[c] = safe_calloc(rec.n_frames, sizeof (*results[c]));
+		bench_results(&rec, &cfgs[c], results[c]);
+	}
+	for (unsigned c = 1; c < NUM_CFGS; c++) {
+		unsigned mismatches = 0;
+
+		for (unsigned i = 0; i < rec.n_frames; i++) {
+			if (results[c][i] == results[0][i])
+				continue;
+			if (mismatches < MAX_MISMATCHES) {
+				printf("  frame %d: %s picked %d, %s picked "
+				    "%d\n", i, cfgs[0].name, results[0][i],
+				    cfgs[c].name, results[c][i]);
+			}
+			mismatches++;
+		}
+		printf("  %s vs %s: %d of %d frames differ\n", cfgs[c].name,
+		    cfgs[0].name, mismatches, rec.n_frames);
+	}
+	for (unsigned c = 0; c < NUM_CFGS; c++) {
+		bench_timing(&rec, &cfgs[c], iterations);
+		free(results[c]);
+	}
+	recording_free(&rec);
+
+	return (true);
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-i iterations] <plugindir> "
+	    "<recording>...\n", progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	unsigned iterations = DFL_ITERATIONS;
+	char name[256], sig[256], desc[256];
+	char *plugin_path;
+	int max_w = 1, max_h = 1;
+	int ret = 1;
+
+	while ((opt = getopt(argc, argv, "i:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = MAX(atoi(optarg), 1);
+			break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h' ? 0 : 1);
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return (1);
+	}
+	/* size our fake window to fit every recording's viewport */
+	for (int i = optind + 1; i < argc; i++) {
+		recording_t rec;
+
+		if (!recording_load(argv[i], &rec))
+			return (1);
+		for (unsigned j = 0; j < rec.n_frames; j++) {
+			const int *vp = rec.frames[j].data.vp;
+
+			max_w = MAX(max_w, vp[0] + vp[2]);
+			max_h = MAX(max_h, vp[1] + vp[3]);
+		}
+		recording_free(&rec);
+	}
+	if (!egl_init())
+		goto out;
+	plugin_path = mkpathname(argv[optind], "lin_x64", "manipdraw.xpl",
+	    NULL);
+	fake_init(plugin_path);
+	lacf_free(plugin_path);
+	if (!XPluginStart(name, sig, desc)) {
+		fprintf(stderr, "XPluginStart failed\n");
+		goto out;
+	}
+	screen_init(max_w, max_h);
+	screen_vp[2] = max_w;
+	screen_vp[3] = max_h;
+	ret = 0;
+	for (int i = optind + 1; i < argc; i++) {
+		if (!bench_recording(argv[i], iterations)) {
+			ret = 1;
+			break;
+		}
+	}
+	if (plugin_enabled) {
+		XPluginDisable();
+		plugin_enabled = false;
+	}
+	XPluginStop();
+out:
+	screen_fini();
+	fake_fini();
+	egl_fini();
+	return (ret);
+}
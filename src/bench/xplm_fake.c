@@ -0,0 +1,607 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <XPLMDataAccess.h>
+#include <XPLMDisplay.h>
+#include <XPLMPlugin.h>
+#include <XPLMProcessing.h>
+#include <XPLMUtilities.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+
+#include "xplm_fake.h"
+
+#define	MAX_DRAW_CBS	16
+#define	FAKE_XPLM_VER	400
+/*
+ * We claim to be X-Plane 11, so the plugin consults the reverse-Z
+ * datarefs, which the benchmark sets from the recording before it
+ * enables the plugin.
+ */
+#define	FAKE_XP_VER	11550
+
+typedef struct {
+	char		name[128];
+	XPLMDataTypeID	type;
+	bool		writable;
+	bool		registered;
+	/* sim datarefs */
+	float		*values;
+	unsigned	n_values;
+	/* datarefs registered by the plugin */
+	XPLMGetDatai_f	get_i;
+	XPLMSetDatai_f	set_i;
+	XPLMGetDataf_f	get_f;
+	XPLMSetDataf_f	set_f;
+	XPLMGetDatad_f	get_d;
+	XPLMSetDatad_f	set_d;
+	XPLMGetDatavi_f	get_vi;
+	XPLMSetDatavi_f	set_vi;
+	XPLMGetDatavf_f	get_vf;
+	XPLMSetDatavf_f	set_vf;
+	XPLMGetDatab_f	get_b;
+	XPLMSetDatab_f	set_b;
+	void		*read_refcon;
+	void		*write_refcon;
+} fake_dr_t;
+
+typedef struct {
+	XPLMDrawCallback_f	cb;
+	XPLMDrawingPhase	phase;
+	int			before;
+	void			*refcon;
+} draw_cb_t;
+
+static char		*plugin_path = NULL;
+static fake_dr_t	**drs = NULL;
+static unsigned		n_drs = 0;
+static draw_cb_t	draw_cbs[MAX_DRAW_CBS];
+static unsigned		n_draw_cbs = 0;
+static int		mouse_x = 0, mouse_y = 0;
+
+static fake_dr_t *
+dr_lookup(const char *name)
+{
+	/* the plugin's own datarefs shadow any sim ones */
+	for (unsigned i = 0; i < n_drs; i++) {
+		if (drs[i]->registered && strcmp(drs[i]->name, name) == 0)
+			return (drs[i]);
+	}
+	for (unsigned i = 0; i < n_drs; i++) {
+		if (strcmp(drs[i]->name, name) == 0)
+			return (drs[i]);
+	}
+	return (NULL);
+}
+
+static fake_dr_t *
+dr_add(const char *name)
+{
+	fake_dr_t *dr = safe_calloc(1, sizeof (*dr));
+
+	strlcpy(dr->name, name, sizeof (dr->name));
+	drs = safe_realloc(drs, (n_drs + 1) * sizeof (*drs));
+	drs[n_drs++] = dr;
+
+	return (dr);
+}
+
+static fake_dr_t *
+sim_dr(const char *name)
+{
+	fake_dr_t *dr = dr_lookup(name);
+
+	if (dr == NULL) {
+		dr = dr_add(name);
+		dr->type = xplmType_Int | xplmType_Float | xplmType_Double |
+		    xplmType_IntArray | xplmType_FloatArray;
+		dr->writable = true;
+	}
+	return (dr);
+}
+
+static void
+sim_dr_grow(fake_dr_t *dr, unsigned n)
+{
+	if (n <= dr->n_values)
+		return;
+	dr->values = safe_realloc(dr->values, n * sizeof (*dr->values));
+	memset(&dr->values[dr->n_values], 0,
+	    (n - dr->n_values) * sizeof (*dr->values));
+	dr->n_values = n;
+}
+
+void
+fake_init(const char *path)
+{
+	ASSERT(path != NULL);
+	plugin_path = safe_strdup(path);
+}
+
+void
+fake_fini(void)
+{
+	for (unsigned i = 0; i < n_drs; i++) {
+		free(drs[i]->values);
+		free(drs[i]);
+	}
+	free(drs);
+	drs = NULL;
+	n_drs = 0;
+	n_draw_cbs = 0;
+	free(plugin_path);
+	plugin_path = NULL;
+}
+
+void
+fake_set_mouse(int x, int y)
+{
+	mouse_x = x;
+	mouse_y = y;
+}
+
+void
+fake_set_dr(const char *name, unsigned idx, float value)
+{
+	fake_dr_t *dr = sim_dr(name);
+
+	sim_dr_grow(dr, idx + 1);
+	dr->values[idx] = value;
+}
+
+void
+fake_set_drv(const char *name, const float *values, unsigned n)
+{
+	fake_dr_t *dr = sim_dr(name);
+
+	sim_dr_grow(dr, n);
+	memcpy(dr->values, values, n * sizeof (*values));
+}
+
+bool
+fake_get_dr_i(const char *name, int *value)
+{
+	fake_dr_t *dr = dr_lookup(name);
+
+	if (dr == NULL)
+		return (false);
+	*value = XPLMGetDatai(dr);
+	return (true);
+}
+
+bool
+fake_set_dr_i(const char *name, int value)
+{
+	fake_dr_t *dr = dr_lookup(name);
+
+	if (dr == NULL)
+		return (false);
+	XPLMSetDatai(dr, value);
+	return (true);
+}
+
+void
+fake_draw(XPLMDrawingPhase phase)
+{
+	for (unsigned i = 0; i < n_draw_cbs; i++) {
+		if (draw_cbs[i].phase == phase)
+			draw_cbs[i].cb(phase, draw_cbs[i].before,
+			    draw_cbs[i].refcon);
+	}
+}
+
+/*
+ * XPLMUtilities & XPLMPlugin
+ */
+void
+XPLMGetVersions(int *xp_ver, int *xplm_ver, XPLMHostApplicationID *host)
+{
+	if (xp_ver != NULL)
+		*xp_ver = FAKE_XP_VER;
+	if (xplm_ver != NULL)
+		*xplm_ver = FAKE_XPLM_VER;
+	if (host != NULL)
+		*host = 1;
+}
+
+void
+XPLMDebugString(const char *str)
+{
+	fputs(str, stderr);
+}
+
+void
+XPLMGetSystemPath(char *path)
+{
+	strcpy(path, "./");
+}
+
+void
+XPLMGetPrefsPath(char *path)
+{
+	strcpy(path, "./Output/preferences/X-Plane.prf");
+}
+
+const char *
+XPLMGetDirectorySeparator(void)
+{
+	return ("/");
+}
+
+void
+XPLMSpeakString(const char *str)
+{
+	UNUSED(str);
+}
+
+void
+XPLMEnableFeature(const char *feature, int enable)
+{
+	UNUSED(feature);
+	UNUSED(enable);
+}
+
+XPLMPluginID
+XPLMGetMyID(void)
+{
+	return (1);
+}
+
+void
+XPLMGetPluginInfo(XPLMPluginID id, char *name, char *path, char *sig,
+    char *desc)
+{
+	UNUSED(id);
+	if (name != NULL)
+		strcpy(name, "manipdraw");
+	if (path != NULL)
+		strcpy(path, plugin_path);
+	if (sig != NULL)
+		strcpy(sig, "skiselkov.manipdraw");
+	if (desc != NULL)
+		strcpy(desc, "manipdraw");
+}
+
+XPLMPluginID
+XPLMFindPluginBySignature(const char *sig)
+{
+	UNUSED(sig);
+	return (XPLM_NO_PLUGIN_ID);
+}
+
+void
+XPLMSendMessageToPlugin(XPLMPluginID id, int msg, void *param)
+{
+	UNUSED(id);
+	UNUSED(msg);
+	UNUSED(param);
+}
+
+/*
+ * XPLMDisplay & XPLMProcessing
+ */
+int
+XPLMRegisterDrawCallback(XPLMDrawCallback_f cb, XPLMDrawingPhase phase,
+    int before, void *refcon)
+{
+	if (n_draw_cbs == MAX_DRAW_CBS)
+		return (0);
+	draw_cbs[n_draw_cbs++] = (draw_cb_t){ cb, phase, before, refcon };
+	return (1);
+}
+
+int
+XPLMUnregisterDrawCallback(XPLMDrawCallback_f cb, XPLMDrawingPhase phase,
+    int before, void *refcon)
+{
+	for (unsigned i = 0; i < n_draw_cbs; i++) {
+		draw_cb_t *dcb = &draw_cbs[i];
+
+		if (dcb->cb == cb && dcb->phase == phase &&
+		    dcb->before == before && dcb->refcon == refcon) {
+			memmove(dcb, dcb + 1,
+			    (n_draw_cbs - i - 1) * sizeof (*dcb));
+			n_draw_cbs--;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+void
+XPLMGetMouseLocationGlobal(int *x, int *y)
+{
+	if (x != NULL)
+		*x = mouse_x;
+	if (y != NULL)
+		*y = mouse_y;
+}
+
+void
+XPLMGetScreenSize(int *w, int *h)
+{
+	fake_dr_t *vp = sim_dr("sim/graphics/view/viewport");
+
+	sim_dr_grow(vp, 4);
+	if (w != NULL)
+		*w = vp->values[2];
+	if (h != NULL)
+		*h = vp->values[3];
+}
+
+void
+XPLMRegisterFlightLoopCallback(XPLMFlightLoop_f cb, float interval,
+    void *refcon)
+{
+	UNUSED(cb);
+	UNUSED(interval);
+	UNUSED(refcon);
+}
+
+void
+XPLMUnregisterFlightLoopCallback(XPLMFlightLoop_f cb, void *refcon)
+{
+	UNUSED(cb);
+	UNUSED(refcon);
+}
+
+int
+XPLMGetCycleNumber(void)
+{
+	return (0);
+}
+
+/*
+ * XPLMDataAccess
+ */
+XPLMDataRef
+XPLMFindDataRef(const char *name)
+{
+	return (sim_dr(name));
+}
+
+int
+XPLMCanWriteDataRef(XPLMDataRef ref)
+{
+	return (((fake_dr_t *)ref)->writable);
+}
+
+int
+XPLMIsDataRefGood(XPLMDataRef ref)
+{
+	return (ref != NULL);
+}
+
+XPLMDataTypeID
+XPLMGetDataRefTypes(XPLMDataRef ref)
+{
+	return (((fake_dr_t *)ref)->type);
+}
+
+int
+XPLMGetDatai(XPLMDataRef ref)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered)
+		return (dr->get_i != NULL ? dr->get_i(dr->read_refcon) : 0);
+	return (dr->n_values != 0 ? dr->values[0] : 0);
+}
+
+void
+XPLMSetDatai(XPLMDataRef ref, int value)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered) {
+		if (dr->set_i != NULL)
+			dr->set_i(dr->write_refcon, value);
+	} else {
+		sim_dr_grow(dr, 1);
+		dr->values[0] = value;
+	}
+}
+
+float
+XPLMGetDataf(XPLMDataRef ref)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered)
+		return (dr->get_f != NULL ? dr->get_f(dr->read_refcon) : 0);
+	return (dr->n_values != 0 ? dr->values[0] : 0);
+}
+
+void
+XPLMSetDataf(XPLMDataRef ref, float value)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered) {
+		if (dr->set_f != NULL)
+			dr->set_f(dr->write_refcon, value);
+	} else {
+		sim_dr_grow(dr, 1);
+		dr->values[0] = value;
+	}
+}
+
+double
+XPLMGetDatad(XPLMDataRef ref)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered)
+		return (dr->get_d != NULL ? dr->get_d(dr->read_refcon) : 0);
+	return (dr->n_values != 0 ? dr->values[0] : 0);
+}
+
+void
+XPLMSetDatad(XPLMDataRef ref, double value)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered) {
+		if (dr->set_d != NULL)
+			dr->set_d(dr->write_refcon, value);
+	} else {
+		sim_dr_grow(dr, 1);
+		dr->values[0] = value;
+	}
+}
+
+int
+XPLMGetDatavi(XPLMDataRef ref, int *values, int off, int n)
+{
+	fake_dr_t *dr = ref;
+	int count;
+
+	if (dr->registered) {
+		return (dr->get_vi != NULL ?
+		    dr->get_vi(dr->read_refcon, values, off, n) : 0);
+	}
+	if (values == NULL)
+		return (dr->n_values);
+	count = MAX(MIN(n, (int)dr->n_values - off), 0);
+	for (int i = 0; i < count; i++)
+		values[i] = dr->values[off + i];
+	return (count);
+}
+
+void
+XPLMSetDatavi(XPLMDataRef ref, int *values, int off, int n)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered) {
+		if (dr->set_vi != NULL)
+			dr->set_vi(dr->write_refcon, values, off, n);
+		return;
+	}
+	sim_dr_grow(dr, off + n);
+	for (int i = 0; i < n; i++)
+		dr->values[off + i] = values[i];
+}
+
+int
+XPLMGetDatavf(XPLMDataRef ref, float *values, int off, int n)
+{
+	fake_dr_t *dr = ref;
+	int count;
+
+	if (dr->registered) {
+		return (dr->get_vf != NULL ?
+		    dr->get_vf(dr->read_refcon, values, off, n) : 0);
+	}
+	if (values == NULL)
+		return (dr->n_values);
+	count = MAX(MIN(n, (int)dr->n_values - off), 0);
+	if (count > 0)
+		memcpy(values, &dr->values[off], count * sizeof (*values));
+	return (count);
+}
+
+void
+XPLMSetDatavf(XPLMDataRef ref, float *values, int off, int n)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered) {
+		if (dr->set_vf != NULL)
+			dr->set_vf(dr->write_refcon, values, off, n);
+		return;
+	}
+	sim_dr_grow(dr, off + n);
+	memcpy(&dr->values[off], values, n * sizeof (*values));
+}
+
+int
+XPLMGetDatab(XPLMDataRef ref, void *value, int off, int n)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered && dr->get_b != NULL)
+		return (dr->get_b(dr->read_refcon, value, off, n));
+	return (0);
+}
+
+void
+XPLMSetDatab(XPLMDataRef ref, void *value, int off, int n)
+{
+	fake_dr_t *dr = ref;
+
+	if (dr->registered && dr->set_b != NULL)
+		dr->set_b(dr->write_refcon, value, off, n);
+}
+
+XPLMDataRef
+XPLMRegisterDataAccessor(const char *name, XPLMDataTypeID type,
+    int writable, XPLMGetDatai_f get_i, XPLMSetDatai_f set_i,
+    XPLMGetDataf_f get_f, XPLMSetDataf_f set_f, XPLMGetDatad_f get_d,
+    XPLMSetDatad_f set_d, XPLMGetDatavi_f get_vi, XPLMSetDatavi_f set_vi,
+    XPLMGetDatavf_f get_vf, XPLMSetDatavf_f set_vf, XPLMGetDatab_f get_b,
+    XPLMSetDatab_f set_b, void *read_refcon, void *write_refcon)
+{
+	fake_dr_t *dr = dr_add(name);
+
+	dr->registered = true;
+	dr->type = type;
+	dr->writable = writable;
+	dr->get_i = get_i;
+	dr->set_i = set_i;
+	dr->get_f = get_f;
+	dr->set_f = set_f;
+	dr->get_d = get_d;
+	dr->set_d = set_d;
+	dr->get_vi = get_vi;
+	dr->set_vi = set_vi;
+	dr->get_vf = get_vf;
+	dr->set_vf = set_vf;
+	dr->get_b = get_b;
+	dr->set_b = set_b;
+	dr->read_refcon = read_refcon;
+	dr->write_refcon = write_refcon;
+
+	return (dr);
+}
+
+void
+XPLMUnregisterDataAccessor(XPLMDataRef ref)
+{
+	for (unsigned i = 0; i < n_drs; i++) {
+		if (drs[i] == ref) {
+			free(drs[i]->values);
+			free(drs[i]);
+			memmove(&drs[i], &drs[i + 1],
+			    (n_drs - i - 1) * sizeof (*drs));
+			n_drs--;
+			return;
+		}
+	}
+}
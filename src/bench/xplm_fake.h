@@ -0,0 +1,57 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_XPLM_FAKE_H_
+#define	_XPLM_FAKE_H_
+
+#include <stdbool.h>
+
+#include <XPLMDisplay.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimal stand-in for the X-Plane plugin API, just enough to host the
+ * manipdraw plugin outside of the sim. Sim datarefs are simple value
+ * stores which any XPLMFindDataRef() call creates on demand, so the
+ * benchmark can feed in whatever a recording contains. Datarefs which
+ * the plugin registers itself go through its accessors as usual.
+ */
+void fake_init(const char *plugin_path);
+void fake_fini(void);
+
+void fake_set_mouse(int x, int y);
+void fake_set_dr(const char *name, unsigned idx, float value);
+void fake_set_drv(const char *name, const float *values, unsigned n);
+bool fake_get_dr_i(const char *name, int *value);
+bool fake_set_dr_i(const char *name, int value);
+
+void fake_draw(XPLMDrawingPhase phase);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _XPLM_FAKE_H_ */
@@ -0,0 +1,1159 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "bvh.h"
+#include "taskpool.h"
+
+#define	BVH_BINS		16
+#define	BVH_LEAF_TRIS		4
+#define	BVH_MAX_LEAF_TRIS	16
+#define	BVH_STACK_DEPTH		64
+/* keeps traversal within the fixed-size stack, even for skewed trees */
+#define	BVH_MAX_DEPTH		(BVH_STACK_DEPTH - 2)
+#define	RAY_EPSILON		1e-7f
+/* ranges smaller than this are built serially on a pool worker */
+#define	PAR_MIN_PRIMS		4096
+#define	PAR_CHUNK_PRIMS		1024	/* binned per task */
+#define	PAR_MAX_CHUNKS		32
+/*
+ * Once refitting has grown the total surface area of the top-level tree
+ * by this factor over what it was right after it was built, we rebuild
+ * it in the background.
+ */
+#define	TLAS_MAX_DEGRADATION	1.5
+
+/*
+ * Nodes are stored depth-first, so an inner node's left child always
+ * immediately follows it and only the right child's index is stored.
+ * This keeps nodes at 32 bytes, two per cache line.
+ */
+typedef struct {
+	float		min[3];
+	float		max[3];
+	uint32_t	off;	/* inner: right child index, leaf: first ref */
+	uint32_t	n_prims;	/* 0 for inner nodes */
+} bvh_node_t;
+
+_Static_assert(sizeof (bvh_node_t) == 32, "bvh_node_t must be 32 bytes");
+
+typedef struct {
+	vec3		v0;
+	vec3		e1;
+	vec3		e2;
+	uint32_t	manip;
+} bvh_tri_t;
+
+/*
+ * All triangles hanging under one animation node. The group's tree is
+ * static in the node's local space, while its object-space bounds and
+ * inverse transform follow the animation.
+ */
+typedef struct {
+	uint32_t	anim;		/* or MGEOM_ANIM_NONE */
+	uint32_t	root;		/* index into bvh_t.nodes */
+	mgeom_aabb_t	local_bounds;
+	mgeom_aabb_t	bounds;		/* object space, empty if hidden */
+	mat4		inv_xform;	/* object -> local space */
+} bvh_group_t;
+
+/*
+ * The top-level tree over all groups, with exactly one group per leaf.
+ * This is the part which gets refitted as animations move.
+ */
+typedef struct {
+	uint32_t	n_nodes;
+	bvh_node_t	*nodes;
+	uint32_t	*refs;		/* leaf ref -> group index */
+	uint32_t	*parents;	/* node -> parent, UINT32_MAX at root */
+	uint32_t	*leaf_of;	/* group -> leaf node */
+	double		build_area;	/* total node area after build */
+	double		area;		/* current total node area */
+} tlas_t;
+
+struct bvh_s {
+	unsigned	n_groups;
+	bvh_group_t	*groups;
+	unsigned	n_nodes;
+	bvh_node_t	*nodes;
+	unsigned	n_tris;
+	bvh_tri_t	*tris;
+
+	tlas_t		*tlas;
+	uint64_t	geom_update_num;
+
+	mutex_t		lock;
+	bool		rebuilding;
+	thread_t	rebuild_thr;
+	mgeom_aabb_t	*rebuild_bounds;
+	tlas_t		*rebuild_result;	/* protected by lock */
+};
+
+/*
+ * Generic binned SAH builder, shared by the per-group trees and the
+ * top-level tree. It works on an array of primitive references, which
+ * it reorders so that every leaf covers a contiguous range of them.
+ */
+typedef struct {
+	const mgeom_aabb_t	*prim_bounds;
+	const vec3		*centroids;
+	uint32_t		*refs;
+	bvh_node_t		*nodes;
+	uint32_t		n_nodes;
+	unsigned		leaf_prims;	/* make leaf at or below this */
+	unsigned		max_leaf_prims;
+} build_t;
+
+static inline float
+dot3(const float a[3], const float b[3])
+{
+	return (a[0] * b[0] + a[1] * b[1] + a[2] * b[2]);
+}
+
+static inline void
+cross3(const float a[3], const float b[3], float out[3])
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static inline void
+sub3(const float a[3], const float b[3], float out[3])
+{
+	out[0] = a[0] - b[0];
+	out[1] = a[1] - b[1];
+	out[2] = a[2] - b[2];
+}
+
+static inline float
+aabb_area(const mgeom_aabb_t *aabb)
+{
+	float dx, dy, dz;
+
+	if (mgeom_aabb_is_empty(aabb))
+		return (0);
+	dx = aabb->max[0] - aabb->min[0];
+	dy = aabb->max[1] - aabb->min[1];
+	dz = aabb->max[2] - aabb->min[2];
+	return (2 * (dx * dy + dy * dz + dz * dx));
+}
+
+static inline void
+node_get_bounds(const bvh_node_t *node, mgeom_aabb_t *aabb)
+{
+	memcpy(aabb->min, node->min, sizeof (aabb->min));
+	memcpy(aabb->max, node->max, sizeof (aabb->max));
+}
+
+static inline void
+node_set_bounds(bvh_node_t *node, const mgeom_aabb_t *aabb)
+{
+	memcpy(node->min, aabb->min, sizeof (node->min));
+	memcpy(node->max, aabb->max, sizeof (node->max));
+}
+
+static inline float
+node_area(const bvh_node_t *node)
+{
+	mgeom_aabb_t aabb;
+
+	node_get_bounds(node, &aabb);
+	return (aabb_area(&aabb));
+}
+
+static void
+aabb_centroid(const mgeom_aabb_t *aabb, vec3 c)
+{
+	for (int i = 0; i < 3; i++) {
+		c[i] = (mgeom_aabb_is_empty(aabb) ? 0 :
+		    (aabb->min[i] + aabb->max[i]) / 2);
+	}
+}
+
+static inline int
+bin_of(float c, float lo, float scale)
+{
+	return (clampi((c - lo) * scale, 0, BVH_BINS - 1));
+}
+
+/*
+ * Primitive counts and bounds per bin along each axis, gathered over a
+ * range of references.
+ */
+typedef struct {
+	unsigned	cnt[3][BVH_BINS];
+	mgeom_aabb_t	bounds[3][BVH_BINS];
+} bins_t;
+
+static void
+bins_clear(bins_t *bins)
+{
+	memset(bins->cnt, 0, sizeof (bins->cnt));
+	for (int axis = 0; axis < 3; axis++) {
+		for (int i = 0; i < BVH_BINS; i++)
+			mgeom_aabb_clear(&bins->bounds[axis][i]);
+	}
+}
+
+/*
+ * Bins [start, end) along all three axes, over the centroid bounds
+ * `cbounds' of the whole range being split.
+ */
+static void
+bins_fill(const build_t *b, uint32_t start, uint32_t end,
+    const mgeom_aabb_t *cbounds, bins_t *bins)
+{
+	float lo[3], scale[3];
+
+	for (int axis = 0; axis < 3; axis++) {
+		float ext = cbounds->max[axis] - cbounds->min[axis];
+
+		lo[axis] = cbounds->min[axis];
+		scale[axis] = (ext > 0 ? BVH_BINS / ext : 0);
+	}
+	for (uint32_t i = start; i < end; i++) {
+		uint32_t ref = b->refs[i];
+
+		for (int axis = 0; axis < 3; axis++) {
+			int bin;
+
+			if (scale[axis] == 0)
+				continue;
+			bin = bin_of(b->centroids[ref][axis], lo[axis],
+			    scale[axis]);
+			bins->cnt[axis][bin]++;
+			mgeom_aabb_add_aabb(&bins->bounds[axis][bin],
+			    &b->prim_bounds[ref]);
+		}
+	}
+}
+
+static void
+bins_merge(bins_t *bins, const bins_t *other)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		for (int i = 0; i < BVH_BINS; i++) {
+			bins->cnt[axis][i] += other->cnt[axis][i];
+			mgeom_aabb_add_aabb(&bins->bounds[axis][i],
+			    &other->bounds[axis][i]);
+		}
+	}
+}
+
+/*
+ * Picks the cheapest split between bins. Returns false if a leaf over
+ * all `n' primitives in `bounds' is cheaper than any split.
+ */
+static bool
+bins_best_split(const bins_t *bins, const mgeom_aabb_t *cbounds,
+    uint32_t n, const mgeom_aabb_t *bounds, int *axis_p, float *split_p)
+{
+	float best_cost = n * aabb_area(bounds);
+	bool found = false;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float lo = cbounds->min[axis], hi = cbounds->max[axis];
+		mgeom_aabb_t acc;
+		float right_area[BVH_BINS];
+		unsigned right_cnt[BVH_BINS];
+		unsigned left_cnt = 0;
+		float scale;
+
+		if (hi - lo <= 0)
+			continue;
+		scale = BVH_BINS / (hi - lo);
+		mgeom_aabb_clear(&acc);
+		for (int i = BVH_BINS - 1; i > 0; i--) {
+			mgeom_aabb_add_aabb(&acc, &bins->bounds[axis][i]);
+			right_area[i] = aabb_area(&acc);
+			right_cnt[i] = bins->cnt[axis][i] +
+			    (i + 1 < BVH_BINS ? right_cnt[i + 1] : 0);
+		}
+		mgeom_aabb_clear(&acc);
+		for (int i = 0; i + 1 < BVH_BINS; i++) {
+			float cost;
+
+			mgeom_aabb_add_aabb(&acc, &bins->bounds[axis][i]);
+			left_cnt += bins->cnt[axis][i];
+			if (left_cnt == 0 || right_cnt[i + 1] == 0)
+				continue;
+			cost = left_cnt * aabb_area(&acc) +
+			    right_cnt[i + 1] * right_area[i + 1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				*axis_p = axis;
+				*split_p = lo + (i + 1) / scale;
+				found = true;
+			}
+		}
+	}
+	return (found);
+}
+
+/*
+ * Finds the best binned SAH split of [start, end). Returns false if a
+ * leaf is cheaper than any split we could find.
+ */
+static bool
+find_split(const build_t *b, uint32_t start, uint32_t end,
+    const mgeom_aabb_t *bounds, int *axis_p, float *split_p)
+{
+	mgeom_aabb_t cbounds;
+	bins_t bins;
+
+	mgeom_aabb_clear(&cbounds);
+	for (uint32_t i = start; i < end; i++)
+		mgeom_aabb_add_pt(&cbounds, b->centroids[b->refs[i]]);
+	bins_clear(&bins);
+	bins_fill(b, start, end, &cbounds, &bins);
+
+	return (bins_best_split(&bins, &cbounds, end - start, bounds,
+	    axis_p, split_p));
+}
+
+/*
+ * Reorders [start, end) so that everything left of the split comes
+ * first. Returns the start of the right side.
+ */
+static uint32_t
+partition(build_t *b, uint32_t start, uint32_t end, int axis, float split)
+{
+	uint32_t i = start, j = end;
+
+	while (i < j) {
+		if (b->centroids[b->refs[i]][axis] < split) {
+			i++;
+		} else {
+			uint32_t tmp = b->refs[i];
+
+			b->refs[i] = b->refs[--j];
+			b->refs[j] = tmp;
+		}
+	}
+	return (i);
+}
+
+static uint32_t
+build_node(build_t *b, uint32_t start, uint32_t end, unsigned depth)
+{
+	uint32_t idx = b->n_nodes++;
+	bvh_node_t *node = &b->nodes[idx];
+	mgeom_aabb_t bounds;
+	uint32_t mid;
+	int axis = 0;
+	float split = 0;
+
+	ASSERT3U(start, <, end);
+	mgeom_aabb_clear(&bounds);
+	for (uint32_t i = start; i < end; i++)
+		mgeom_aabb_add_aabb(&bounds, &b->prim_bounds[b->refs[i]]);
+	node_set_bounds(node, &bounds);
+
+	if (end - start <= b->leaf_prims || depth == BVH_MAX_DEPTH ||
+	    !find_split(b, start, end, &bounds, &axis, &split)) {
+		if (end - start <= b->max_leaf_prims ||
+		    depth == BVH_MAX_DEPTH) {
+			node->off = start;
+			node->n_prims = end - start;
+			return (idx);
+		}
+		/* degenerate centroids, just split down the middle */
+		mid = start + (end - start) / 2;
+	} else {
+		mid = partition(b, start, end, axis, split);
+		if (mid == start || mid == end)
+			mid = start + (end - start) / 2;
+	}
+	VERIFY3U(build_node(b, start, mid, depth + 1), ==, idx + 1);
+	b->nodes[idx].off = build_node(b, mid, end, depth + 1);
+	b->nodes[idx].n_prims = 0;
+
+	return (idx);
+}
+
+/*
+ * Parallel build. The upper levels of big trees are split on the
+ * building thread, with the binning for each split spread over the
+ * task pool in chunks. Once a range is small enough, it becomes a part
+ * of its own, which a worker then builds serially into a private node
+ * array. When everything is done, the parts get stitched together into
+ * the usual depth-first layout.
+ */
+typedef struct part_s {
+	uint32_t	start;
+	uint32_t	end;
+	unsigned	depth;
+	bool		split;		/* inner node with `child' below */
+	bvh_node_t	node;		/* bounds of an inner node */
+	struct part_s	*child[2];
+	build_t		b;		/* serially built subtree */
+} part_t;
+
+typedef struct {
+	taskpool_t		*tp;
+	taskpool_group_t	grp;	/* subtree builds */
+	build_t			proto;	/* inputs shared by all parts */
+} par_build_t;
+
+typedef struct {
+	const build_t	*b;
+	uint32_t	start;
+	uint32_t	end;
+	mgeom_aabb_t	bounds;
+	mgeom_aabb_t	cbounds;
+	bins_t		bins;
+} chunk_t;
+
+static void
+chunk_bounds_task(void *arg)
+{
+	chunk_t *chunk = arg;
+	const build_t *b = chunk->b;
+
+	mgeom_aabb_clear(&chunk->bounds);
+	mgeom_aabb_clear(&chunk->cbounds);
+	for (uint32_t i = chunk->start; i < chunk->end; i++) {
+		uint32_t ref = b->refs[i];
+
+		mgeom_aabb_add_aabb(&chunk->bounds, &b->prim_bounds[ref]);
+		mgeom_aabb_add_pt(&chunk->cbounds, b->centroids[ref]);
+	}
+}
+
+/* chunk->cbounds holds the centroid bounds of the whole range here */
+static void
+chunk_bins_task(void *arg)
+{
+	chunk_t *chunk = arg;
+
+	bins_clear(&chunk->bins);
+	bins_fill(chunk->b, chunk->start, chunk->end, &chunk->cbounds,
+	    &chunk->bins);
+}
+
+/*
+ * find_split() for big ranges, with the bounds and the bins gathered
+ * in parallel. Also returns the bounds of the range.
+ */
+static bool
+find_split_par(par_build_t *par, uint32_t start, uint32_t end,
+    mgeom_aabb_t *bounds, int *axis_p, float *split_p)
+{
+	uint32_t n = end - start;
+	unsigned n_chunks = clampi(n / PAR_CHUNK_PRIMS, 1, PAR_MAX_CHUNKS);
+	chunk_t *chunks = safe_calloc(n_chunks, sizeof (*chunks));
+	taskpool_group_t grp;
+	mgeom_aabb_t cbounds;
+	bins_t *bins = &chunks[0].bins;
+	bool found;
+
+	taskpool_group_init(&grp);
+	for (unsigned i = 0; i < n_chunks; i++) {
+		chunks[i].b = &par->proto;
+		chunks[i].start = start + (uint64_t)n * i / n_chunks;
+		chunks[i].end = start + (uint64_t)n * (i + 1) / n_chunks;
+		taskpool_submit(par->tp, &grp, chunk_bounds_task, &chunks[i]);
+	}
+	taskpool_wait(par->tp, &grp);
+	mgeom_aabb_clear(bounds);
+	mgeom_aabb_clear(&cbounds);
+	for (unsigned i = 0; i < n_chunks; i++) {
+		mgeom_aabb_add_aabb(bounds, &chunks[i].bounds);
+		mgeom_aabb_add_aabb(&cbounds, &chunks[i].cbounds);
+	}
+	for (unsigned i = 0; i < n_chunks; i++) {
+		chunks[i].cbounds = cbounds;
+		taskpool_submit(par->tp, &grp, chunk_bins_task, &chunks[i]);
+	}
+	taskpool_wait(par->tp, &grp);
+	for (unsigned i = 1; i < n_chunks; i++)
+		bins_merge(bins, &chunks[i].bins);
+	found = bins_best_split(bins, &cbounds, n, bounds, axis_p, split_p);
+	free(chunks);
+
+	return (found);
+}
+
+static void
+subtree_task(void *arg)
+{
+	part_t *part = arg;
+
+	build_node(&part->b, part->start, part->end, part->depth);
+}
+
+static part_t *
+build_par(par_build_t *par, uint32_t start, uint32_t end, unsigned depth)
+{
+	part_t *part = safe_calloc(1, sizeof (*part));
+	mgeom_aabb_t bounds;
+	int axis = 0;
+	float split = 0;
+
+	ASSERT3U(start, <, end);
+	part->start = start;
+	part->end = end;
+	part->depth = depth;
+
+	if (par->tp != NULL && end - start >= PAR_MIN_PRIMS &&
+	    depth < BVH_MAX_DEPTH &&
+	    find_split_par(par, start, end, &bounds, &axis, &split)) {
+		uint32_t mid = partition(&par->proto, start, end, axis, split);
+
+		if (mid != start && mid != end) {
+			part->split = true;
+			node_set_bounds(&part->node, &bounds);
+			part->child[0] = build_par(par, start, mid, depth + 1);
+			part->child[1] = build_par(par, mid, end, depth + 1);
+			return (part);
+		}
+	}
+	part->b = par->proto;
+	part->b.nodes = safe_calloc(2 * (end - start), sizeof (bvh_node_t));
+	part->b.n_nodes = 0;
+	taskpool_submit(par->tp, &par->grp, subtree_task, part);
+
+	return (part);
+}
+
+/*
+ * Appends the part's nodes to `nodes' in depth-first order and frees
+ * it. Returns the index of its root node.
+ */
+static uint32_t
+part_flatten(part_t *part, bvh_node_t *nodes, uint32_t *n_nodes)
+{
+	uint32_t idx = *n_nodes;
+
+	if (part->split) {
+		nodes[idx] = part->node;
+		nodes[idx].n_prims = 0;
+		(*n_nodes)++;
+		VERIFY3U(part_flatten(part->child[0], nodes, n_nodes), ==,
+		    idx + 1);
+		nodes[idx].off = part_flatten(part->child[1], nodes, n_nodes);
+	} else {
+		for (uint32_t i = 0; i < part->b.n_nodes; i++) {
+			bvh_node_t *node = &nodes[idx + i];
+
+			*node = part->b.nodes[i];
+			if (node->n_prims == 0)
+				node->off += idx;
+		}
+		*n_nodes += part->b.n_nodes;
+		free(part->b.nodes);
+	}
+	free(part);
+
+	return (idx);
+}
+
+static double
+total_area(const bvh_node_t *nodes, uint32_t n_nodes)
+{
+	double area = 0;
+
+	for (uint32_t i = 0; i < n_nodes; i++)
+		area += node_area(&nodes[i]);
+	return (area);
+}
+
+static void
+tlas_free(tlas_t *tlas)
+{
+	if (tlas == NULL)
+		return;
+	free(tlas->nodes);
+	free(tlas->refs);
+	free(tlas->parents);
+	free(tlas->leaf_of);
+	free(tlas);
+}
+
+/*
+ * Builds the top-level tree over the object-space group bounds. This
+ * only reads its arguments, so it can run on a worker thread.
+ */
+static tlas_t *
+tlas_build(const mgeom_aabb_t *bounds, unsigned n_groups)
+{
+	tlas_t *tlas = safe_calloc(1, sizeof (*tlas));
+	vec3 *centroids = safe_calloc(MAX(n_groups, 1), sizeof (*centroids));
+	build_t b = {
+	    .prim_bounds = bounds,
+	    .centroids = (const vec3 *)centroids,
+	    .leaf_prims = 1,
+	    .max_leaf_prims = 1
+	};
+
+	tlas->nodes = safe_calloc(MAX(2 * n_groups, 1),
+	    sizeof (*tlas->nodes));
+	tlas->refs = safe_calloc(MAX(n_groups, 1), sizeof (*tlas->refs));
+	tlas->parents = safe_calloc(MAX(2 * n_groups, 1),
+	    sizeof (*tlas->parents));
+	tlas->leaf_of = safe_calloc(MAX(n_groups, 1),
+	    sizeof (*tlas->leaf_of));
+	if (n_groups == 0) {
+		free(centroids);
+		return (tlas);
+	}
+	for (unsigned i = 0; i < n_groups; i++) {
+		aabb_centroid(&bounds[i], centroids[i]);
+		tlas->refs[i] = i;
+	}
+	b.refs = tlas->refs;
+	b.nodes = tlas->nodes;
+	build_node(&b, 0, n_groups, 0);
+	tlas->n_nodes = b.n_nodes;
+	free(centroids);
+
+	tlas->parents[0] = UINT32_MAX;
+	for (uint32_t i = 0; i < tlas->n_nodes; i++) {
+		const bvh_node_t *node = &tlas->nodes[i];
+
+		if (node->n_prims != 0) {
+			ASSERT3U(node->n_prims, ==, 1);
+			tlas->leaf_of[tlas->refs[node->off]] = i;
+		} else {
+			tlas->parents[i + 1] = i;
+			tlas->parents[node->off] = i;
+		}
+	}
+	tlas->build_area = tlas->area = total_area(tlas->nodes,
+	    tlas->n_nodes);
+
+	return (tlas);
+}
+
+/*
+ * Builds the BVH over all manipulator triangles in `geom'. Triangles are
+ * stored in their animation node's local space, so the animation state
+ * at build time doesn't matter. The top-level tree is built on the
+ * first bvh_update(). If `tp' isn't NULL, the groups' trees are built
+ * in parallel on it, otherwise serially on the calling thread. The
+ * resulting tree is the same either way.
+ */
+bvh_t *
+bvh_build(const mgeom_t *geom, taskpool_t *tp)
+{
+	bvh_t *bvh = safe_calloc(1, sizeof (*bvh));
+	uint32_t *group_of_anim, *group_start, *fill;
+	mgeom_aabb_t *tri_bounds;
+	vec3 *centroids;
+	bvh_tri_t *tris;
+	par_build_t par = { .tp = tp };
+	build_t *b = &par.proto;
+	part_t **parts;
+	uint32_t none_slot, n_nodes = 0;
+
+	ASSERT(geom != NULL);
+
+	mutex_init(&bvh->lock);
+	bvh->n_tris = geom->n_idx / 3;
+	tris = safe_calloc(MAX(bvh->n_tris, 1), sizeof (*tris));
+	bvh->nodes = safe_calloc(MAX(2 * bvh->n_tris, 1),
+	    sizeof (*bvh->nodes));
+	tri_bounds = safe_calloc(MAX(bvh->n_tris, 1), sizeof (*tri_bounds));
+	centroids = safe_calloc(MAX(bvh->n_tris, 1), sizeof (*centroids));
+	/*
+	 * Assign every animation node which has geometry under it a group
+	 * and lay out the triangles so that each group is contiguous.
+	 */
+	none_slot = geom->n_anims;
+	group_of_anim = safe_malloc((geom->n_anims + 1) *
+	    sizeof (*group_of_anim));
+	memset(group_of_anim, 0xff, (geom->n_anims + 1) *
+	    sizeof (*group_of_anim));
+	bvh->groups = safe_calloc(geom->n_anims + 1, sizeof (*bvh->groups));
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+		uint32_t slot = (span->anim == MGEOM_ANIM_NONE ? none_slot :
+		    span->anim);
+
+		if (group_of_anim[slot] == UINT32_MAX) {
+			group_of_anim[slot] = bvh->n_groups;
+			bvh->groups[bvh->n_groups++].anim = span->anim;
+		}
+	}
+	group_start = safe_calloc(bvh->n_groups + 1, sizeof (*group_start));
+	fill = safe_calloc(MAX(bvh->n_groups, 1), sizeof (*fill));
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+		uint32_t slot = (span->anim == MGEOM_ANIM_NONE ? none_slot :
+		    span->anim);
+
+		group_start[group_of_anim[slot] + 1] += span->len / 3;
+	}
+	for (unsigned i = 0; i < bvh->n_groups; i++)
+		group_start[i + 1] += group_start[i];
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+		uint32_t slot = (span->anim == MGEOM_ANIM_NONE ? none_slot :
+		    span->anim);
+		uint32_t g = group_of_anim[slot];
+
+		for (unsigned j = 0; j < span->len; j += 3) {
+			uint32_t t = group_start[g] + fill[g]++;
+			bvh_tri_t *tri = &tris[t];
+			const float *v[3];
+
+			for (int k = 0; k < 3; k++)
+				v[k] = geom->vtx[geom->idx[span->off + j + k]];
+			memcpy(tri->v0, v[0], sizeof (tri->v0));
+			sub3(v[1], v[0], tri->e1);
+			sub3(v[2], v[0], tri->e2);
+			tri->manip = span->manip;
+			mgeom_aabb_clear(&tri_bounds[t]);
+			for (int k = 0; k < 3; k++)
+				mgeom_aabb_add_pt(&tri_bounds[t], v[k]);
+			for (int k = 0; k < 3; k++) {
+				centroids[t][k] = (v[0][k] + v[1][k] +
+				    v[2][k]) / 3;
+			}
+		}
+	}
+
+	b->prim_bounds = tri_bounds;
+	b->centroids = (const vec3 *)centroids;
+	b->refs = safe_calloc(MAX(bvh->n_tris, 1), sizeof (*b->refs));
+	b->leaf_prims = BVH_LEAF_TRIS;
+	b->max_leaf_prims = BVH_MAX_LEAF_TRIS;
+	for (unsigned i = 0; i < bvh->n_tris; i++)
+		b->refs[i] = i;
+	/*
+	 * Groups occupy disjoint ranges of the references, so they can
+	 * all be built at the same time.
+	 */
+	taskpool_group_init(&par.grp);
+	parts = safe_calloc(MAX(bvh->n_groups, 1), sizeof (*parts));
+	for (unsigned i = 0; i < bvh->n_groups; i++) {
+		ASSERT3U(group_start[i + 1], >, group_start[i]);
+		parts[i] = build_par(&par, group_start[i], group_start[i + 1],
+		    0);
+	}
+	taskpool_wait(tp, &par.grp);
+	for (unsigned i = 0; i < bvh->n_groups; i++) {
+		bvh_group_t *group = &bvh->groups[i];
+
+		group->root = part_flatten(parts[i], bvh->nodes, &n_nodes);
+		node_get_bounds(&bvh->nodes[group->root],
+		    &group->local_bounds);
+		group->bounds = group->local_bounds;
+		glm_mat4_identity(group->inv_xform);
+	}
+	bvh->n_nodes = n_nodes;
+	/* put the triangles in leaf order */
+	bvh->tris = safe_calloc(MAX(bvh->n_tris, 1), sizeof (*bvh->tris));
+	for (unsigned i = 0; i < bvh->n_tris; i++)
+		bvh->tris[i] = tris[b->refs[i]];
+
+	free(parts);
+	free(b->refs);
+	free(group_start);
+	free(fill);
+	free(group_of_anim);
+	free(tri_bounds);
+	free(centroids);
+	free(tris);
+
+	return (bvh);
+}
+
+/*
+ * Number of nodes in the per-group trees, not counting the top-level
+ * tree, which changes size with rebuilds.
+ */
+unsigned
+bvh_get_num_nodes(const bvh_t *bvh)
+{
+	ASSERT(bvh != NULL);
+	return (bvh->n_nodes);
+}
+
+void
+bvh_free(bvh_t *bvh)
+{
+	if (bvh == NULL)
+		return;
+	if (bvh->rebuilding) {
+		thread_join(&bvh->rebuild_thr);
+		tlas_free(bvh->rebuild_result);
+		free(bvh->rebuild_bounds);
+	}
+	mutex_destroy(&bvh->lock);
+	tlas_free(bvh->tlas);
+	free(bvh->groups);
+	free(bvh->nodes);
+	free(bvh->tris);
+	free(bvh);
+}
+
+static void
+rebuild_worker(void *arg)
+{
+	bvh_t *bvh = arg;
+	tlas_t *tlas;
+
+	thread_set_name("manipdraw_bvh");
+	tlas = tlas_build(bvh->rebuild_bounds, bvh->n_groups);
+	mutex_enter(&bvh->lock);
+	bvh->rebuild_result = tlas;
+	mutex_exit(&bvh->lock);
+}
+
+static void
+rebuild_start(bvh_t *bvh)
+{
+	ASSERT(!bvh->rebuilding);
+	bvh->rebuild_bounds = safe_calloc(MAX(bvh->n_groups, 1),
+	    sizeof (*bvh->rebuild_bounds));
+	for (unsigned i = 0; i < bvh->n_groups; i++)
+		bvh->rebuild_bounds[i] = bvh->groups[i].bounds;
+	bvh->rebuild_result = NULL;
+	bvh->rebuilding = true;
+	VERIFY(thread_create(&bvh->rebuild_thr, rebuild_worker, bvh));
+}
+
+/*
+ * Swaps in a finished background rebuild. Returns true if it did, in
+ * which case the new tree's bounds are as of when the rebuild started
+ * and need a full refit.
+ */
+static bool
+rebuild_finish(bvh_t *bvh)
+{
+	tlas_t *tlas;
+
+	if (!bvh->rebuilding)
+		return (false);
+	mutex_enter(&bvh->lock);
+	tlas = bvh->rebuild_result;
+	mutex_exit(&bvh->lock);
+	if (tlas == NULL)
+		return (false);
+	thread_join(&bvh->rebuild_thr);
+	tlas_free(bvh->tlas);
+	bvh->tlas = tlas;
+	free(bvh->rebuild_bounds);
+	bvh->rebuild_bounds = NULL;
+	bvh->rebuild_result = NULL;
+	bvh->rebuilding = false;
+
+	return (true);
+}
+
+static void
+tlas_refit_node(tlas_t *tlas, uint32_t idx, const bvh_group_t *groups)
+{
+	bvh_node_t *node = &tlas->nodes[idx];
+	mgeom_aabb_t bounds;
+
+	tlas->area -= node_area(node);
+	if (node->n_prims != 0) {
+		bounds = groups[tlas->refs[node->off]].bounds;
+	} else {
+		mgeom_aabb_t child;
+
+		node_get_bounds(&tlas->nodes[idx + 1], &bounds);
+		node_get_bounds(&tlas->nodes[node->off], &child);
+		mgeom_aabb_add_aabb(&bounds, &child);
+	}
+	node_set_bounds(node, &bounds);
+	tlas->area += node_area(node);
+}
+
+/*
+ * Brings the BVH in line with the current animation state of `geom'.
+ * Must be called after every mgeom_update() before using bvh_cast().
+ * Only groups whose animation node changed get refitted, along with
+ * their path to the root of the top-level tree. If refitting has made
+ * the top-level tree too loose, we rebuild it in the background and
+ * keep using the refitted one until the new one is ready.
+ */
+void
+bvh_update(bvh_t *bvh, const mgeom_t *geom)
+{
+	uint64_t prev_update_num;
+	bool all;
+
+	ASSERT(bvh != NULL);
+	ASSERT(geom != NULL);
+
+	if (bvh->geom_update_num == geom->update_num)
+		return;
+	/*
+	 * The animation generations also cover any updates we've missed
+	 * (e.g. because the BVH backend wasn't in use), so we only ever
+	 * refit the groups which actually moved since we last looked.
+	 */
+	prev_update_num = bvh->geom_update_num;
+	all = (bvh->tlas == NULL);
+	bvh->geom_update_num = geom->update_num;
+
+	for (unsigned i = 0; i < bvh->n_groups; i++) {
+		bvh_group_t *group = &bvh->groups[i];
+		const mgeom_anim_t *anim;
+		mat4 xform;
+
+		if (group->anim == MGEOM_ANIM_NONE)
+			continue;
+		anim = &geom->anims[group->anim];
+		if (!all && anim->gen <= prev_update_num)
+			continue;
+		if (anim->hidden) {
+			mgeom_aabb_clear(&group->bounds);
+		} else {
+			glm_mat4_copy((vec4 *)anim->xform, xform);
+			mgeom_aabb_xform(&group->local_bounds, xform,
+			    &group->bounds);
+			glm_mat4_inv(xform, group->inv_xform);
+		}
+		if (!all && bvh->tlas != NULL) {
+			tlas_t *tlas = bvh->tlas;
+
+			for (uint32_t n = tlas->leaf_of[i]; n != UINT32_MAX;
+			    n = tlas->parents[n])
+				tlas_refit_node(tlas, n, bvh->groups);
+		}
+	}
+	if (bvh->tlas == NULL) {
+		mgeom_aabb_t *bounds = safe_calloc(MAX(bvh->n_groups, 1),
+		    sizeof (*bounds));
+
+		for (unsigned i = 0; i < bvh->n_groups; i++)
+			bounds[i] = bvh->groups[i].bounds;
+		bvh->tlas = tlas_build(bounds, bvh->n_groups);
+		free(bounds);
+		return;
+	}
+	if (rebuild_finish(bvh))
+		all = true;
+	if (all) {
+		tlas_t *tlas = bvh->tlas;
+
+		/* children always follow their parents */
+		for (uint32_t n = tlas->n_nodes; n > 0; n--)
+			tlas_refit_node(tlas, n - 1, bvh->groups);
+		tlas->area = total_area(tlas->nodes, tlas->n_nodes);
+	}
+	if (!bvh->rebuilding &&
+	    bvh->tlas->area > bvh->tlas->build_area * TLAS_MAX_DEGRADATION)
+		rebuild_start(bvh);
+}
+
+static inline bool
+ray_node_isect(const bvh_node_t *node, const float orig[3],
+    const float inv_dir[3], float max_t, float *t_p)
+{
+	float t_min = 0, t_max = max_t;
+
+	/* hidden groups leave behind empty nodes in the top-level tree */
+	if (node->min[0] > node->max[0])
+		return (false);
+	for (int i = 0; i < 3; i++) {
+		float t1 = (node->min[i] - orig[i]) * inv_dir[i];
+		float t2 = (node->max[i] - orig[i]) * inv_dir[i];
+
+		/* NaN (0 * inf) compares false and leaves the slab open */
+		if (t1 > t2) {
+			float tmp = t1;
+			t1 = t2;
+			t2 = tmp;
+		}
+		if (t1 > t_min)
+			t_min = t1;
+		if (t2 < t_max)
+			t_max = t2;
+	}
+	*t_p = t_min;
+	return (t_min <= t_max);
+}
+
+static inline bool
+ray_tri_isect(const bvh_tri_t *tri, const float orig[3],
+    const float dir[3], float *t_p)
+{
+	float p[3], q[3], s[3];
+	float det, inv_det, u, v, t;
+
+	cross3(dir, tri->e2, p);
+	det = dot3(tri->e1, p);
+	if (fabsf(det) < RAY_EPSILON)
+		return (false);
+	inv_det = 1 / det;
+	sub3(orig, tri->v0, s);
+	u = dot3(s, p) * inv_det;
+	if (u < 0 || u > 1)
+		return (false);
+	cross3(s, tri->e1, q);
+	v = dot3(dir, q) * inv_det;
+	if (v < 0 || u + v > 1)
+		return (false);
+	t = dot3(tri->e2, q) * inv_det;
+	if (t <= 0 || t >= *t_p)
+		return (false);
+	*t_p = t;
+	return (true);
+}
+
+typedef struct {
+	const bvh_t	*bvh;
+	vec4		orig;		/* object space */
+	vec4		dir;
+	float		best_t;
+	uint32_t	best_manip;
+} cast_t;
+
+typedef void (*leaf_func_t)(cast_t *cast, const bvh_node_t *leaf,
+    const float orig[3], const float dir[3]);
+
+/*
+ * Front-to-back traversal of one tree, calling `leaf_func' for every
+ * leaf the ray enters while closer than the best hit so far.
+ */
+static void
+traverse(cast_t *cast, const bvh_node_t *nodes, uint32_t root,
+    const float orig[3], const float dir[3], leaf_func_t leaf_func)
+{
+	uint32_t stack[BVH_STACK_DEPTH];
+	unsigned sp = 0;
+	float inv_dir[3] = { 1 / dir[0], 1 / dir[1], 1 / dir[2] };
+	float t;
+
+	if (!ray_node_isect(&nodes[root], orig, inv_dir, cast->best_t, &t))
+		return;
+	stack[sp++] = root;
+	while (sp != 0) {
+		uint32_t idx = stack[--sp];
+		const bvh_node_t *node = &nodes[idx];
+		uint32_t left, right;
+		float t_left, t_right;
+		bool hit_left, hit_right;
+
+		if (node->n_prims != 0) {
+			leaf_func(cast, node, orig, dir);
+			continue;
+		}
+		left = idx + 1;
+		right = node->off;
+		hit_left = ray_node_isect(&nodes[left], orig, inv_dir,
+		    cast->best_t, &t_left);
+		hit_right = ray_node_isect(&nodes[right], orig, inv_dir,
+		    cast->best_t, &t_right);
+		/* push the far child first, so the near one pops first */
+		if (hit_left && hit_right && t_left < t_right) {
+			uint32_t tmp = left;
+			left = right;
+			right = tmp;
+		}
+		ASSERT3U(sp + 2, <=, BVH_STACK_DEPTH);
+		if (hit_left && hit_right) {
+			stack[sp++] = left;
+			stack[sp++] = right;
+		} else if (hit_left) {
+			stack[sp++] = left;
+		} else if (hit_right) {
+			stack[sp++] = right;
+		}
+	}
+}
+
+static void
+tri_leaf(cast_t *cast, const bvh_node_t *leaf, const float orig[3],
+    const float dir[3])
+{
+	for (uint32_t i = 0; i < leaf->n_prims; i++) {
+		const bvh_tri_t *tri = &cast->bvh->tris[leaf->off + i];
+
+		if (ray_tri_isect(tri, orig, dir, &cast->best_t))
+			cast->best_manip = tri->manip;
+	}
+}
+
+static void
+group_leaf(cast_t *cast, const bvh_node_t *leaf, const float orig[3],
+    const float dir[3])
+{
+	const bvh_t *bvh = cast->bvh;
+	const bvh_group_t *group;
+	vec4 lo, ld;
+
+	UNUSED(orig);
+	UNUSED(dir);
+	ASSERT3U(leaf->n_prims, ==, 1);
+	group = &bvh->groups[bvh->tlas->refs[leaf->off]];
+	if (group->anim == MGEOM_ANIM_NONE) {
+		traverse(cast, bvh->nodes, group->root, cast->orig, cast->dir,
+		    tri_leaf);
+		return;
+	}
+	/*
+	 * Bring the ray into the group's local space. The direction isn't
+	 * renormalized, so ray parameters stay comparable between groups.
+	 */
+	glm_mat4_mulv((vec4 *)group->inv_xform, cast->orig, lo);
+	glm_mat4_mulv((vec4 *)group->inv_xform, cast->dir, ld);
+	traverse(cast, bvh->nodes, group->root, lo, ld, tri_leaf);
+}
+
+/*
+ * Casts a ray in object space (`dir' need not be normalized) and finds
+ * the nearest manipulator triangle it hits. The animation state used is
+ * the one from the last bvh_update(). On a hit, returns true and fills
+ * in the manipulator index and the ray parameter of the hit point.
+ */
+bool
+bvh_cast(const bvh_t *bvh, const vec3 orig, const vec3 dir,
+    uint32_t *manip, float *t)
+{
+	cast_t cast = {
+	    .bvh = bvh,
+	    .orig = { orig[0], orig[1], orig[2], 1 },
+	    .dir = { dir[0], dir[1], dir[2], 0 },
+	    .best_t = INFINITY,
+	    .best_manip = UINT32_MAX
+	};
+
+	ASSERT(bvh != NULL);
+	ASSERT(manip != NULL);
+	ASSERT(t != NULL);
+
+	if (bvh->tlas == NULL || bvh->tlas->n_nodes == 0)
+		return (false);
+	traverse(&cast, bvh->tlas->nodes, 0, cast.orig, cast.dir,
+	    group_leaf);
+	if (cast.best_manip == UINT32_MAX)
+		return (false);
+	*manip = cast.best_manip;
+	*t = cast.best_t;
+
+	return (true);
+}
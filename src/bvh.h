@@ -0,0 +1,63 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_BVH_H_
+#define	_BVH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cglm/cglm.h>
+
+#include "mgeom.h"
+#include "taskpool.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounding volume hierarchy over manipulator triangles, used for CPU
+ * ray-cast picking. Triangles are grouped by the animation node they
+ * hang under and every group gets its own tree, built in the node's
+ * local coordinate space. Ray casts transform the ray into each
+ * group's space using the current animation state in the mgeom_t, so
+ * rigid animations never invalidate the trees themselves. On top of the
+ * groups sits a small top-level tree over their object-space bounds,
+ * which bvh_update() refits as animations move.
+ */
+typedef struct bvh_s bvh_t;
+
+bvh_t *bvh_build(const mgeom_t *geom, taskpool_t *tp);
+void bvh_free(bvh_t *bvh);
+unsigned bvh_get_num_nodes(const bvh_t *bvh);
+
+void bvh_update(bvh_t *bvh, const mgeom_t *geom);
+bool bvh_cast(const bvh_t *bvh, const vec3 orig, const vec3 dir,
+    uint32_t *manip, float *t);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _BVH_H_ */
@@ -0,0 +1,357 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/dr.h>
+
+#include "glstate.h"
+
+/* uniform matrices we remember the last upload of */
+#define	UNIFORM_CACHE_SIZE	32
+
+typedef enum {
+    ST_FBO =		1 << 0,
+    ST_VIEWPORT =	1 << 1,
+    ST_DEPTH_TEST =	1 << 2,
+    ST_DEPTH_MASK =	1 << 3,
+    ST_DEPTH_FUNC =	1 << 4,
+    ST_CLEAR_DEPTH =	1 << 5,
+    ST_CLEAR_COLOR =	1 << 6,
+    ST_BLEND =		1 << 7,
+    ST_PROG =		1 << 8
+} state_bit_t;
+
+typedef struct {
+	GLuint	fbo;
+	int	vp[4];
+	bool	depth_test;
+	bool	depth_mask;
+	GLenum	depth_func;
+	double	clear_depth;
+	float	clear_color[4];
+	bool	blend;
+	GLuint	prog;
+} state_t;
+
+typedef struct {
+	GLuint	prog;
+	GLint	loc;
+	mat4	m;
+} uniform_ent_t;
+
+static bool		inited = false;
+static bool		active = false;
+static state_t		cur;
+static state_t		base;
+static unsigned		known = 0;	/* fields of `cur' matching GL */
+static unsigned		changed = 0;	/* fields to restore from `base' */
+static bool		restore_blend = false;
+static uniform_ent_t	uniforms[UNIFORM_CACHE_SIZE];
+static unsigned		n_uniforms = 0;
+static unsigned		uniform_next = 0;
+static unsigned		n_issued = 0, n_skipped = 0;
+static int		pub_calls[2] = { 0, 0 };
+
+static struct {
+	dr_t	calls;
+} drs;
+
+void
+glstate_init(void)
+{
+	ASSERT(!inited);
+	dr_create_vi(&drs.calls, pub_calls, 2, false,
+	    "manipdraw/stats/gl_calls");
+	glstate_forget_uniforms();
+	inited = true;
+}
+
+void
+glstate_fini(void)
+{
+	if (!inited)
+		return;
+	ASSERT(!active);
+	dr_delete(&drs.calls);
+	memset(pub_calls, 0, sizeof (pub_calls));
+	inited = false;
+}
+
+/*
+ * Returns true if the state in `bit' needs setting. Otherwise counts a
+ * skipped call.
+ */
+static bool
+need(unsigned bit, bool same)
+{
+	ASSERT(active);
+	if ((known & bit) && same) {
+		n_skipped++;
+		return (false);
+	}
+	known |= bit;
+	changed |= bit;
+	n_issued++;
+	return (true);
+}
+
+void
+glstate_begin(GLuint fbo, const int vp[4])
+{
+	ASSERT(inited);
+	ASSERT(!active);
+	ASSERT(vp != NULL);
+
+	memset(&base, 0, sizeof (base));
+	base.fbo = fbo;
+	memcpy(base.vp, vp, sizeof (base.vp));
+	base.depth_test = false;
+	base.depth_mask = false;
+	base.depth_func = GL_LESS;
+	base.clear_depth = 1;
+	base.prog = 0;
+	cur = base;
+	/* we don't know what the sim left bound and blending is up to it */
+	known = ~(unsigned)(ST_PROG | ST_BLEND);
+	changed = 0;
+	restore_blend = false;
+	n_issued = n_skipped = 0;
+	active = true;
+}
+
+/*
+ * Same as glstate_begin(), but for drawing phases where we can't assume
+ * the sim's state, so it's read back from GL. glstate_end() then also
+ * restores blending.
+ */
+void
+glstate_begin_probe(GLuint fbo, const int vp[4])
+{
+	GLboolean mask;
+	GLint func;
+	GLfloat depth;
+
+	glstate_begin(fbo, vp);
+	base.depth_test = glIsEnabled(GL_DEPTH_TEST);
+	glGetBooleanv(GL_DEPTH_WRITEMASK, &mask);
+	base.depth_mask = mask;
+	glGetIntegerv(GL_DEPTH_FUNC, &func);
+	base.depth_func = func;
+	glGetFloatv(GL_DEPTH_CLEAR_VALUE, &depth);
+	base.clear_depth = depth;
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, base.clear_color);
+	base.blend = glIsEnabled(GL_BLEND);
+	cur = base;
+	known |= ST_BLEND;
+	restore_blend = true;
+}
+
+void
+glstate_end(void)
+{
+	ASSERT(active);
+
+	if (changed & ST_DEPTH_TEST)
+		glstate_depth_test(base.depth_test);
+	if (changed & ST_DEPTH_MASK)
+		glstate_depth_mask(base.depth_mask);
+	if (changed & ST_DEPTH_FUNC)
+		glstate_depth_func(base.depth_func);
+	if (changed & ST_CLEAR_DEPTH)
+		glstate_clear_depth(base.clear_depth);
+	if (changed & ST_CLEAR_COLOR) {
+		glstate_clear_color(base.clear_color[0], base.clear_color[1],
+		    base.clear_color[2], base.clear_color[3]);
+	}
+	if (changed & ST_FBO)
+		glstate_bind_fbo(base.fbo);
+	if (changed & ST_VIEWPORT)
+		glstate_viewport(base.vp[0], base.vp[1], base.vp[2],
+		    base.vp[3]);
+	if (changed & ST_BLEND)
+		glstate_blend(base.blend);
+	if (changed & ST_PROG)
+		glstate_use_program(base.prog);
+	pub_calls[0] = n_issued;
+	pub_calls[1] = n_skipped;
+	active = false;
+}
+
+void
+glstate_bind_fbo(GLuint fbo)
+{
+	if (need(ST_FBO, cur.fbo == fbo)) {
+		glBindFramebufferEXT(GL_FRAMEBUFFER, fbo);
+		cur.fbo = fbo;
+	}
+}
+
+void
+glstate_viewport(int x, int y, int w, int h)
+{
+	if (need(ST_VIEWPORT, cur.vp[0] == x && cur.vp[1] == y &&
+	    cur.vp[2] == w && cur.vp[3] == h)) {
+		glViewport(x, y, w, h);
+		cur.vp[0] = x;
+		cur.vp[1] = y;
+		cur.vp[2] = w;
+		cur.vp[3] = h;
+	}
+}
+
+void
+glstate_depth_test(bool enable)
+{
+	if (need(ST_DEPTH_TEST, cur.depth_test == enable)) {
+		if (enable)
+			glEnable(GL_DEPTH_TEST);
+		else
+			glDisable(GL_DEPTH_TEST);
+		cur.depth_test = enable;
+	}
+}
+
+void
+glstate_depth_mask(bool enable)
+{
+	if (need(ST_DEPTH_MASK, cur.depth_mask == enable)) {
+		glDepthMask(enable ? GL_TRUE : GL_FALSE);
+		cur.depth_mask = enable;
+	}
+}
+
+void
+glstate_depth_func(GLenum func)
+{
+	if (need(ST_DEPTH_FUNC, cur.depth_func == func)) {
+		glDepthFunc(func);
+		cur.depth_func = func;
+	}
+}
+
+void
+glstate_clear_depth(double depth)
+{
+	if (need(ST_CLEAR_DEPTH, cur.clear_depth == depth)) {
+		glClearDepth(depth);
+		cur.clear_depth = depth;
+	}
+}
+
+void
+glstate_clear_color(float r, float g, float b, float a)
+{
+	if (need(ST_CLEAR_COLOR, cur.clear_color[0] == r &&
+	    cur.clear_color[1] == g && cur.clear_color[2] == b &&
+	    cur.clear_color[3] == a)) {
+		glClearColor(r, g, b, a);
+		cur.clear_color[0] = r;
+		cur.clear_color[1] = g;
+		cur.clear_color[2] = b;
+		cur.clear_color[3] = a;
+	}
+}
+
+void
+glstate_blend(bool enable)
+{
+	if (need(ST_BLEND, cur.blend == enable)) {
+		if (enable)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+		cur.blend = enable;
+		/* unless probed, the sim gets blending the way we leave it */
+		if (!restore_blend)
+			changed &= ~(unsigned)ST_BLEND;
+	}
+}
+
+void
+glstate_use_program(GLuint prog)
+{
+	if (need(ST_PROG, cur.prog == prog)) {
+		glUseProgram(prog);
+		cur.prog = prog;
+	}
+}
+
+/*
+ * For after calling code which may have bound a program of its own.
+ */
+void
+glstate_forget_program(void)
+{
+	ASSERT(active);
+	known &= ~(unsigned)ST_PROG;
+	changed |= ST_PROG;
+}
+
+/*
+ * Uploads a matrix to the uniform at `loc' of `prog', which must be the
+ * bound program, unless that's what it already holds.
+ */
+void
+glstate_uniform_mat4(GLuint prog, GLint loc, const mat4 m)
+{
+	uniform_ent_t *ent = NULL;
+
+	ASSERT(active);
+	ASSERT(m != NULL);
+	ASSERT(!(known & ST_PROG) || cur.prog == prog);
+
+	if (loc == -1)
+		return;
+	for (unsigned i = 0; i < n_uniforms; i++) {
+		if (uniforms[i].prog == prog && uniforms[i].loc == loc) {
+			ent = &uniforms[i];
+			break;
+		}
+	}
+	if (ent != NULL && memcmp(ent->m, m, sizeof (ent->m)) == 0) {
+		n_skipped++;
+		return;
+	}
+	if (ent == NULL) {
+		if (n_uniforms < UNIFORM_CACHE_SIZE) {
+			ent = &uniforms[n_uniforms++];
+		} else {
+			ent = &uniforms[uniform_next];
+			uniform_next = (uniform_next + 1) % UNIFORM_CACHE_SIZE;
+		}
+		ent->prog = prog;
+		ent->loc = loc;
+	}
+	glUniformMatrix4fv(loc, 1, GL_FALSE, (const GLfloat *)m);
+	glm_mat4_copy((vec4 *)m, ent->m);
+	n_issued++;
+}
+
+void
+glstate_forget_uniforms(void)
+{
+	n_uniforms = 0;
+	uniform_next = 0;
+}
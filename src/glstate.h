@@ -0,0 +1,79 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_GLSTATE_H_
+#define	_GLSTATE_H_
+
+#include <stdbool.h>
+
+#include <acfutils/glew.h>
+#include <cglm/cglm.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Shadow copy of the GL state touched by our passes, so that setting a
+ * piece of state to the value it already has costs no GL call. All of
+ * the plugin's GL work in a frame goes into one block, between
+ * glstate_begin() and glstate_end(). glstate_begin() takes the sim's
+ * framebuffer and viewport and assumes its usual state for everything
+ * else we touch (no depth testing or writes, GL_LESS, clear depth 1 and
+ * a zero clear color). glstate_end() puts back whatever we changed, once
+ * for the whole block, and leaves no program bound. Blending is left as
+ * we set it, like before the tracker.
+ *
+ * Uniform matrix uploads are cached per program and location across
+ * frames, since a program keeps its uniforms until it is relinked. Call
+ * glstate_forget_uniforms() after anything may have relinked one.
+ *
+ * The number of tracked calls issued and skipped in the last block is
+ * published as the read-only int[2] dataref manipdraw/stats/gl_calls.
+ */
+void glstate_init(void);
+void glstate_fini(void);
+
+void glstate_begin(GLuint fbo, const int vp[4]);
+void glstate_begin_probe(GLuint fbo, const int vp[4]);
+void glstate_end(void);
+
+void glstate_bind_fbo(GLuint fbo);
+void glstate_viewport(int x, int y, int w, int h);
+void glstate_depth_test(bool enable);
+void glstate_depth_mask(bool enable);
+void glstate_depth_func(GLenum func);
+void glstate_clear_depth(double depth);
+void glstate_clear_color(float r, float g, float b, float a);
+void glstate_blend(bool enable);
+void glstate_use_program(GLuint prog);
+void glstate_forget_program(void);
+
+void glstate_uniform_mat4(GLuint prog, GLint loc, const mat4 m);
+void glstate_forget_uniforms(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _GLSTATE_H_ */
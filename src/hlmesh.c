@@ -0,0 +1,219 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+
+#include "glstate.h"
+#include "hlmesh.h"
+
+typedef struct {
+	GLfloat		pos[3];
+	GLfloat		slot;
+} hlmesh_vtx_t;
+
+struct hlmesh_s {
+	unsigned	n_ents;
+	hlmesh_ent_t	ents[HLMESH_MAX_ENTS];
+	/* geom->update_num each entry was last baked at */
+	uint64_t	baked[HLMESH_MAX_ENTS];
+	GLfloat		alphas[HLMESH_MAX_ENTS];
+
+	GLuint		vbo;
+	unsigned	vbo_cap;	/* in vertices */
+	unsigned	n_vtx;
+	hlmesh_vtx_t	*vtx;
+	unsigned	vtx_cap;
+};
+
+hlmesh_t *
+hlmesh_new(void)
+{
+	hlmesh_t *hl = safe_calloc(1, sizeof (*hl));
+
+	glGenBuffers(1, &hl->vbo);
+	VERIFY(hl->vbo != 0);
+
+	return (hl);
+}
+
+void
+hlmesh_free(hlmesh_t *hl)
+{
+	if (hl == NULL)
+		return;
+	if (hl->vbo != 0)
+		glDeleteBuffers(1, &hl->vbo);
+	free(hl->vtx);
+	free(hl);
+}
+
+static bool
+ent_eq(const hlmesh_ent_t *a, const hlmesh_ent_t *b)
+{
+	return (a->geom == b->geom && a->manip == b->manip &&
+	    memcmp(a->offset, b->offset, sizeof (a->offset)) == 0);
+}
+
+/*
+ * Whether the manipulator's geometry may have moved since we baked it.
+ */
+static bool
+ent_moved(const hlmesh_ent_t *ent, uint64_t baked)
+{
+	return (mgeom_manip_moved_since(ent->geom, ent->manip, baked));
+}
+
+static void
+bake_ent(hlmesh_t *hl, const hlmesh_ent_t *ent, unsigned slot)
+{
+	const mgeom_t *geom = ent->geom;
+	const mgeom_manip_t *manip = &geom->manips[ent->manip];
+	mat4 model;
+
+	glm_translate_make(model, (float *)ent->offset);
+	for (unsigned i = 0; i < manip->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[manip->first_span + i];
+		mat4 m;
+
+		if (span->anim != MGEOM_ANIM_NONE) {
+			if (geom->anims[span->anim].hidden)
+				continue;
+			glm_mat4_mul(model,
+			    (vec4 *)geom->anims[span->anim].xform, m);
+		} else {
+			glm_mat4_copy(model, m);
+		}
+		if (hl->n_vtx + span->len > hl->vtx_cap) {
+			hl->vtx_cap = MAX(2 * hl->vtx_cap,
+			    hl->n_vtx + span->len);
+			hl->vtx = safe_realloc(hl->vtx,
+			    hl->vtx_cap * sizeof (*hl->vtx));
+		}
+		for (unsigned j = 0; j < span->len; j++) {
+			hlmesh_vtx_t *out = &hl->vtx[hl->n_vtx++];
+
+			glm_mat4_mulv3(m, geom->vtx[geom->idx[span->off + j]],
+			    1, out->pos);
+			out->slot = slot;
+		}
+	}
+}
+
+static void
+rebuild(hlmesh_t *hl)
+{
+	hl->n_vtx = 0;
+	for (unsigned i = 0; i < hl->n_ents; i++) {
+		bake_ent(hl, &hl->ents[i], i);
+		hl->baked[i] = hl->ents[i].geom->update_num;
+	}
+	if (hl->n_vtx == 0)
+		return;
+	glBindBuffer(GL_ARRAY_BUFFER, hl->vbo);
+	if (hl->n_vtx > hl->vbo_cap) {
+		hl->vbo_cap = MAX(2 * hl->vbo_cap, hl->n_vtx);
+		glBufferData(GL_ARRAY_BUFFER, hl->vbo_cap * sizeof (*hl->vtx),
+		    NULL, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_ARRAY_BUFFER, 0, hl->n_vtx * sizeof (*hl->vtx),
+	    hl->vtx);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+ * Sets the manipulators to highlight. Call after mgeom_update() of the
+ * geometries involved, before hlmesh_draw(). The vertex buffer is only
+ * rebuilt if the set of manipulators changed or one of them moved
+ * since it was baked, so changing only the alphas never touches it.
+ */
+void
+hlmesh_set(hlmesh_t *hl, const hlmesh_ent_t *ents, unsigned n_ents)
+{
+	bool dirty;
+
+	ASSERT(hl != NULL);
+	ASSERT(ents != NULL || n_ents == 0);
+	ASSERT3U(n_ents, <=, HLMESH_MAX_ENTS);
+
+	dirty = (n_ents != hl->n_ents);
+	for (unsigned i = 0; i < n_ents; i++) {
+		ASSERT(ents[i].geom != NULL);
+		ASSERT3U(ents[i].manip, <, ents[i].geom->n_manips);
+		if (!dirty && (!ent_eq(&ents[i], &hl->ents[i]) ||
+		    ent_moved(&ents[i], hl->baked[i])))
+			dirty = true;
+		hl->alphas[i] = ents[i].alpha;
+	}
+	if (!dirty)
+		return;
+	memcpy(hl->ents, ents, n_ents * sizeof (*ents));
+	hl->n_ents = n_ents;
+	rebuild(hl);
+}
+
+/*
+ * Paints all highlighted manipulators in a single draw. The program must
+ * already be bound. `pvm' maps aircraft coordinates to clip space.
+ */
+void
+hlmesh_draw(hlmesh_t *hl, GLuint prog, GLint u_pvm, GLint u_alphas,
+    const mat4 pvm)
+{
+	GLint pos_loc, slot_loc;
+
+	ASSERT(hl != NULL);
+	ASSERT(pvm != NULL);
+
+	if (hl->n_vtx == 0)
+		return;
+	glstate_uniform_mat4(prog, u_pvm, pvm);
+	glUniform1fv(u_alphas, hl->n_ents, hl->alphas);
+
+	pos_loc = glGetAttribLocation(prog, "vtx_pos");
+	slot_loc = glGetAttribLocation(prog, "vtx_slot");
+	glBindBuffer(GL_ARRAY_BUFFER, hl->vbo);
+	if (pos_loc != -1) {
+		glEnableVertexAttribArray(pos_loc);
+		glVertexAttribPointer(pos_loc, 3, GL_FLOAT, GL_FALSE,
+		    sizeof (hlmesh_vtx_t),
+		    (void *)offsetof(hlmesh_vtx_t, pos));
+	}
+	if (slot_loc != -1) {
+		glEnableVertexAttribArray(slot_loc);
+		glVertexAttribPointer(slot_loc, 1, GL_FLOAT, GL_FALSE,
+		    sizeof (hlmesh_vtx_t),
+		    (void *)offsetof(hlmesh_vtx_t, slot));
+	}
+	glDrawArrays(GL_TRIANGLES, 0, hl->n_vtx);
+	if (pos_loc != -1)
+		glDisableVertexAttribArray(pos_loc);
+	if (slot_loc != -1)
+		glDisableVertexAttribArray(slot_loc);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
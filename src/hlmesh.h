@@ -0,0 +1,78 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_HLMESH_H_
+#define	_HLMESH_H_
+
+#include <stdint.h>
+
+#include <cglm/cglm.h>
+
+#include <acfutils/glew.h>
+
+#include "mgeom.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Must match MAX_HL in highlight.vert.
+ */
+#define	HLMESH_MAX_ENTS	32
+
+/*
+ * One highlighted manipulator. `offset' is where the object sits in
+ * aircraft coordinates. Entries are compared by value to tell whether
+ * the set of highlighted manipulators changed.
+ */
+typedef struct {
+	const mgeom_t	*geom;
+	uint32_t	manip;
+	vec3		offset;
+	float		alpha;
+} hlmesh_ent_t;
+
+/*
+ * A small vertex buffer holding just the triangles of the currently
+ * highlighted manipulators, with their animations and object offsets
+ * baked in. It's rebuilt only when the set of manipulators changes, or
+ * when one of them moves, so painting the highlight doesn't walk any
+ * object or animation tree. Any number of manipulators (up to
+ * HLMESH_MAX_ENTS) are painted in a single draw, each with its own
+ * alpha. Every vertex carries the index of its entry in `vtx_slot'.
+ */
+typedef struct hlmesh_s hlmesh_t;
+
+hlmesh_t *hlmesh_new(void);
+void hlmesh_free(hlmesh_t *hl);
+
+void hlmesh_set(hlmesh_t *hl, const hlmesh_ent_t *ents, unsigned n_ents);
+void hlmesh_draw(hlmesh_t *hl, GLuint prog, GLint u_pvm, GLint u_alphas,
+    const mat4 pvm);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _HLMESH_H_ */
@@ -26,9 +26,11 @@
 
 #include <XPLMDisplay.h>
 #include <XPLMPlugin.h>
+#include <XPLMProcessing.h>
 
 #include <cglm/cglm.h>
 
+#include <acfutils/conf.h>
 #include <acfutils/crc64.h>
 #include <acfutils/dr.h>
 #include <acfutils/glew.h>
@@ -36,13 +38,89 @@
 #include <acfutils/helpers.h>
 #include <acfutils/osrand.h>
 #include <acfutils/shader.h>
+#include <acfutils/thread.h>
 
 #include <obj8.h>
 
+#include "bvh.h"
+#include "glstate.h"
+#include "hlmesh.h"
+#include "manipdraw_api.h"
+#include "mcache.h"
+#include "mgeom.h"
+#include "mmesh.h"
+#include "pickreduce.h"
+#include "progcache.h"
+#include "record.h"
+#include "rsched.h"
+#include "shwatch.h"
+#include "stats.h"
+#include "taskpool.h"
+
 #define	PLUGIN_NAME		"manipdraw"
-#define	PLUGIN_SIG		"skiselkov.manipdraw"
+#define	PLUGIN_SIG		MANIPDRAW_PLUGIN_SIG
 #define	PLUGIN_DESCRIPTION	"manipdraw"
 
+/*
+ * Depth of the manipulator readback ring. Each slot holds one in-flight
+ * resolve result, so the GPU can be up to this many frames behind us
+ * before we have to skip a resolve pass.
+ */
+#define	CURSOR_XFER_DEPTH_DFL	3
+#define	CURSOR_XFER_DEPTH_MAX	8
+/*
+ * When the pick frustum culling leaves an object without a compact mesh
+ * with at most this many candidate manipulators, we draw them one by
+ * one. Every such draw is a full traversal of the object by libobj8,
+ * animations included, which only skips the other manipulators' draw
+ * calls. Those would have been clipped early by the narrowed frustum
+ * anyway, so there's little GPU time to win. A single candidate costs
+ * the same one traversal as the full pass and draws strictly less, so
+ * it can't lose. Past that, the extra traversals cost more CPU time
+ * than they save on the GPU.
+ */
+#define	PICK_MAX_SEPARATE_DRAWS	1
+/*
+ * Maximum number of points resolved in one batched pick pass, including
+ * the mouse. Must match MAX_PICK_PTS in resolve_multi.vert.
+ */
+#define	PICK_MAX_PTS		32
+#define	PICK_MAX_EXT_PTS	(PICK_MAX_PTS - 1)
+/*
+ * Every object we pick against gets an index, and its manipulators
+ * resolve to IDs of PICK_ID(object index, manipulator index). These are
+ * rendered into the two 16-bit channels of the ID targets. Both channels
+ * at 0xffff, which is what the targets get cleared to, means no
+ * manipulator.
+ */
+#define	PICK_ID(obj_idx, manip_idx)	\
+	(((uint32_t)(obj_idx) << 16) | (uint32_t)(manip_idx))
+#define	PICK_ID_OBJ(id)		((id) >> 16)
+#define	PICK_ID_MANIP(id)	((id) & 0xffff)
+#define	PICK_NONE		UINT32_MAX
+#define	MAX_OBJS		64
+/*
+ * Each readback PBO holds the IDs of the pick regions of all points,
+ * followed by their depth buffer values.
+ */
+#define	XFER_MAX_PX		(PICK_MAX_PTS * PICKREDUCE_MAX_PX)
+#define	XFER_DEPTH_OFF		(XFER_MAX_PX * 2 * sizeof (uint16_t))
+#define	XFER_SIZE		(XFER_DEPTH_OFF + XFER_MAX_PX * sizeof (float))
+/* compute backend result: ray parameter bits and pick ID per point */
+#define	COMPUTE_RES_SIZE	(PICK_MAX_PTS * 2 * sizeof (uint32_t))
+#define	COMPUTE_BIND_RES	4	/* must match resolve_ray.comp */
+#define	COMPUTE_GROUP_SIZE	64	/* must match resolve_ray.comp */
+_Static_assert(COMPUTE_RES_SIZE <= XFER_SIZE,
+    "compute results must fit into a readback slot");
+/*
+ * The screen ID cache is rendered at 1/SCRCACHE_DIV_DFL of the viewport
+ * resolution in each axis, once the camera and all animations have held
+ * still for SCRCACHE_STABLE_FRAMES frames.
+ */
+#define	SCRCACHE_DIV_DFL	2
+#define	SCRCACHE_DIV_MAX	16
+#define	SCRCACHE_STABLE_FRAMES	3
+
 static struct {
 	dr_t	fbo;
 	dr_t	viewport;
@@ -51,211 +129,3068 @@ static struct {
 	dr_t	proj_matrix_3d;
 	dr_t	rev_float_z;
 	dr_t	modern_drv;
+	dr_t	vr_enabled;
 } drs;
+static bool	have_vr_dr = false;
+
+static struct {
+	dr_t	xfer_depth;
+	dr_t	backend;
+	dr_t	latency_mode;
+	dr_t	scrcache_div;
+	dr_t	record;
+	dr_t	shader_reload;
+	dr_t	rev_z;
+	dr_t	ready;
+	dr_t	obj_idx;
+	dr_t	manip_idx;
+	dr_t	manip_type;
+	dr_t	hit_depth;
+	dr_t	frame;
+	dr_t	pick_n_pts;
+	dr_t	pick_tol;
+	dr_t	pick_tol_mode;
+	dr_t	pick_pts;
+	dr_t	pick_res;
+	dr_t	hl_n;
+	dr_t	hl_ids;
+	dr_t	hl_alpha;
+	dr_t	bvh_build_us;
+	dr_t	bvh_nodes;
+} our_drs;
+
+/*
+ * Selects how we find the manipulator under the cursor. The GPU backend
+ * renders manipulator IDs and reads them back a frame later. The BVH
+ * backend ray-casts against the manipulator geometry on the CPU and
+ * produces a result in the same frame, without touching the GPU. The
+ * compute backend ray-casts on the GPU in a compute shader (GL 4.3+)
+ * and comes back through the same readback ring as the GPU backend.
+ * Backends which the driver or the loaded objects can't support fall
+ * back to the GPU backend. So do resolves with a hover tolerance region
+ * (manipdraw/pick/tolerance > 1), since the ray casters can only pick
+ * single pixels.
+ */
+typedef enum {
+    BACKEND_GPU,
+    BACKEND_BVH,
+    BACKEND_COMPUTE,
+    NUM_BACKENDS
+} backend_t;
+
+/*
+ * manipdraw/latency_mode. In throughput mode, async backends publish
+ * their results once the readback completes, so the highlight trails
+ * the mouse by a frame or more, and the resolve scheduler may defer
+ * resolves further. In low-latency mode, resolves are never deferred,
+ * and whenever the BVHs can answer, they're ray-cast on the CPU for a
+ * same-frame result instead of going to the GPU at all. An async result
+ * issued alongside would always be for an older frame than the BVH one
+ * and get dropped by pick_store(), so it would only cost us. The BVHs
+ * can't do the hover tolerance region, so this needs all of them built
+ * and a tolerance of 1, otherwise the resolve goes to the selected
+ * backend as in throughput mode.
+ */
+typedef enum {
+    LATENCY_THROUGHPUT,
+    LATENCY_LOW,
+    NUM_LATENCY_MODES
+} latency_mode_t;
+
+typedef struct {
+	int		x;
+	int		y;
+} pick_pt_t;
+
+/*
+ * What we need to turn a depth buffer value under a pick point back
+ * into a distance from the viewpoint.
+ */
+typedef struct {
+	int		vp[4];
+	mat4		inv_proj;
+	bool		rev_z;
+} pick_view_t;
+
+typedef struct {
+	GLuint		pbo;
+	const void	*map;		/* persistent mapping, if available */
+	GLsync		fence;
+	GLuint		query;		/* GL_ANY_SAMPLES_PASSED, or 0 */
+	bool		queried;
+	bool		busy;
+	uint64_t	frame;
+	unsigned	n_pts;
+	pick_pt_t	pts[PICK_MAX_PTS];
+	pick_view_t	view;
+	unsigned	tol;		/* pick region is tol x tol pixels */
+	pickreduce_mode_t tol_mode;
+	/* compute backend results carry the rays instead of depths */
+	bool		compute;
+	vec3		ray_orig[PICK_MAX_PTS];
+	vec3		ray_dir[PICK_MAX_PTS];
+	mat4		mv;
+} cursor_xfer_t;
+
+static int		xpver = 0;
+static char		plugindir[512] = { 0 };
+
+static GLuint		cursor_tex[2] = {};
+static GLuint		cursor_fbo = 0;
+static cursor_xfer_t	cursor_xfer[CURSOR_XFER_DEPTH_MAX] = {};
+static unsigned		cursor_xfer_depth = 0;
+static unsigned		cursor_xfer_head = 0;
+static int		cursor_xfer_depth_req = CURSOR_XFER_DEPTH_DFL;
+static bool		have_sync = false;
+static bool		have_persistent_map = false;
+static bool		have_occl_query = false;
+static bool		have_cond_render = false;
+/*
+ * Occlusion query of this frame's resolve pass, if it covered only the
+ * mouse pick point. Used to conditionally render the highlight.
+ */
+static GLuint		paint_cond_query = 0;
+static uint64_t		frame_num = 0;
+static uint32_t		pick_id = PICK_NONE;
+static uint64_t		manip_idx_frame = 0;
+
+/*
+ * When the mouse position of each of the last LAT_RING frames was
+ * sampled, for measuring how long it takes until the highlight follows
+ * it. Must cover more frames than the readback ring can be behind.
+ */
+#define	LAT_RING		16
+static uint64_t		mouse_t[LAT_RING] = {};
+static uint32_t		lat_pick_id = PICK_NONE;
+
+/*
+ * Besides the mouse, other plugins and scripts can have us resolve up
+ * to PICK_MAX_EXT_PTS extra points in window coordinates, by writing
+ * them as x/y pairs to manipdraw/pick/points and their number to
+ * manipdraw/pick/n_points. The points stay queried until changed. Their
+ * results show up in manipdraw/pick/results as object index * 65536 +
+ * manipulator index, -1 meaning no manipulator.
+ * All points are resolved together in a single pass, pick_res[0] always
+ * being the mouse.
+ */
+static int		pick_ext_n_pts = 0;
+static int		pick_ext_pts[2 * PICK_MAX_EXT_PTS] = {};
+static int		pick_ext_res[PICK_MAX_EXT_PTS] = {};
+/*
+ * Hover tolerance. With manipdraw/pick/tolerance set to N > 1, the GPU
+ * backend resolves an NxN pixel region around every pick point rather
+ * than the single pixel under it (N is rounded up to odd, at most
+ * PICKREDUCE_MAX_DIM). manipdraw/pick/tolerance_mode picks how the
+ * region reduces to one manipulator: 0 takes the one nearest to the
+ * point, 1 the one covering most of the region. The ray-casting
+ * backends can't do this, so with a tolerance set, resolves always go
+ * to the GPU backend, whichever backend is selected.
+ */
+static int		pick_tol = 1;
+static int		pick_tol_mode = PICKREDUCE_NEAREST;
+static uint32_t		pick_res[PICK_MAX_PTS] = {};
+static float		pick_res_depth[PICK_MAX_PTS] = {};
+static pick_pt_t	pick_res_pts[PICK_MAX_PTS] = {};
+static unsigned		pick_res_n = 0;
+
+/*
+ * While the mouse only wiggles by a few pixels, staying inside the
+ * window-space rectangle of the manipulator it was over and outside of
+ * those of any manipulators which could be in front of it, we keep the
+ * last result instead of resolving again (see hover_coherent()). That
+ * result must be the newest one (no resolve since last_resolve_frame in
+ * flight) and must postdate the last camera or animation change.
+ */
+#define	HOVER_COHERENT_PX	8
+static uint64_t		view_change_frame = 0;
+static uint64_t		last_resolve_frame = 0;
+
+/*
+ * Queries registered by other plugins through MANIPDRAW_MSG_QUERY_ADD
+ * (see manipdraw_api.h). Each frame, the active ones get the pick slots
+ * left over after the mouse and the dataref points. query_slot holds
+ * the slot a query was given this frame, or -1.
+ */
+static manipdraw_query_t	*queries[MANIPDRAW_MAX_QUERIES] = {};
+static int			query_slot[MANIPDRAW_MAX_QUERIES] = {};
+
+/*
+ * VR controller rays registered through MANIPDRAW_MSG_VR_RAYS_SET. In
+ * VR, X-Plane calls the 3D drawing phase once per eye, so the rays are
+ * only picked on the first call after the flight loop bumped
+ * vr_sim_frame, and every eye just paints the same result.
+ */
+static manipdraw_vr_rays_t	*vr_rays = NULL;
+static uint64_t			vr_sim_frame = 0;
+static uint64_t			vr_pick_frame = 0;
+
+/*
+ * Everything the resolve result depends on. The animation state is
+ * summed up per object in `anim_gen', see key_anim_gens(). If none of
+ * it changed since the last resolve, the result can't have changed
+ * either.
+ */
+typedef struct {
+	unsigned	n_pts;
+	pick_pt_t	pts[PICK_MAX_PTS];	/* [0] is the mouse */
+	int		vp[4];
+	mat4		acf_matrix;
+	mat4		proj_matrix;
+	int		backend;
+	unsigned	tol;
+	pickreduce_mode_t tol_mode;
+	uint64_t	anim_gen[MAX_OBJS];
+} resolve_key_t;
+
+static resolve_key_t	last_resolve_key;
+
+/*
+ * Everything a frame needs from X-Plane's view datarefs. It's read once
+ * at the top of draw_manips() and handed down to every stage, so no
+ * dataref gets read more than once per frame. The animation datarefs
+ * are read by mgeom_update() into each object's geometry.
+ */
+typedef struct {
+	int		vp[4];
+	int		fbo;
+	mat4		acf_matrix;
+	mat4		proj_matrix;
+	mat4		pvm;		/* proj_matrix * acf_matrix */
+	bool		rev_z;
+} frame_ctx_t;
+/* can't change without restarting X-Plane, so we only look it up once */
+static bool		rev_float_z = false;
+static int		pub_rev_z = 0;		/* manipdraw/dev/rev_z */
+/* view as of view_change_frame */
+static frame_ctx_t	prev_view = {};
+static bool		last_resolve_valid = false;
+
+/*
+ * Full-viewport manipulator ID cache. While the camera sits still, the
+ * IDs of all visible manipulators are rendered once at reduced
+ * resolution and read back into system memory, after which hovering
+ * the mouse around is just a lookup in `ids'.
+ */
+typedef struct {
+	int		vp[4];
+	mat4		acf_matrix;
+	mat4		proj_matrix;
+	int		div;
+} scrcache_key_t;
+
+static struct {
+	GLuint		tex[2];
+	GLuint		fbo;
+	GLuint		pbo;
+	GLsync		fence;
+	unsigned	w, h;
+	scrcache_key_t	key;		/* what the pending/valid IDs show */
+	unsigned	stable_frames;
+	bool		pending;
+	bool		valid;
+	uint32_t	*ids;
+	float		*depths;
+} scrcache = {};
+static int		scrcache_div = SCRCACHE_DIV_DFL;
+
+static uint64_t		last_draw_t = 0;
+static uint64_t		blink_start_t = 0;
+static uint32_t		prev_pick_id = PICK_NONE;
+
+static shader_info_t generic_vert_info = { .filename = "generic.vert.spv" };
+static shader_info_t resolve_frag_info = { .filename = "resolve.frag.spv" };
+static shader_info_t paint_frag_info = { .filename = "paint.frag.spv" };
+static shader_info_t highlight_vert_info = {
+    .filename = "highlight.vert.spv"
+};
+static shader_info_t highlight_frag_info = {
+    .filename = "highlight.frag.spv"
+};
+static shader_info_t resolve_mesh_vert_info = {
+    .filename = "resolve_mesh.vert.spv"
+};
+static shader_info_t resolve_mesh_frag_info = {
+    .filename = "resolve_mesh.frag.spv"
+};
+static shader_info_t resolve_multi_vert_info = {
+    .filename = "resolve_multi.vert.spv"
+};
+static const shader_prog_info_t resolve_prog_info = {
+    .progname = "manipdraw_resolve",
+    .vert = &generic_vert_info,
+    .frag = &resolve_frag_info
+};
+static const shader_prog_info_t paint_prog_info = {
+    .progname = "manipdraw_paint",
+    .vert = &generic_vert_info,
+    .frag = &paint_frag_info
+};
+static shader_info_t resolve_ray_comp_info = {
+    .filename = "resolve_ray.comp.spv"
+};
+static const shader_prog_info_t resolve_ray_prog_info = {
+    .progname = "manipdraw_resolve_ray",
+    .comp = &resolve_ray_comp_info
+};
+static const shader_prog_info_t highlight_prog_info = {
+    .progname = "manipdraw_highlight",
+    .vert = &highlight_vert_info,
+    .frag = &highlight_frag_info
+};
+static const shader_prog_info_t resolve_mesh_prog_info = {
+    .progname = "manipdraw_resolve_mesh",
+    .vert = &resolve_mesh_vert_info,
+    .frag = &resolve_mesh_frag_info
+};
+static const shader_prog_info_t resolve_multi_prog_info = {
+    .progname = "manipdraw_resolve_multi",
+    .vert = &resolve_multi_vert_info,
+    .frag = &resolve_mesh_frag_info
+};
+static progcache_prog_t	resolve_shader = {};
+static progcache_prog_t	resolve_mesh_shader = {};
+static progcache_prog_t	resolve_multi_shader = {};
+static bool		have_multi_pick = false;
+static progcache_prog_t	paint_shader = {};
+static progcache_prog_t	highlight_shader = {};
+static progcache_prog_t	resolve_ray_shader = {};
+static bool		have_compute_pick = false;
+static GLuint		compute_res_buf = 0;
+static hlmesh_t		*hl_mesh = NULL;
+
+/*
+ * Besides the manipulator under the mouse, other plugins can have us
+ * highlight up to HL_MAX_EXT manipulators of their choosing (think
+ * tutorials), by writing their IDs (object index * 65536 + manipulator
+ * index, as in manipdraw/pick/results) to manipdraw/highlight/ids, an
+ * alpha for each to manipdraw/highlight/alpha and their number to
+ * manipdraw/highlight/n. All highlights are painted in a single draw.
+ */
+#define	HL_MAX_EXT	(HLMESH_MAX_ENTS - 1)
+static int		hl_ext_n = 0;
+static int		hl_ext_ids[HL_MAX_EXT] = {};
+static float		hl_ext_alpha[HL_MAX_EXT] = {};
+static char		*shader_dir = NULL;
+
+/*
+ * Setting manipdraw/dev/shader_reload to 1 watches the shader directory
+ * from a background thread and reloads any shaders which were edited.
+ * Release builds leave it off, so the draw callback never has to go
+ * near the filesystem.
+ */
+#ifdef	DEBUG
+#define	SHADER_RELOAD_DFL	1
+#else
+#define	SHADER_RELOAD_DFL	0
+#endif
+static int		shader_reload = SHADER_RELOAD_DFL;
+static int		backend = BACKEND_GPU;
+static int		latency_mode = LATENCY_THROUGHPUT;
+
+/*
+ * Window-space bounding rectangle of one manipulator, plus a lower bound
+ * on its distance from the viewpoint. Computed from the manipulator's
+ * object-space bounds, which also serve to tell when it went stale.
+ */
+typedef struct {
+	bool		valid;
+	mgeom_aabb_t	bounds;
+	float		x1, y1, x2, y2;
+	float		dist;
+} hover_rect_t;
+
+/*
+ * One of the objects we pick against. The list comes from
+ * <plugindir>/manipdraw.cfg (see objs_init()), and all of them are drawn
+ * in the same resolve pass. An object which failed to load keeps its
+ * slot, so that the object indices in the IDs stay put.
+ */
+typedef struct {
+	char		*path;
+	char		*cache_path;
+	vec3		offset;		/* in aircraft coordinates */
+	/* loader results, owned by the worker until loader.done is set */
+	obj8_t		*obj;
+	mgeom_t		*geom;
+	bvh_t		*bvh;
+	bool		cached;
+	uint64_t	obj_us;
+	uint64_t	geom_us;
+	uint64_t	bvh_us;
+	/* set up by load_complete() */
+	bool		usable;
+	mmesh_t		*mesh;
+	uint32_t	*cands;
+	uint32_t	*deps;		/* see key_anim_gens() */
+	uint32_t	n_deps;
+	hover_rect_t	*hover_rects;	/* one per manipulator */
+	mat4		hover_pvm;	/* pvm the hover_rects are for */
+	/* filled in every frame */
+	uint32_t	n_cands;	/* UINT32_MAX: can't cull, draw all */
+	mat4		pvm;
+} pick_obj_t;
+
+static pick_obj_t	*objs = NULL;
+static unsigned		n_objs = 0;
+/*
+ * Whether every usable object has our own manipulator geometry, a
+ * compact mesh and a BVH. Anything which relies on one of them needs it
+ * for all objects, or can't be used at all.
+ */
+static bool		have_all_geoms = false;
+static bool		have_all_meshes = false;
+static bool		have_all_bvhs = false;
+
+/*
+ * Parsing the cockpit objects takes long enough to visibly stall the
+ * sim, so it happens on a background thread. The worker only touches
+ * memory; everything needing GL or the XPLM is finished by
+ * load_complete() in the draw callback. Until then, we don't pick at all.
+ */
+static struct {
+	thread_t	thr;
+	mutex_t		lock;
+	bool		running;
+	bool		done;		/* protected by lock */
+	uint64_t	start_t;
+	taskpool_t	*pool;		/* owned by the worker */
+} loader = {};
+static bool		obj_ready = false;
+/* totals over all objects of the last load, for the stats datarefs */
+static int		pub_bvh_build_us = 0;
+static int		pub_bvh_nodes = 0;
+
+/*
+ * Setting manipdraw/record to 1 records every frame's resolve inputs to
+ * a new file under <plugindir>/recordings, for replay by the benchmark
+ * harness. The read-only manipdraw/ready and manipdraw/manip_idx
+ * datarefs let the harness tell when we're loaded and what we picked.
+ */
+static int		record_req = 0;
+static rec_writer_t	*recorder = NULL;
+static float		*rec_dr_values = NULL;
+static int		pub_ready = 0;
+static int		pub_obj_idx = -1;
+static int		pub_manip_idx = -1;
+static int		pub_manip_type = -1;
+static float		pub_hit_depth = -1;
+static int		pub_frame = 0;
+
+enum {
+    U_PVM,
+    U_ALPHA,
+    U_N_PTS,
+    U_PICK,
+    U_OBJ_IDX,
+    U_HL_ALPHA,
+    U_N_TRIS,
+    U_RAY_ORIG,
+    U_RAY_DIR,
+    U_OBJ_OFFSET,
+    U_PICK_PASS,
+    U_IDX_SHORT,
+    NUM_UNIFORMS
+};
+static const char *uniforms[NUM_UNIFORMS] = {
+    [U_PVM] = "pvm",
+    [U_ALPHA] = "alpha",
+    [U_N_PTS] = "n_pts",
+    [U_PICK] = "pick",
+    [U_OBJ_IDX] = "obj_idx",
+    [U_HL_ALPHA] = "hl_alpha",
+    [U_N_TRIS] = "n_tris",
+    [U_RAY_ORIG] = "ray_orig",
+    [U_RAY_DIR] = "ray_dir",
+    [U_OBJ_OFFSET] = "obj_offset",
+    [U_PICK_PASS] = "pick_pass",
+    [U_IDX_SHORT] = "idx_short"
+};
+
+/*
+ * Sets up the back-transfer pixel buffer ring. This is used to retrieve
+ * the manipulator render result back from GPU VRAM. Each slot gets its
+ * own PBO and (if supported) a fence, so that we can tell when the GPU
+ * has finished writing into it without having to block on a map.
+ */
+static void
+cursor_xfer_init(void)
+{
+	cursor_xfer_depth = clampi(cursor_xfer_depth_req, 1,
+	    CURSOR_XFER_DEPTH_MAX);
+	cursor_xfer_depth_req = cursor_xfer_depth;
+	cursor_xfer_head = 0;
+	have_sync = (GLEW_VERSION_3_2 || GLEW_ARB_sync);
+
+	/*
+	 * On GL 4.4+ we can keep the buffers mapped for their entire
+	 * lifetime and read the result straight out of the mapping once
+	 * the fence signals. The map/unmap pair costs more than the actual
+	 * transfer of a few bytes, so this is worth having. Coherent
+	 * mappings are only safe to read once we know the GPU is done
+	 * writing, so this requires sync objects as well.
+	 */
+	have_persistent_map = (have_sync &&
+	    (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage));
+	/*
+	 * An occlusion query around the ID pass tells us whether any
+	 * manipulator fragment landed at all. Most of the time the mouse
+	 * is over empty space, in which case we can skip mapping the PBO
+	 * and all of the manipulator lookups. We only ever read the query
+	 * result after the slot's fence has signaled, so that it never
+	 * blocks, hence it requires sync objects as well.
+	 */
+	have_occl_query = (have_sync &&
+	    (GLEW_VERSION_3_3 || GLEW_ARB_occlusion_query2));
+	have_cond_render = (have_occl_query && GLEW_VERSION_3_0);
+	paint_cond_query = 0;
+
+	for (unsigned i = 0; i < cursor_xfer_depth; i++) {
+		cursor_xfer_t *xfer = &cursor_xfer[i];
+
+		ASSERT0(xfer->pbo);
+		glGenBuffers(1, &xfer->pbo);
+		VERIFY(xfer->pbo != 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, xfer->pbo);
+		if (have_persistent_map) {
+			const GLbitfield flags = GL_MAP_READ_BIT |
+			    GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+			glBufferStorage(GL_PIXEL_PACK_BUFFER, XFER_SIZE,
+			    NULL, flags);
+			xfer->map = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+			    XFER_SIZE, flags);
+		}
+		if (xfer->map == NULL) {
+			if (have_persistent_map) {
+				/*
+				 * Buffer storage is immutable, so we need
+				 * a fresh buffer object for the fallback.
+				 */
+				logMsg("Persistent PBO mapping failed, "
+				    "falling back to glMapBuffer");
+				have_persistent_map = false;
+				glDeleteBuffers(1, &xfer->pbo);
+				glGenBuffers(1, &xfer->pbo);
+				VERIFY(xfer->pbo != 0);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, xfer->pbo);
+			}
+			glBufferData(GL_PIXEL_PACK_BUFFER, XFER_SIZE, NULL,
+			    GL_STREAM_READ);
+		}
+		if (have_occl_query) {
+			glGenQueries(1, &xfer->query);
+			VERIFY(xfer->query != 0);
+		}
+		xfer->busy = false;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+static void
+cursor_xfer_fini(void)
+{
+	for (unsigned i = 0; i < ARRAY_NUM_ELEM(cursor_xfer); i++) {
+		cursor_xfer_t *xfer = &cursor_xfer[i];
+
+		if (xfer->fence != NULL)
+			glDeleteSync(xfer->fence);
+		if (xfer->map != NULL) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, xfer->pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+		if (xfer->pbo != 0)
+			glDeleteBuffers(1, &xfer->pbo);
+		if (xfer->query != 0)
+			glDeleteQueries(1, &xfer->query);
+		memset(xfer, 0, sizeof (*xfer));
+	}
+	cursor_xfer_depth = 0;
+	paint_cond_query = 0;
+	cursor_xfer_head = 0;
+}
+
+/*
+ * Called when the user changes the readback ring depth at runtime.
+ * Any in-flight results are dropped, we'll pick up a fresh one shortly.
+ */
+static void
+cursor_xfer_reinit(void)
+{
+	cursor_xfer_fini();
+	cursor_xfer_init();
+	last_resolve_valid = false;
+}
+
+static bool
+cursor_xfer_ready(const cursor_xfer_t *xfer)
+{
+	ASSERT(xfer != NULL);
+	ASSERT(xfer->busy);
+
+	if (xfer->fence == NULL) {
+		/*
+		 * Without sync objects, we have no way of knowing when the
+		 * transfer is done. Only consume it once it's the oldest
+		 * transfer in a full ring, at which point the GPU has had
+		 * cursor_xfer_depth - 1 frames to complete it.
+		 */
+		return (cursor_xfer[cursor_xfer_head].busy &&
+		    xfer == &cursor_xfer[cursor_xfer_head]);
+	}
+	switch (glClientWaitSync(xfer->fence, 0, 0)) {
+	case GL_ALREADY_SIGNALED:
+	case GL_CONDITION_SATISFIED:
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+static bool
+is_rev_float_z(void)
+{
+	return (xpver >= 12000 || dr_geti(&drs.modern_drv) != 0 ||
+	    dr_geti(&drs.rev_float_z) != 0);
+}
+
+static void
+frame_ctx_init(frame_ctx_t *ctx)
+{
+	ASSERT(ctx != NULL);
+
+	VERIFY3S(dr_getvi(&drs.viewport, ctx->vp, 0, 4), ==, 4);
+	ctx->fbo = dr_geti(&drs.fbo);
+	dr_getvf32(&drs.acf_matrix, (float *)ctx->acf_matrix, 0, 16);
+	dr_getvf32(&drs.proj_matrix_3d, (float *)ctx->proj_matrix, 0, 16);
+	glm_mat4_mul(ctx->proj_matrix, ctx->acf_matrix, ctx->pvm);
+	ctx->rev_z = rev_float_z;
+}
+
+/*
+ * Turns the depth buffer value under a pick point into the distance of
+ * whatever it hit from the viewpoint, in meters.
+ */
+static float
+depth_to_dist(const pick_view_t *view, const pick_pt_t *pt, float win_z)
+{
+	vec4 ndc, eye;
+
+	ASSERT(view != NULL);
+	ASSERT(pt != NULL);
+
+	ndc[0] = 2 * (pt->x + 0.5 - view->vp[0]) / view->vp[2] - 1;
+	ndc[1] = 2 * (pt->y + 0.5 - view->vp[1]) / view->vp[3] - 1;
+	/* reverse-Z uses a [0,1] clip depth range, otherwise it's [-1,1] */
+	ndc[2] = (view->rev_z ? win_z : 2 * win_z - 1);
+	ndc[3] = 1;
+	glm_mat4_mulv((vec4 *)view->inv_proj, ndc, eye);
+	if (eye[3] == 0)
+		return (-1);
+	glm_vec3_scale(eye, 1 / eye[3], eye);
+
+	return (glm_vec3_norm(eye));
+}
+
+static void
+pick_view_init(pick_view_t *view, const int vp[4], const mat4 proj,
+    bool rev_z)
+{
+	ASSERT(view != NULL);
+	ASSERT(vp != NULL);
+	ASSERT(proj != NULL);
+
+	memcpy(view->vp, vp, sizeof (view->vp));
+	glm_mat4_inv((vec4 *)proj, view->inv_proj);
+	view->rev_z = rev_z;
+}
+
+/*
+ * Publishes the results of a pick of the `n' points in `pts' made in
+ * `frame'. `depths' holds the distance of each hit from the viewpoint,
+ * and is ignored for points where nothing was hit.
+ */
+static void
+pick_store(const pick_pt_t *pts, const uint32_t *values,
+    const float *depths, unsigned n, uint64_t frame)
+{
+	ASSERT(pts != NULL);
+	ASSERT(values != NULL);
+	ASSERT(depths != NULL);
+	ASSERT3U(n, >=, 1);
+	ASSERT3U(n, <=, PICK_MAX_PTS);
+
+	/*
+	 * Results are stored in submission order, but guard against ever
+	 * going backwards in time anyway.
+	 */
+	if (frame < manip_idx_frame)
+		return;
+	memcpy(pick_res, values, n * sizeof (*values));
+	memcpy(pick_res_pts, pts, n * sizeof (*pts));
+	for (unsigned i = 0; i < n; i++)
+		pick_res_depth[i] = (values[i] != PICK_NONE ? depths[i] : -1);
+	pick_res_n = n;
+	pick_id = values[0];
+	manip_idx_frame = frame;
+	for (unsigned i = 0; i < PICK_MAX_EXT_PTS; i++) {
+		pick_ext_res[i] = (i + 1 < n && values[i + 1] != PICK_NONE ?
+		    (int)values[i + 1] : -1);
+	}
+}
+
+/*
+ * Stores a result of nothing being under any of the pick points.
+ */
+static void
+pick_store_none(const pick_pt_t *pts, unsigned n, uint64_t frame)
+{
+	uint32_t none[PICK_MAX_PTS];
+	float no_depths[PICK_MAX_PTS] = {};
+
+	memset(none, 0xff, sizeof (none));
+	pick_store(pts, none, no_depths, n, frame);
+}
+
+static unsigned
+pick_tol_dim(void)
+{
+	return (clampi(pick_tol, 1, PICKREDUCE_MAX_DIM) | 1);
+}
+
+static pickreduce_mode_t
+pick_tol_mode_get(void)
+{
+	return (clampi(pick_tol_mode, 0, NUM_PICKREDUCE_MODES - 1));
+}
+
+/*
+ * Reduces the dim x dim region of IDs and window depths around `pt'
+ * (bottom row first) down to a single hit. Neighboring pixels of the
+ * region are `step' window pixels apart.
+ */
+static void
+pick_region(const pick_view_t *view, const pick_pt_t *pt,
+    const uint32_t *ids, const float *win_z, unsigned dim, int step,
+    pickreduce_mode_t mode, uint32_t *value, float *depth)
+{
+	int px = pickreduce(ids, dim, PICK_NONE, mode);
+	pick_pt_t hit_pt;
+
+	if (px < 0) {
+		*value = PICK_NONE;
+		*depth = -1;
+		return;
+	}
+	hit_pt.x = pt->x + ((int)(px % dim) - (int)dim / 2) * step;
+	hit_pt.y = pt->y + ((int)(px / dim) - (int)dim / 2) * step;
+	*value = ids[px];
+	*depth = depth_to_dist(view, &hit_pt, win_z[px]);
+}
+
+/*
+ * The readback is an n_pts x 1 strip of tol x tol regions, one per point.
+ */
+static void
+cursor_xfer_store(const cursor_xfer_t *xfer, const void *data)
+{
+	const uint16_t *px = data;
+	const float *win_z = (const float *)((const uint8_t *)data +
+	    XFER_DEPTH_OFF);
+	unsigned tol = xfer->tol, stride = xfer->n_pts * tol;
+	uint32_t values[PICK_MAX_PTS];
+	float depths[PICK_MAX_PTS];
+
+	for (unsigned i = 0; i < xfer->n_pts; i++) {
+		uint32_t ids[PICKREDUCE_MAX_PX];
+		float z[PICKREDUCE_MAX_PX];
+
+		for (unsigned r = 0; r < tol; r++) {
+			for (unsigned c = 0; c < tol; c++) {
+				unsigned src = r * stride + i * tol + c;
+
+				/*
+				 * red holds the manipulator index, green
+				 * the object index
+				 */
+				ids[r * tol + c] = PICK_ID(px[2 * src + 1],
+				    px[2 * src]);
+				z[r * tol + c] = win_z[src];
+			}
+		}
+		pick_region(&xfer->view, &xfer->pts[i], ids, z, tol, 1,
+		    xfer->tol_mode, &values[i], &depths[i]);
+	}
+	pick_store(xfer->pts, values, depths, xfer->n_pts, xfer->frame);
+}
+
+/*
+ * Decodes a compute backend result, turning the ray parameters of the
+ * hits back into distances from the viewpoint.
+ */
+static void
+cursor_xfer_store_compute(const cursor_xfer_t *xfer, const void *data)
+{
+	const uint32_t *res = data;
+	uint32_t values[PICK_MAX_PTS];
+	float depths[PICK_MAX_PTS];
+
+	for (unsigned i = 0; i < xfer->n_pts; i++) {
+		float t;
+		vec3 hit, hit_eye;
+
+		values[i] = res[2 * i + 1];
+		depths[i] = -1;
+		if (values[i] == PICK_NONE)
+			continue;
+		memcpy(&t, &res[2 * i], sizeof (t));
+		glm_vec3_copy((float *)xfer->ray_orig[i], hit);
+		glm_vec3_muladds((float *)xfer->ray_dir[i], t, hit);
+		glm_mat4_mulv3((vec4 *)xfer->mv, hit, 1, hit_eye);
+		depths[i] = glm_vec3_norm(hit_eye);
+	}
+	pick_store(xfer->pts, values, depths, xfer->n_pts, xfer->frame);
+}
+
+static void
+cursor_xfer_consume(cursor_xfer_t *xfer)
+{
+	ASSERT(xfer != NULL);
+	ASSERT(xfer->busy);
+	ASSERT(xfer->pbo != 0);
+
+	if (xfer->queried) {
+		GLuint any_samples = 1;
+
+		/*
+		 * The query ended before the fence was inserted, so its
+		 * result is available by now. If no manipulator fragment
+		 * landed, the pixels are all just the clear color and
+		 * there's no point in reading them.
+		 */
+		glGetQueryObjectuiv(xfer->query, GL_QUERY_RESULT,
+		    &any_samples);
+		xfer->queried = false;
+		if (!any_samples) {
+			pick_store_none(xfer->pts, xfer->n_pts, xfer->frame);
+			goto out;
+		}
+	}
+	if (xfer->map != NULL) {
+		/*
+		 * The pick region of every point, containing the
+		 * clickspot indices, followed by the depths of the same
+		 * pixels.
+		 */
+		if (xfer->compute)
+			cursor_xfer_store_compute(xfer, xfer->map);
+		else
+			cursor_xfer_store(xfer, xfer->map);
+	} else {
+		const void *data;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, xfer->pbo);
+		data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (data != NULL) {
+			if (xfer->compute)
+				cursor_xfer_store_compute(xfer, data);
+			else
+				cursor_xfer_store(xfer, data);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+out:
+	if (xfer->fence != NULL) {
+		glDeleteSync(xfer->fence);
+		xfer->fence = NULL;
+	}
+	xfer->busy = false;
+}
+
+/*
+ * Collects all completed manipulator readbacks, oldest first, without
+ * ever blocking on the GPU. Since transfers complete in order, we can
+ * stop at the first one which isn't ready yet. After this, pick_id
+ * holds the newest completed result and manip_idx_frame the frame
+ * number in which it was rendered.
+ */
+static void
+resolve_manip_complete(void)
+{
+	for (unsigned i = 0; i < cursor_xfer_depth; i++) {
+		cursor_xfer_t *xfer = &cursor_xfer[(cursor_xfer_head + i) %
+		    cursor_xfer_depth];
+
+		if (!xfer->busy)
+			continue;
+		if (!cursor_xfer_ready(xfer))
+			break;
+		cursor_xfer_consume(xfer);
+	}
+}
+
+/*
+ * Constructs a matrix which, applied after the projection matrix, maps
+ * a w x h pixel region centered on (x, y) in window coordinates onto
+ * the entire clip volume. This is the same as the classic gluPickMatrix.
+ */
+static void
+pick_matrix(const int vp[4], double x, double y, double w, double h,
+    mat4 pick)
+{
+	ASSERT(vp != NULL);
+	ASSERT(w > 0);
+	ASSERT(h > 0);
+
+	glm_mat4_identity(pick);
+	pick[0][0] = vp[2] / w;
+	pick[1][1] = vp[3] / h;
+	pick[3][0] = (vp[2] + 2 * (vp[0] - x)) / w;
+	pick[3][1] = (vp[3] + 2 * (vp[1] - y)) / h;
+}
+
+static bool
+aabb_outside_frustum(const mgeom_aabb_t *aabb, const mat4 pvm)
+{
+	unsigned left = 0, right = 0, bottom = 0, top = 0, behind = 0;
+
+	ASSERT(aabb != NULL);
+	ASSERT(pvm != NULL);
+
+	if (mgeom_aabb_is_empty(aabb))
+		return (true);
+	for (int i = 0; i < 8; i++) {
+		vec4 pt = {
+		    (i & 1) ? aabb->max[0] : aabb->min[0],
+		    (i & 2) ? aabb->max[1] : aabb->min[1],
+		    (i & 4) ? aabb->max[2] : aabb->min[2],
+		    1
+		};
+		vec4 clip;
+
+		glm_mat4_mulv((vec4 *)pvm, pt, clip);
+		left += (clip[0] < -clip[3]);
+		right += (clip[0] > clip[3]);
+		bottom += (clip[1] < -clip[3]);
+		top += (clip[1] > clip[3]);
+		behind += (clip[3] <= 0);
+	}
+	return (left == 8 || right == 8 || bottom == 8 || top == 8 ||
+	    behind == 8);
+}
+
+/*
+ * Returns true if any object's manipulators moved in the last update,
+ * or if we can't tell, because we lack its geometry.
+ */
+static bool
+objs_changed(void)
+{
+	for (unsigned i = 0; i < n_objs; i++) {
+		const pick_obj_t *o = &objs[i];
+
+		if (o->usable && (o->geom == NULL || o->geom->changed))
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Computes an object's projection-view-model matrix, narrowed down by
+ * `pick' (if not NULL).
+ */
+static void
+obj_pvm(const pick_obj_t *o, const mat4 pick, mat4 pvm)
+{
+	ASSERT(o != NULL);
+	ASSERT(pvm != NULL);
+
+	if (pick != NULL)
+		glm_mat4_mul((vec4 *)pick, (vec4 *)o->pvm, pvm);
+	else
+		glm_mat4_copy((vec4 *)o->pvm, pvm);
+}
+
+/*
+ * Collects the indices of all manipulators whose bounds intersect the
+ * view frustum, narrowed down by `pick' (if not NULL), into the
+ * candidate list of each object. Whole objects get checked first, so an
+ * object which is out of view costs a single box test. Objects we have
+ * no geometry information for can't be culled, and get n_cands set to
+ * UINT32_MAX. Returns false if there's nothing to draw at all.
+ */
+static bool
+cull_manips(const mat4 pick)
+{
+	bool any = false;
+
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+		const mgeom_t *geom = o->geom;
+		mat4 pvm;
+
+		o->n_cands = 0;
+		if (!o->usable)
+			continue;
+		if (geom == NULL) {
+			o->n_cands = UINT32_MAX;
+			any = true;
+			continue;
+		}
+		obj_pvm(o, pick, pvm);
+		if (aabb_outside_frustum(&geom->bounds, pvm))
+			continue;
+		ASSERT(o->cands != NULL);
+		for (unsigned j = 0; j < geom->n_manips; j++) {
+			const mgeom_manip_t *manip = &geom->manips[j];
+
+			if (!manip->hidden &&
+			    !aabb_outside_frustum(&manip->bounds, pvm))
+				o->cands[o->n_cands++] = j;
+		}
+		any = (any || o->n_cands != 0);
+	}
+	return (any);
+}
+
+/*
+ * Constructs a pick matrix for the smallest screen region which takes
+ * in the pick regions of all points of `key'.
+ */
+static void
+key_pick_region(const resolve_key_t *key, mat4 pick)
+{
+	int x0 = key->pts[0].x, x1 = x0, y0 = key->pts[0].y, y1 = y0;
+
+	for (unsigned i = 1; i < key->n_pts; i++) {
+		x0 = MIN(x0, key->pts[i].x);
+		x1 = MAX(x1, key->pts[i].x);
+		y0 = MIN(y0, key->pts[i].y);
+		y1 = MAX(y1, key->pts[i].y);
+	}
+	pick_matrix(key->vp, (x0 + x1 + 1) / 2.0, (y0 + y1 + 1) / 2.0,
+	    x1 - x0 + key->tol, y1 - y0 + key->tol, pick);
+}
+
+/*
+ * Fills in key->anim_gen with, for every object, the last update in
+ * which any manipulator the resolve depends on moved. These are the
+ * visible manipulators in view of the pick region, plus the ones which
+ * were when the last resolve ran (o->deps, see deps_save()), as they
+ * may have since moved out of it. Movement anywhere else can't change
+ * the result, so it doesn't cost us a resolve. Any manipulator which
+ * moves into the region does so in the update its gen gets set to, so
+ * it always raises the maximum. Without an object's geometry we can't
+ * tell, so it counts as changing every frame.
+ */
+static void
+key_anim_gens(resolve_key_t *key, const mat4 pick)
+{
+	for (unsigned i = 0; i < n_objs; i++) {
+		const pick_obj_t *o = &objs[i];
+		const mgeom_t *geom = o->geom;
+		uint64_t gen = 0;
+		mat4 pvm;
+
+		if (!o->usable)
+			continue;
+		if (geom == NULL) {
+			key->anim_gen[i] = frame_num;
+			continue;
+		}
+		for (uint32_t j = 0; j < o->n_deps; j++)
+			gen = MAX(gen, geom->manips[o->deps[j]].gen);
+		obj_pvm(o, pick, pvm);
+		if (!aabb_outside_frustum(&geom->bounds, pvm)) {
+			for (unsigned j = 0; j < geom->n_manips; j++) {
+				const mgeom_manip_t *m = &geom->manips[j];
+
+				/* only manips which would raise it matter */
+				if (m->gen > gen && !m->hidden &&
+				    !aabb_outside_frustum(&m->bounds, pvm))
+					gen = m->gen;
+			}
+		}
+		key->anim_gen[i] = gen;
+	}
+}
+
+/*
+ * Remembers which manipulators are in view of the pick region as of
+ * the resolve which just ran, for key_anim_gens() to keep watching.
+ */
+static void
+deps_save(const mat4 pick)
+{
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+		const mgeom_t *geom = o->geom;
+		mat4 pvm;
+
+		o->n_deps = 0;
+		if (!o->usable || geom == NULL)
+			continue;
+		obj_pvm(o, pick, pvm);
+		if (aabb_outside_frustum(&geom->bounds, pvm))
+			continue;
+		for (unsigned j = 0; j < geom->n_manips; j++) {
+			const mgeom_manip_t *m = &geom->manips[j];
+
+			if (!m->hidden &&
+			    !aabb_outside_frustum(&m->bounds, pvm))
+				o->deps[o->n_deps++] = j;
+		}
+	}
+}
+
+/*
+ * Sets up rendering of manipulator IDs into an offscreen w x h target.
+ * Must be paired with id_pass_end(), which restores X-Plane's state.
+ */
+static void
+id_pass_begin(const frame_ctx_t *ctx, GLuint fbo, unsigned w, unsigned h)
+{
+	ASSERT(ctx != NULL);
+	ASSERT(fbo != 0);
+	glstate_bind_fbo(fbo);
+	glstate_viewport(0, 0, w, h);
+	glstate_depth_test(true);
+	glstate_depth_mask(true);
+	glstate_depth_func(ctx->rev_z ? GL_GREATER : GL_LESS);
+	glstate_clear_depth(ctx->rev_z ? 0 : 1);
+	/*
+	 * We want to set the FBO's color to 1, which is 0xFFFF in 16-bit,
+	 * in both the manipulator and object channels. That way, if
+	 * nothing covers it, we know that there is no valid manipulator
+	 * there. The sim's clear color is put back by glstate_end().
+	 */
+	glstate_clear_color(1, 1, 0, 1);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+/*
+ * Switches back to the sim's framebuffer and viewport for what follows
+ * in the frame. The depth state stays as the ID pass left it, since
+ * another ID pass may follow. glstate_end() restores it once.
+ */
+static void
+id_pass_end(const frame_ctx_t *ctx)
+{
+	ASSERT(ctx != NULL);
+	glstate_bind_fbo(ctx->fbo);
+	glstate_viewport(ctx->vp[0], ctx->vp[1], ctx->vp[2], ctx->vp[3]);
+}
+
+/*
+ * Draws the IDs of the candidate manipulators picked by cull_manips()
+ * into the currently bound ID target, narrowing the view down by `pick'
+ * (if not NULL).
+ */
+static void
+draw_manip_ids(const mat4 pick)
+{
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+		mat4 pvm;
+		GLuint prog;
+
+		if (o->n_cands == 0)
+			continue;
+		obj_pvm(o, pick, pvm);
+		if (o->mesh != NULL) {
+			/*
+			 * With the compact mesh, the candidates are a
+			 * multi-draw per animation node, regardless of how
+			 * many there are.
+			 */
+			ASSERT(o->n_cands != UINT32_MAX);
+			progcache_bind(&resolve_mesh_shader);
+			glUniform1f(progcache_get_u(&resolve_mesh_shader,
+			    U_OBJ_IDX), i);
+			mmesh_draw_manips(o->mesh, o->geom, o->cands,
+			    o->n_cands,
+			    progcache_get_prog(&resolve_mesh_shader),
+			    progcache_get_u(&resolve_mesh_shader, U_PVM),
+			    pvm);
+			continue;
+		}
+		progcache_bind(&resolve_shader);
+		glUniformMatrix4fv(progcache_get_u(&resolve_shader, U_PVM),
+		    1, GL_FALSE, (const GLfloat *)pvm);
+		glUniform1f(progcache_get_u(&resolve_shader, U_OBJ_IDX), i);
+		ASSERT(o->obj != NULL);
+		prog = progcache_get_prog(&resolve_shader);
+		if (o->n_cands <= PICK_MAX_SEPARATE_DRAWS) {
+			for (uint32_t j = 0; j < o->n_cands; j++) {
+				obj8_set_render_mode2(o->obj,
+				    OBJ8_RENDER_MODE_MANIP_ONLY_ONE,
+				    o->cands[j]);
+				obj8_draw_group(o->obj, NULL, prog, pvm);
+			}
+		} else {
+			obj8_set_render_mode(o->obj,
+			    OBJ8_RENDER_MODE_MANIP_ONLY);
+			obj8_draw_group(o->obj, NULL, prog, pvm);
+		}
+		glstate_forget_program();
+	}
+}
+
+/*
+ * Draws all pick points at once, one instance per point, each landing
+ * in its own pixel of the strip. Needs the compact mesh of every object.
+ */
+static void
+draw_manip_ids_multi(const mat4 *picks, unsigned n_pts)
+{
+	GLuint prog = progcache_get_prog(&resolve_multi_shader);
+	GLint u_pvm = progcache_get_u(&resolve_multi_shader, U_PVM);
+
+	ASSERT(have_all_meshes);
+	ASSERT(picks != NULL);
+
+	progcache_bind(&resolve_multi_shader);
+	glUniform1i(progcache_get_u(&resolve_multi_shader, U_N_PTS), n_pts);
+	glUniformMatrix4fv(progcache_get_u(&resolve_multi_shader, U_PICK),
+	    n_pts, GL_FALSE, (const GLfloat *)picks);
+	glEnable(GL_CLIP_DISTANCE0);
+	glEnable(GL_CLIP_DISTANCE1);
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+
+		if (o->n_cands == 0)
+			continue;
+		ASSERT(o->mesh != NULL);
+		glUniform1f(progcache_get_u(&resolve_multi_shader,
+		    U_OBJ_IDX), i);
+		mmesh_draw_manips_inst(o->mesh, o->geom, o->cands, o->n_cands,
+		    prog, u_pvm, o->pvm, n_pts);
+	}
+	glDisable(GL_CLIP_DISTANCE0);
+	glDisable(GL_CLIP_DISTANCE1);
+}
+
+/*
+ * Resolves all pick points in a single pass into an n_pts x 1 strip of
+ * cursor_tex, which then comes back in a single readback. Returns true
+ * if a resolve was started (or its result determined right away), false
+ * if it had to be skipped.
+ */
+static bool
+resolve_manip(const frame_ctx_t *ctx, const pick_pt_t *pts, unsigned n_pts)
+{
+	const int *vp = ctx->vp;
+	unsigned tol = pick_tol_dim();
+	mat4 picks[PICK_MAX_PTS];
+	cursor_xfer_t *xfer;
+
+	ASSERT(ctx != NULL);
+	ASSERT(pts != NULL);
+	ASSERT3U(n_pts, >=, 1);
+	ASSERT3U(n_pts, <=, PICK_MAX_PTS);
+
+	resolve_manip_complete();
+	xfer = &cursor_xfer[cursor_xfer_head];
+	if (xfer->busy) {
+		/*
+		 * The GPU is more than cursor_xfer_depth frames behind us.
+		 * Rather than stalling on it, skip this frame's resolve and
+		 * keep showing the last completed result.
+		 */
+		return (false);
+	}
+
+	/*
+	 * Narrow the projection down to the pick region of each point,
+	 * normally just the single pixel under it. With just one point,
+	 * this lets us throw out any manipulator which can't possibly be
+	 * under it before issuing any draws. With several, culling for
+	 * each one separately costs more than it saves, so we only cull
+	 * against the view.
+	 */
+	for (unsigned i = 0; i < n_pts; i++) {
+		pick_matrix(vp, pts[i].x + 0.5, pts[i].y + 0.5, tol, tol,
+		    picks[i]);
+	}
+	if (!cull_manips(n_pts == 1 ? picks[0] : NULL)) {
+		/*
+		 * Nothing is under any point, so we know the answer right
+		 * now. Stamping it with the current frame also discards any
+		 * older results still in flight.
+		 */
+		pick_store_none(pts, n_pts, frame_num);
+		return (true);
+	}
+
+	id_pass_begin(ctx, cursor_fbo, n_pts * tol, tol);
+	if (xfer->query != 0)
+		glBeginQuery(GL_ANY_SAMPLES_PASSED, xfer->query);
+	/* the single-pass variant only knows single pixel regions */
+	if (n_pts > 1 && tol == 1 && have_all_meshes && have_multi_pick) {
+		draw_manip_ids_multi((const mat4 *)picks, n_pts);
+	} else {
+		for (unsigned i = 0; i < n_pts; i++) {
+			glstate_viewport(i * tol, 0, tol, tol);
+			draw_manip_ids(picks[i]);
+		}
+	}
+	if (xfer->query != 0) {
+		glEndQuery(GL_ANY_SAMPLES_PASSED);
+		xfer->queried = true;
+		/*
+		 * With just the mouse point in the pass, the query also
+		 * tells us whether there's anything to highlight under the
+		 * mouse right now, which lets the GPU drop a stale
+		 * highlight without us having to wait for the readback.
+		 */
+		if (n_pts == 1 && have_cond_render)
+			paint_cond_query = xfer->query;
+	}
+	ASSERT(xfer->pbo != 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, xfer->pbo);
+	glReadPixels(0, 0, n_pts * tol, tol, GL_RG, GL_UNSIGNED_SHORT, NULL);
+	glReadPixels(0, 0, n_pts * tol, tol, GL_DEPTH_COMPONENT, GL_FLOAT,
+	    (void *)XFER_DEPTH_OFF);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (have_sync)
+		xfer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	xfer->frame = frame_num;
+	xfer->n_pts = n_pts;
+	memcpy(xfer->pts, pts, n_pts * sizeof (*pts));
+	pick_view_init(&xfer->view, vp, ctx->proj_matrix, ctx->rev_z);
+	xfer->tol = tol;
+	xfer->tol_mode = pick_tol_mode_get();
+	xfer->compute = false;
+	xfer->busy = true;
+	cursor_xfer_head = (cursor_xfer_head + 1) % cursor_xfer_depth;
+	id_pass_end(ctx);
+
+	return (true);
+}
+
+static void
+scrcache_invalidate(void)
+{
+	if (scrcache.fence != NULL) {
+		glDeleteSync(scrcache.fence);
+		scrcache.fence = NULL;
+	}
+	scrcache.pending = false;
+	scrcache.valid = false;
+	scrcache.stable_frames = 0;
+}
+
+/*
+ * The cache PBO holds the IDs followed by the depth buffer values.
+ */
+static size_t
+scrcache_depth_off(unsigned w, unsigned h)
+{
+	return (w * h * 2 * sizeof (uint16_t));
+}
+
+/*
+ * (Re)sizes the cache's render target, PBO and system memory copy.
+ * The texture and FBO names stay the same, only their storage changes.
+ */
+static void
+scrcache_resize(unsigned w, unsigned h)
+{
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+
+	if (scrcache.w == w && scrcache.h == h)
+		return;
+	if (scrcache.tex[0] == 0) {
+		glGenTextures(ARRAY_NUM_ELEM(scrcache.tex), scrcache.tex);
+		VERIFY(scrcache.tex[0] != 0);
+		glGenFramebuffers(1, &scrcache.fbo);
+		VERIFY(scrcache.fbo != 0);
+		glGenBuffers(1, &scrcache.pbo);
+		VERIFY(scrcache.pbo != 0);
+	}
+	setup_texture(scrcache.tex[0], GL_RG16, w, h,
+	    GL_RG, GL_UNSIGNED_SHORT, NULL);
+	setup_texture(scrcache.tex[1], GL_DEPTH_COMPONENT32F, w, h,
+	    GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	setup_color_fbo_for_tex(scrcache.fbo, scrcache.tex[0],
+	    scrcache.tex[1], 0, false);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, scrcache.pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, scrcache_depth_off(w, h) +
+	    w * h * sizeof (float), NULL, GL_STREAM_READ);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	free(scrcache.ids);
+	scrcache.ids = safe_calloc(w * h, sizeof (*scrcache.ids));
+	free(scrcache.depths);
+	scrcache.depths = safe_calloc(w * h, sizeof (*scrcache.depths));
+	scrcache.w = w;
+	scrcache.h = h;
+}
+
+static void
+scrcache_fini(void)
+{
+	scrcache_invalidate();
+	if (scrcache.pbo != 0)
+		glDeleteBuffers(1, &scrcache.pbo);
+	if (scrcache.fbo != 0)
+		glDeleteFramebuffers(1, &scrcache.fbo);
+	if (scrcache.tex[0] != 0) {
+		glDeleteTextures(ARRAY_NUM_ELEM(scrcache.tex),
+		    scrcache.tex);
+	}
+	free(scrcache.ids);
+	free(scrcache.depths);
+	memset(&scrcache, 0, sizeof (scrcache));
+}
+
+/*
+ * Renders all visible manipulators at reduced resolution and kicks off
+ * the asynchronous readback of the result.
+ */
+static void
+scrcache_render(const frame_ctx_t *ctx)
+{
+	const scrcache_key_t *key = &scrcache.key;
+	const int *vp = key->vp;
+	unsigned w = (vp[2] + key->div - 1) / key->div;
+	unsigned h = (vp[3] + key->div - 1) / key->div;
+
+	ASSERT(!scrcache.pending);
+	ASSERT3P(scrcache.fence, ==, NULL);
+
+	scrcache_resize(w, h);
+
+	id_pass_begin(ctx, scrcache.fbo, w, h);
+	if (cull_manips(NULL))
+		draw_manip_ids(NULL);
+	/* both IDs and depths are 4 bytes, so rows are always aligned */
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, scrcache.pbo);
+	glReadPixels(0, 0, w, h, GL_RG, GL_UNSIGNED_SHORT, NULL);
+	glReadPixels(0, 0, w, h, GL_DEPTH_COMPONENT, GL_FLOAT,
+	    (void *)scrcache_depth_off(w, h));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	scrcache.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	scrcache.pending = true;
+	id_pass_end(ctx);
+}
+
+/*
+ * Copies a completed readback into system memory, if it's done. Never
+ * blocks on the GPU.
+ */
+static void
+scrcache_complete(void)
+{
+	const uint16_t *data;
+
+	ASSERT(scrcache.pending);
+	ASSERT(scrcache.fence != NULL);
+
+	switch (glClientWaitSync(scrcache.fence, 0, 0)) {
+	case GL_ALREADY_SIGNALED:
+	case GL_CONDITION_SATISFIED:
+		break;
+	default:
+		return;
+	}
+	glDeleteSync(scrcache.fence);
+	scrcache.fence = NULL;
+	scrcache.pending = false;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, scrcache.pbo);
+	data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (data != NULL) {
+		for (unsigned i = 0, n = scrcache.w * scrcache.h; i < n; i++)
+			scrcache.ids[i] = PICK_ID(data[2 * i + 1], data[2 * i]);
+		memcpy(scrcache.depths, (const uint8_t *)data +
+		    scrcache_depth_off(scrcache.w, scrcache.h),
+		    scrcache.w * scrcache.h * sizeof (*scrcache.depths));
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		scrcache.valid = true;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/*
+ * Advances the screen cache state for this frame. Any change in the
+ * camera, viewport or animation state throws the cache away. Once
+ * things have been stable for a few frames, we render a new one.
+ */
+static void
+scrcache_update(const frame_ctx_t *ctx, const resolve_key_t *rkey)
+{
+	scrcache_key_t key;
+
+	ASSERT(ctx != NULL);
+	ASSERT(rkey != NULL);
+	/*
+	 * Without sync objects we can't poll the readback, and without
+	 * our own geometry we can't tell when animations moved.
+	 */
+	if (scrcache_div <= 0 || !have_sync || !have_all_geoms ||
+	    rkey->vp[2] <= 0 || rkey->vp[3] <= 0) {
+		if (scrcache.pending || scrcache.valid)
+			scrcache_invalidate();
+		return;
+	}
+	scrcache_div = MIN(scrcache_div, SCRCACHE_DIV_MAX);
+
+	memset(&key, 0, sizeof (key));
+	memcpy(key.vp, rkey->vp, sizeof (key.vp));
+	glm_mat4_copy((vec4 *)rkey->acf_matrix, key.acf_matrix);
+	glm_mat4_copy((vec4 *)rkey->proj_matrix, key.proj_matrix);
+	key.div = scrcache_div;
+
+	if (objs_changed() ||
+	    memcmp(&key, &scrcache.key, sizeof (key)) != 0) {
+		scrcache_invalidate();
+		scrcache.key = key;
+		return;
+	}
+	if (scrcache.valid)
+		return;
+	if (scrcache.pending) {
+		scrcache_complete();
+		return;
+	}
+	if (++scrcache.stable_frames >= SCRCACHE_STABLE_FRAMES)
+		scrcache_render(ctx);
+}
+
+/*
+ * Looks up the manipulators under all pick points in the screen cache.
+ * Returns false if the cache isn't currently usable.
+ */
+static bool
+scrcache_lookup(const frame_ctx_t *ctx, const pick_pt_t *pts, unsigned n_pts)
+{
+	const scrcache_key_t *key = &scrcache.key;
+	uint32_t res[PICK_MAX_PTS];
+	float depths[PICK_MAX_PTS];
+	pick_view_t view;
+	/* the pick region, in cache cells */
+	int rad = ((int)pick_tol_dim() / 2 + key->div - 1) / key->div;
+	unsigned dim = 2 * rad + 1;
+
+	ASSERT(ctx != NULL);
+	ASSERT(pts != NULL);
+	ASSERT3U(n_pts, <=, PICK_MAX_PTS);
+
+	if (!scrcache.valid)
+		return (false);
+	pick_view_init(&view, key->vp, key->proj_matrix, ctx->rev_z);
+	for (unsigned i = 0; i < n_pts; i++) {
+		int x0 = (pts[i].x - key->vp[0]) / key->div;
+		int y0 = (pts[i].y - key->vp[1]) / key->div;
+		uint32_t ids[PICKREDUCE_MAX_PX];
+		float z[PICKREDUCE_MAX_PX];
+
+		for (int dy = -rad; dy <= rad; dy++) {
+			for (int dx = -rad; dx <= rad; dx++) {
+				int x = x0 + dx, y = y0 + dy;
+				unsigned dst = (dy + rad) * dim + dx + rad;
+
+				if (x < 0 || x >= (int)scrcache.w ||
+				    y < 0 || y >= (int)scrcache.h) {
+					ids[dst] = PICK_NONE;
+					z[dst] = 0;
+				} else {
+					ids[dst] = scrcache.ids[y *
+					    scrcache.w + x];
+					z[dst] = scrcache.depths[y *
+					    scrcache.w + x];
+				}
+			}
+		}
+		pick_region(&view, &pts[i], ids, z, dim, key->div,
+		    pick_tol_mode_get(), &res[i], &depths[i]);
+	}
+	pick_store(pts, res, depths, n_pts, frame_num);
+
+	return (true);
+}
+
+/*
+ * Transforms a point in normalized device coordinates back into object
+ * space using the inverse projection-view-model matrix.
+ */
+static void
+unproject(const mat4 inv_pvm, double ndc_x, double ndc_y, double ndc_z,
+    vec3 out)
+{
+	vec4 ndc = { ndc_x, ndc_y, ndc_z, 1 }, obj_pt;
+
+	glm_mat4_mulv((vec4 *)inv_pvm, ndc, obj_pt);
+	ASSERT(obj_pt[3] != 0);
+	for (int i = 0; i < 3; i++)
+		out[i] = obj_pt[i] / obj_pt[3];
+}
+
+/*
+ * Builds the ray through the center of the pixel under a pick point, in
+ * aircraft coordinates. We unproject a point on the near plane and one
+ * halfway into the depth range, since with reverse-Z the far plane is
+ * at infinity.
+ */
+static void
+pick_ray(const frame_ctx_t *ctx, const mat4 inv_pvm, const pick_pt_t *pt,
+    vec3 orig, vec3 dir)
+{
+	const int *vp = ctx->vp;
+	double ndc_x, ndc_y;
+	vec3 far;
+
+	ndc_x = 2 * (pt->x + 0.5 - vp[0]) / vp[2] - 1;
+	ndc_y = 2 * (pt->y + 0.5 - vp[1]) / vp[3] - 1;
+	unproject(inv_pvm, ndc_x, ndc_y, ctx->rev_z ? 1 : -1, orig);
+	unproject(inv_pvm, ndc_x, ndc_y, ctx->rev_z ? 0.5 : 0, far);
+	glm_vec3_sub(far, orig, dir);
+}
+
+/*
+ * Casts rays in aircraft coordinates against the BVHs of all objects
+ * and stores the nearest hit of each as the result for the matching
+ * entry of `pts'.
+ */
+static void
+resolve_rays_bvh(const frame_ctx_t *ctx, const pick_pt_t *pts,
+    const vec3 *origs, const vec3 *dirs, unsigned n_pts)
+{
+	uint32_t res[PICK_MAX_PTS];
+	float depths[PICK_MAX_PTS];
+
+	ASSERT(ctx != NULL);
+	ASSERT(have_all_bvhs);
+	ASSERT(pts != NULL);
+	ASSERT3U(n_pts, <=, PICK_MAX_PTS);
+
+	for (unsigned i = 0; i < n_objs; i++) {
+		if (objs[i].usable)
+			bvh_update(objs[i].bvh, objs[i].geom);
+	}
+	for (unsigned i = 0; i < n_pts; i++) {
+		vec3 orig, dir;
+		float best_t = INFINITY;
+
+		glm_vec3_copy((float *)origs[i], orig);
+		glm_vec3_copy((float *)dirs[i], dir);
+		/*
+		 * The ray is in aircraft coordinates, so it only needs to be
+		 * shifted into each object's space. The direction is the
+		 * same for all of them, so the `t' values are comparable.
+		 */
+		res[i] = PICK_NONE;
+		depths[i] = -1;
+		for (unsigned j = 0; j < n_objs; j++) {
+			const pick_obj_t *o = &objs[j];
+			vec3 o_orig;
+			uint32_t hit;
+			float t;
+
+			if (!o->usable)
+				continue;
+			glm_vec3_sub(orig, (float *)o->offset, o_orig);
+			if (bvh_cast(o->bvh, o_orig, dir, &hit, &t) &&
+			    t < best_t) {
+				best_t = t;
+				res[i] = PICK_ID(j, hit);
+			}
+		}
+		if (res[i] != PICK_NONE) {
+			vec3 hit_pt;
+
+			glm_vec3_muladds(dir, best_t, orig);
+			glm_mat4_mulv3((vec4 *)ctx->acf_matrix, orig, 1,
+			    hit_pt);
+			depths[i] = glm_vec3_norm(hit_pt);
+		}
+	}
+	pick_store(pts, res, depths, n_pts, frame_num);
+}
+
+static void
+resolve_manip_bvh(const frame_ctx_t *ctx, const pick_pt_t *pts,
+    unsigned n_pts)
+{
+	mat4 inv_pvm;
+	vec3 orig[PICK_MAX_PTS], dir[PICK_MAX_PTS];
+
+	ASSERT(ctx != NULL);
+	ASSERT(pts != NULL);
+	ASSERT3U(n_pts, <=, PICK_MAX_PTS);
+
+	glm_mat4_inv((vec4 *)ctx->pvm, inv_pvm);
+	for (unsigned i = 0; i < n_pts; i++)
+		pick_ray(ctx, inv_pvm, &pts[i], orig[i], dir[i]);
+	resolve_rays_bvh(ctx, pts, (const vec3 *)orig, (const vec3 *)dir,
+	    n_pts);
+}
+
+/*
+ * Ray-casts rays in aircraft coordinates against the compact meshes in
+ * a compute shader, leaving the results for `pts' in flight in `xfer'.
+ * With `culled' set, objects which cull_manips() left without any
+ * candidates are skipped.
+ */
+static void
+resolve_rays_compute(const frame_ctx_t *ctx, cursor_xfer_t *xfer,
+    const pick_pt_t *pts, const vec3 *orig, const vec3 *dir,
+    unsigned n_pts, bool culled)
+{
+	uint32_t clear_val = UINT32_MAX;
+
+	ASSERT(ctx != NULL);
+	ASSERT(xfer != NULL);
+	ASSERT(!xfer->busy);
+	ASSERT(have_compute_pick);
+	ASSERT(have_all_meshes);
+	ASSERT(pts != NULL);
+	ASSERT3U(n_pts, >=, 1);
+	ASSERT3U(n_pts, <=, PICK_MAX_PTS);
+
+	progcache_bind(&resolve_ray_shader);
+	glUniform1i(progcache_get_u(&resolve_ray_shader, U_N_PTS), n_pts);
+	glUniform3fv(progcache_get_u(&resolve_ray_shader, U_RAY_ORIG),
+	    n_pts, (const GLfloat *)orig);
+	glUniform3fv(progcache_get_u(&resolve_ray_shader, U_RAY_DIR),
+	    n_pts, (const GLfloat *)dir);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, compute_res_buf);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI,
+	    GL_RED_INTEGER, GL_UNSIGNED_INT, &clear_val);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMPUTE_BIND_RES,
+	    compute_res_buf);
+	/*
+	 * Pass 0 finds the nearest hit distance of every ray across all
+	 * objects, pass 1 the lowest ID among the hits at that distance.
+	 */
+	for (int pass = 0; pass < 2; pass++) {
+		glUniform1i(progcache_get_u(&resolve_ray_shader,
+		    U_PICK_PASS), pass);
+		for (unsigned i = 0; i < n_objs; i++) {
+			pick_obj_t *o = &objs[i];
+			unsigned n_tris;
+
+			if (!o->usable || (culled && o->n_cands == 0))
+				continue;
+			ASSERT(o->mesh != NULL);
+			n_tris = mmesh_bind_compute(o->mesh, o->geom,
+			    progcache_get_u(&resolve_ray_shader,
+			    U_IDX_SHORT));
+			if (n_tris == 0)
+				continue;
+			glUniform1ui(progcache_get_u(&resolve_ray_shader,
+			    U_N_TRIS), n_tris);
+			glUniform3fv(progcache_get_u(&resolve_ray_shader,
+			    U_OBJ_OFFSET), 1, (const GLfloat *)o->offset);
+			glUniform1f(progcache_get_u(&resolve_ray_shader,
+			    U_OBJ_IDX), i);
+			glDispatchCompute((n_tris + COMPUTE_GROUP_SIZE - 1) /
+			    COMPUTE_GROUP_SIZE, 1, 1);
+		}
+		glMemoryBarrier(pass == 0 ? GL_SHADER_STORAGE_BARRIER_BIT :
+		    GL_BUFFER_UPDATE_BARRIER_BIT);
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMPUTE_BIND_RES, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	ASSERT(xfer->pbo != 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, compute_res_buf);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, xfer->pbo);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+	    n_pts * 2 * sizeof (uint32_t));
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	if (have_sync)
+		xfer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	xfer->frame = frame_num;
+	xfer->n_pts = n_pts;
+	memcpy(xfer->pts, pts, n_pts * sizeof (*pts));
+	memcpy(xfer->ray_orig, orig, n_pts * sizeof (*orig));
+	memcpy(xfer->ray_dir, dir, n_pts * sizeof (*dir));
+	glm_mat4_copy((vec4 *)ctx->acf_matrix, xfer->mv);
+	xfer->compute = true;
+	xfer->busy = true;
+	cursor_xfer_head = (cursor_xfer_head + 1) % cursor_xfer_depth;
+}
+
+/*
+ * Ray-casts all pick points in a compute shader. The results come back
+ * through the same readback ring as resolve_manip(), so they arrive
+ * equally late, but it needs no ID render target and doesn't disturb
+ * the sim's raster state. Returns false if the resolve had to be
+ * skipped.
+ */
+static bool
+resolve_manip_compute(const frame_ctx_t *ctx, const pick_pt_t *pts,
+    unsigned n_pts)
+{
+	mat4 inv_pvm;
+	vec3 orig[PICK_MAX_PTS], dir[PICK_MAX_PTS];
+	cursor_xfer_t *xfer;
+
+	ASSERT(ctx != NULL);
+	ASSERT(pts != NULL);
+	ASSERT3U(n_pts, <=, PICK_MAX_PTS);
+
+	resolve_manip_complete();
+	xfer = &cursor_xfer[cursor_xfer_head];
+	if (xfer->busy)
+		return (false);
+	if (!cull_manips(NULL)) {
+		pick_store_none(pts, n_pts, frame_num);
+		return (true);
+	}
+	glm_mat4_inv((vec4 *)ctx->pvm, inv_pvm);
+	for (unsigned i = 0; i < n_pts; i++)
+		pick_ray(ctx, inv_pvm, &pts[i], orig[i], dir[i]);
+	resolve_rays_compute(ctx, xfer, pts, (const vec3 *)orig,
+	    (const vec3 *)dir, n_pts, true);
+
+	return (true);
+}
+
+/*
+ * Alpha of the highlight under the mouse, which blinks. The blinking
+ * restarts whenever the mouse moves onto a different manipulator.
+ */
+static float
+hover_alpha(void)
+{
+	uint64_t now = microclock(), delta_t;
+
+	if (pick_id != prev_pick_id || now - last_draw_t > SEC2USEC(0.2)) {
+		blink_start_t = now;
+		prev_pick_id = pick_id;
+	}
+	last_draw_t = now;
+	delta_t = (now - blink_start_t) % 1000000;
+	if (delta_t < 500000)
+		return (delta_t / 500000.0);
+	else
+		return (1 - (delta_t - 500000) / 500000.0);
+}
+
+static bool
+hl_ent_add(hlmesh_ent_t *ents, unsigned *n_ents, uint32_t id, float alpha)
+{
+	const pick_obj_t *o;
+
+	if (PICK_ID_OBJ(id) >= n_objs)
+		return (false);
+	o = &objs[PICK_ID_OBJ(id)];
+	if (!o->usable || o->geom == NULL ||
+	    PICK_ID_MANIP(id) >= o->geom->n_manips)
+		return (false);
+	ASSERT3U(*n_ents, <, HLMESH_MAX_ENTS);
+	ents[*n_ents].geom = o->geom;
+	ents[*n_ents].manip = PICK_ID_MANIP(id);
+	glm_vec3_copy((float *)o->offset, ents[*n_ents].offset);
+	ents[*n_ents].alpha = alpha;
+	(*n_ents)++;
+
+	return (true);
+}
+
+/*
+ * Paints the manipulator under the mouse (if `hover' is set) and any
+ * externally requested highlights. The highlight mesh takes all of them
+ * in one draw. Only an object we have no geometry of needs the obj8
+ * fallback, in which case the mouse highlight is drawn separately.
+ * With `cond_query' set, the mouse highlight is subject to conditional
+ * rendering on it. The query only describes the hovered manipulator,
+ * so we can only do that if the mesh draws nothing but the hover.
+ */
+static void
+paint_highlights(const frame_ctx_t *ctx, bool hover, GLuint cond_query)
+{
+	hlmesh_ent_t ents[HLMESH_MAX_ENTS];
+	unsigned n_ents = 0;
+	bool hover_obj8 = false;
+	float alpha = 0;
+
+	if (hover) {
+		alpha = hover_alpha();
+		ASSERT3U(PICK_ID_OBJ(pick_id), <, n_objs);
+		hover_obj8 = !hl_ent_add(ents, &n_ents, pick_id, alpha);
+	}
+	for (int i = 0; i < MIN(hl_ext_n, HL_MAX_EXT); i++) {
+		if (hl_ext_ids[i] >= 0) {
+			hl_ent_add(ents, &n_ents, hl_ext_ids[i],
+			    clamp(hl_ext_alpha[i], 0, 1));
+		}
+	}
+	hlmesh_set(hl_mesh, ents, n_ents);
+	if (!hover || n_ents > 1 || hover_obj8)
+		cond_query = 0;
+
+	glstate_depth_test(false);
+	glstate_depth_mask(false);
+	glstate_blend(true);
+	if (cond_query != 0) {
+		/*
+		 * The query was issued earlier in this frame, so waiting on
+		 * it only waits on the GPU, never on us.
+		 */
+		glBeginConditionalRender(cond_query, GL_QUERY_WAIT);
+	}
+	if (n_ents != 0) {
+		progcache_bind(&highlight_shader);
+		hlmesh_draw(hl_mesh, progcache_get_prog(&highlight_shader),
+		    progcache_get_u(&highlight_shader, U_PVM),
+		    progcache_get_u(&highlight_shader, U_HL_ALPHA), ctx->pvm);
+	}
+	if (cond_query != 0)
+		glEndConditionalRender();
+	if (hover_obj8) {
+		const pick_obj_t *o = &objs[PICK_ID_OBJ(pick_id)];
+
+		ASSERT(o->obj != NULL);
+		progcache_bind(&paint_shader);
+		glUniformMatrix4fv(progcache_get_u(&paint_shader, U_PVM),
+		    1, GL_FALSE, (const GLfloat *)o->pvm);
+		glUniform1f(progcache_get_u(&paint_shader, U_ALPHA), alpha);
+		obj8_set_render_mode2(o->obj, OBJ8_RENDER_MODE_MANIP_ONLY_ONE,
+		    PICK_ID_MANIP(pick_id));
+		obj8_draw_group(o->obj, NULL,
+		    progcache_get_prog(&paint_shader), o->pvm);
+		glstate_forget_program();
+	}
+}
+
+/*
+ * Looks up the object a pick ID belongs to.
+ */
+static const pick_obj_t *
+id2obj(uint32_t id)
+{
+	ASSERT(id != PICK_NONE);
+	ASSERT3U(PICK_ID_OBJ(id), <, n_objs);
+	return (&objs[PICK_ID_OBJ(id)]);
+}
+
+static bool
+should_draw_manip(uint32_t id)
+{
+	const pick_obj_t *o;
+
+	if (id == PICK_NONE)
+		return (false);
+	o = id2obj(id);
+	if (o->geom != NULL) {
+		ASSERT3U(PICK_ID_MANIP(id), <, o->geom->n_manips);
+		return (o->geom->manips[PICK_ID_MANIP(id)].type !=
+		    MGEOM_MANIP_NOOP);
+	}
+	ASSERT(o->obj != NULL);
+	return (obj8_get_manip(o->obj, PICK_ID_MANIP(id))->type !=
+	    OBJ8_MANIP_NOOP);
+}
+
+_Static_assert((int)MGEOM_MANIP_UNKNOWN == (int)MANIPDRAW_MANIP_UNKNOWN,
+    "mgeom_manip_type_t and manipdraw_manip_type_t must match");
+
+/*
+ * Returns the manipdraw_manip_type_t of a manipulator, or -1 for none.
+ */
+static int
+manip_type_of(uint32_t id)
+{
+	const pick_obj_t *o;
+
+	if (id == PICK_NONE)
+		return (-1);
+	o = id2obj(id);
+	if (o->geom != NULL) {
+		ASSERT3U(PICK_ID_MANIP(id), <, o->geom->n_manips);
+		return (o->geom->manips[PICK_ID_MANIP(id)].type);
+	}
+	/*
+	 * Only the fallback path without our own geometry gets here, so
+	 * we don't bother translating every libobj8 manipulator type.
+	 */
+	ASSERT(o->obj != NULL);
+	switch (obj8_get_manip(o->obj, PICK_ID_MANIP(id))->type) {
+	case OBJ8_MANIP_COMMAND:
+		return (MANIPDRAW_MANIP_COMMAND);
+	case OBJ8_MANIP_NOOP:
+		return (MANIPDRAW_MANIP_NOOP);
+	default:
+		return (MANIPDRAW_MANIP_UNKNOWN);
+	}
+}
+
+static void
+result_fill(manipdraw_result_t *res, unsigned slot)
+{
+	ASSERT(res != NULL);
+	ASSERT3U(slot, <, pick_res_n);
+
+	if (pick_res[slot] != PICK_NONE) {
+		res->obj_idx = PICK_ID_OBJ(pick_res[slot]);
+		res->manip_idx = PICK_ID_MANIP(pick_res[slot]);
+		res->manip_type = manip_type_of(pick_res[slot]);
+		res->depth = pick_res_depth[slot];
+	} else {
+		res->obj_idx = -1;
+		res->manip_idx = -1;
+		res->manip_type = -1;
+		res->depth = -1;
+	}
+	res->frame = manip_idx_frame;
+}
+
+/*
+ * Hands out the pick slots still free in `key' to the active queries,
+ * adding their points to it.
+ */
+static void
+queries_assign(resolve_key_t *key)
+{
+	ASSERT(key != NULL);
+
+	for (unsigned i = 0; i < MANIPDRAW_MAX_QUERIES; i++) {
+		const manipdraw_query_t *q = queries[i];
+
+		query_slot[i] = -1;
+		if (q == NULL || !q->active || key->n_pts >= PICK_MAX_PTS)
+			continue;
+		query_slot[i] = key->n_pts;
+		key->pts[key->n_pts].x = q->x;
+		key->pts[key->n_pts].y = q->y;
+		key->n_pts++;
+	}
+}
+
+static unsigned
+queries_num_active(void)
+{
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < MANIPDRAW_MAX_QUERIES; i++)
+		n += (queries[i] != NULL && queries[i]->active);
+	return (n);
+}
+
+/*
+ * Writes the newest results back into the queries. The published
+ * results can be from an older pass than the one the queries were just
+ * added to, in which case the slot may well have held some other point
+ * back then. So we only hand out a result if it was really made for the
+ * query's current point.
+ */
+static void
+queries_publish(void)
+{
+	for (unsigned i = 0; i < MANIPDRAW_MAX_QUERIES; i++) {
+		manipdraw_query_t *q = queries[i];
+		int slot = query_slot[i];
+
+		if (q == NULL || slot < 0 || slot >= (int)pick_res_n ||
+		    pick_res_pts[slot].x != q->x ||
+		    pick_res_pts[slot].y != q->y)
+			continue;
+		result_fill(&q->result, slot);
+	}
+}
+
+static void
+query_add(manipdraw_query_t *q)
+{
+	ASSERT(q != NULL);
+
+	for (unsigned i = 0; i < MANIPDRAW_MAX_QUERIES; i++) {
+		if (queries[i] == q)
+			return;
+	}
+	for (unsigned i = 0; i < MANIPDRAW_MAX_QUERIES; i++) {
+		if (queries[i] == NULL) {
+			queries[i] = q;
+			query_slot[i] = -1;
+			q->result.obj_idx = -1;
+			q->result.manip_idx = -1;
+			q->result.manip_type = -1;
+			q->result.depth = -1;
+			q->result.frame = 0;
+			return;
+		}
+	}
+	logMsg("Too many manipulator queries registered, ignoring new "
+	    "query");
+}
+
+static void
+query_remove(const manipdraw_query_t *q)
+{
+	ASSERT(q != NULL);
+
+	for (unsigned i = 0; i < MANIPDRAW_MAX_QUERIES; i++) {
+		if (queries[i] == q) {
+			queries[i] = NULL;
+			query_slot[i] = -1;
+		}
+	}
+}
+
+static void
+hover_rect_update(const pick_obj_t *o, const mgeom_manip_t *manip,
+    const int vp[4], const vec3 eye, hover_rect_t *r)
+{
+	const mgeom_aabb_t *aabb = &manip->bounds;
+	bool behind = false;
+	float d2 = 0;
+
+	r->valid = true;
+	r->bounds = *aabb;
+	r->x1 = r->y1 = INFINITY;
+	r->x2 = r->y2 = -INFINITY;
+	for (int i = 0; i < 8; i++) {
+		vec4 pt = {
+		    (i & 1) ? aabb->max[0] : aabb->min[0],
+		    (i & 2) ? aabb->max[1] : aabb->min[1],
+		    (i & 4) ? aabb->max[2] : aabb->min[2],
+		    1
+		};
+		vec4 clip;
+		float x, y;
+
+		glm_mat4_mulv((vec4 *)o->pvm, pt, clip);
+		if (clip[3] <= 0) {
+			behind = true;
+			break;
+		}
+		x = vp[0] + (clip[0] / clip[3] + 1) * vp[2] / 2;
+		y = vp[1] + (clip[1] / clip[3] + 1) * vp[3] / 2;
+		r->x1 = MIN(r->x1, x);
+		r->y1 = MIN(r->y1, y);
+		r->x2 = MAX(r->x2, x);
+		r->y2 = MAX(r->y2, y);
+	}
+	if (behind) {
+		/* straddles the viewpoint, could be anywhere on screen */
+		r->x1 = r->y1 = -INFINITY;
+		r->x2 = r->y2 = INFINITY;
+	}
+	for (int i = 0; i < 3; i++) {
+		float d = MAX(MAX(aabb->min[i] - eye[i], eye[i] - aabb->max[i]),
+		    0);
+		d2 += d * d;
+	}
+	r->dist = sqrtf(d2);
+}
+
+/*
+ * Returns the cached window-space rectangle of manipulator `idx' of `o'.
+ * A camera move invalidates all of an object's rectangles, an animation
+ * only those of the manipulators whose bounds it changed.
+ */
+static const hover_rect_t *
+hover_rect_get(pick_obj_t *o, unsigned idx, const int vp[4],
+    const vec3 eye)
+{
+	const mgeom_manip_t *manip;
+	hover_rect_t *r;
+
+	ASSERT(o->geom != NULL);
+	ASSERT3U(idx, <, o->geom->n_manips);
+	manip = &o->geom->manips[idx];
+	r = &o->hover_rects[idx];
+	if (!r->valid || memcmp(&r->bounds, &manip->bounds,
+	    sizeof (r->bounds)) != 0)
+		hover_rect_update(o, manip, vp, eye, r);
+
+	return (r);
+}
+
+static bool
+hover_rect_contains(const hover_rect_t *r, float x, float y)
+{
+	return (x >= r->x1 && x <= r->x2 && y >= r->y1 && y <= r->y2);
+}
+
+/*
+ * Decides whether the last pick result still holds for the mouse at
+ * (x, y) without redoing the pick. Conservative: any manipulator whose
+ * rectangle covers the mouse and which isn't known to be behind the
+ * last hit forces a resolve. Collects any completed readbacks first, so
+ * that we judge by the newest result.
+ */
+static bool
+hover_coherent(const frame_ctx_t *ctx, int x, int y)
+{
+	mat4 inv_mv;
+	vec4 eye_acf;
+	float hit_dist, fx = x + 0.5, fy = y + 0.5;
+	bool in_cur = false;
+
+	ASSERT(ctx != NULL);
+
+	resolve_manip_complete();
+	/*
+	 * With a hover tolerance, manipulators next to the mouse can win
+	 * too, which the rectangles below don't account for.
+	 */
+	if (!have_all_geoms || pick_res_n != 1 || pick_id == PICK_NONE ||
+	    pick_tol_dim() != 1 ||
+	    manip_idx_frame < view_change_frame ||
+	    manip_idx_frame < last_resolve_frame ||
+	    abs(x - pick_res_pts[0].x) > HOVER_COHERENT_PX ||
+	    abs(y - pick_res_pts[0].y) > HOVER_COHERENT_PX)
+		return (false);
+	hit_dist = pick_res_depth[0];
+	if (hit_dist < 0)
+		return (false);
+
+	glm_mat4_inv((vec4 *)ctx->acf_matrix, inv_mv);
+	glm_mat4_mulv(inv_mv, (vec4){0, 0, 0, 1}, eye_acf);
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+		vec3 eye;
+
+		if (!o->usable || o->geom == NULL)
+			continue;
+		if (memcmp(o->hover_pvm, o->pvm, sizeof (o->pvm)) != 0) {
+			for (unsigned j = 0; j < o->geom->n_manips; j++)
+				o->hover_rects[j].valid = false;
+			glm_mat4_copy(o->pvm, o->hover_pvm);
+		}
+		glm_vec3_sub(eye_acf, o->offset, eye);
+		for (unsigned j = 0; j < o->geom->n_manips; j++) {
+			const hover_rect_t *r;
+
+			if (o->geom->manips[j].hidden)
+				continue;
+			r = hover_rect_get(o, j, ctx->vp, eye);
+			if (PICK_ID(i, j) == pick_id) {
+				if (!hover_rect_contains(r, fx, fy))
+					return (false);
+				in_cur = true;
+			} else if (r->dist <= hit_dist &&
+			    hover_rect_contains(r, fx, fy)) {
+				return (false);
+			}
+		}
+	}
+	/* also false if the manipulator got hidden in the meantime */
+	return (in_cur);
+}
+
+/*
+ * Whether this resolve should skip the scheduler and be ray-cast
+ * against the BVHs in the same frame. See latency_mode_t.
+ */
+static bool
+low_latency(const resolve_key_t *key)
+{
+	return (latency_mode == LATENCY_LOW && have_all_bvhs &&
+	    key->tol == 1);
+}
+
+/*
+ * Feeds the hover-to-highlight latency stats. Whenever the manipulator
+ * under the mouse changes, this is the time from when the mouse was
+ * sampled in the frame the new result is for, until we paint it.
+ */
+static void
+latency_sample(void)
+{
+	if (pick_id == lat_pick_id)
+		return;
+	lat_pick_id = pick_id;
+	if (manip_idx_frame != 0 && frame_num - manip_idx_frame < LAT_RING) {
+		stats_value(STATS_HOVER_LATENCY, microclock() -
+		    mouse_t[manip_idx_frame % LAT_RING]);
+	}
+}
+
+static bool
+resolve_needed(const resolve_key_t *key)
+{
+	return (!last_resolve_valid ||
+	    memcmp(key, &last_resolve_key, sizeof (*key)) != 0);
+}
+
+static void
+obj_add(const char *objdir, const char *name, const vec3 offset)
+{
+	pick_obj_t *o;
+	char *cache_name, *p;
 
-static int		xpver = 0;
-static char		plugindir[512] = { 0 };
+	ASSERT(objdir != NULL);
+	ASSERT(name != NULL);
+	ASSERT3U(n_objs, <, MAX_OBJS);
 
-static GLuint		cursor_tex[2] = {};
-static GLuint		cursor_fbo = 0;
-static GLuint		cursor_pbo = 0;
-static bool		cursor_xfer = false;
-static uint16_t		manip_idx = UINT16_MAX;
+	o = &objs[n_objs++];
+	o->path = mkpathname(objdir, name, NULL);
+	fix_pathsep(o->path);
+	/* flatten any subdirectories into the cache file name */
+	cache_name = sprintf_alloc("%s.mgeom", name);
+	for (p = cache_name; *p != '\0'; p++) {
+		if (*p == '/' || *p == '\\')
+			*p = '_';
+	}
+	o->cache_path = mkpathname(plugindir, "cache", cache_name, NULL);
+	lacf_free(cache_name);
+	glm_vec3_copy((float *)offset, o->offset);
+}
 
-static uint64_t		last_draw_t = 0;
-static uint64_t		blink_start_t = 0;
-static uint16_t		prev_manip_idx = UINT16_MAX;
+/*
+ * Reads the list of objects to pick against from
+ * <plugindir>/manipdraw.cfg, which looks like this:
+ *
+ *	object/0/path = CL650_cockpit.obj
+ *	object/1/path = CL650_pedestal.obj
+ *	object/1/offset_x = 0.21
+ *	...
+ *
+ * Paths are relative to the aircraft's objects directory. The optional
+ * offset_x/_y/_z give the object's position in aircraft coordinates, in
+ * meters. The object indices in the file are the object indices in the
+ * pick IDs. Without the file, we just pick against CL650_cockpit.obj.
+ */
+static void
+objs_init(void)
+{
+	char *objdir = mkpathname(plugindir, "..", "..", "objects", NULL);
+	char *cfgpath = mkpathname(plugindir, "manipdraw.cfg", NULL);
+	conf_t *conf = NULL;
+	int errline;
 
-static shader_info_t generic_vert_info = { .filename = "generic.vert.spv" };
-static shader_info_t resolve_frag_info = { .filename = "resolve.frag.spv" };
-static shader_info_t paint_frag_info = { .filename = "paint.frag.spv" };
-static const shader_prog_info_t resolve_prog_info = {
-    .progname = "manipdraw_resolve",
-    .vert = &generic_vert_info,
-    .frag = &resolve_frag_info
-};
-static const shader_prog_info_t paint_prog_info = {
-    .progname = "manipdraw_paint",
-    .vert = &generic_vert_info,
-    .frag = &paint_frag_info
-};
-static shader_obj_t	resolve_shader = {};
-static shader_obj_t	paint_shader = {};
-static obj8_t		*obj = NULL;
+	ASSERT3P(objs, ==, NULL);
+	objs = safe_calloc(MAX_OBJS, sizeof (*objs));
+	n_objs = 0;
 
-enum {
-    U_PVM,
-    U_ALPHA,
-    NUM_UNIFORMS
-};
-static const char *uniforms[NUM_UNIFORMS] = {
-    [U_PVM] = "pvm",
-    [U_ALPHA] = "alpha"
-};
+	if (file_exists(cfgpath, NULL)) {
+		conf = conf_read_file(cfgpath, &errline);
+		if (conf == NULL) {
+			logMsg("%s: parse error on line %d, using default "
+			    "object list", cfgpath, errline);
+		}
+	}
+	if (conf != NULL) {
+		for (unsigned i = 0; i < MAX_OBJS; i++) {
+			const char *name;
+			double off[3] = { 0, 0, 0 };
+			vec3 offset;
+
+			if (!conf_get_str_v(conf, "object/%d/path", &name, i))
+				break;
+			conf_get_d_v(conf, "object/%d/offset_x", &off[0], i);
+			conf_get_d_v(conf, "object/%d/offset_y", &off[1], i);
+			conf_get_d_v(conf, "object/%d/offset_z", &off[2], i);
+			for (int j = 0; j < 3; j++)
+				offset[j] = off[j];
+			obj_add(objdir, name, offset);
+		}
+		conf_free(conf);
+	}
+	if (n_objs == 0)
+		obj_add(objdir, "CL650_cockpit.obj", GLM_VEC3_ZERO);
+
+	lacf_free(objdir);
+	lacf_free(cfgpath);
+}
 
 static void
-resolve_manip_complete(void)
+objs_fini(void)
 {
-	const uint16_t *data;
-
-	/* No transfer in progress, so allow caller to start a new update */
-	if (!cursor_xfer)
-		return;
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
 
-	ASSERT(cursor_pbo != 0);
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, cursor_pbo);
-	data = (const uint16_t *)glMapBuffer(GL_PIXEL_PACK_BUFFER,
-	    GL_READ_ONLY);
-	if (data != NULL) {
-		/* single pixel containing the clickspot index */
-		manip_idx = *data;
-		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		if (o->obj != NULL)
+			obj8_free(o->obj);
+		bvh_free(o->bvh);
+		mmesh_free(o->mesh);
+		mgeom_free(o->geom);
+		free(o->cands);
+		free(o->deps);
+		free(o->hover_rects);
+		lacf_free(o->path);
+		lacf_free(o->cache_path);
 	}
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-	cursor_xfer = false;
+	free(objs);
+	objs = NULL;
+	n_objs = 0;
+	have_all_geoms = have_all_meshes = have_all_bvhs = false;
 }
 
-static bool
-is_rev_float_z(void)
+/*
+ * Sets up the projection-view-model matrices of all objects for the
+ * view in `pvm', without touching their animation state.
+ */
+static void
+objs_set_pvm(const mat4 pvm)
 {
-	return (xpver >= 12000 || dr_geti(&drs.modern_drv) != 0 ||
-	    dr_geti(&drs.rev_float_z) != 0);
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+
+		if (!o->usable)
+			continue;
+		glm_mat4_copy((vec4 *)pvm, o->pvm);
+		glm_translate(o->pvm, o->offset);
+	}
 }
 
+/*
+ * Updates the animation state of all objects, along with their
+ * projection-view-model matrices for this frame.
+ */
 static void
-resolve_manip(int mouse_x, int mouse_y, const mat4 pvm)
+objs_update(const mat4 pvm)
 {
-	int vp[4];
+	objs_set_pvm(pvm);
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
 
-	ASSERT(pvm != NULL);
+		if (o->usable && o->geom != NULL)
+			mgeom_update(o->geom);
+	}
+}
 
-	resolve_manip_complete();
+/*
+ * Loads a single object, on the loader thread.
+ */
+static void
+load_obj(pick_obj_t *o)
+{
+	obj8_t *l_obj = NULL;
+	mgeom_t *l_geom;
+	bvh_t *l_bvh = NULL;
+	bool cached = false;
+	uint64_t t0, t1, t2, t3;
 
-	VERIFY3S(dr_getvi(&drs.viewport, vp, 0, 4), ==, 4);
+	ASSERT(o != NULL);
 
-	ASSERT(cursor_fbo != 0);
-	glBindFramebufferEXT(GL_FRAMEBUFFER, cursor_fbo);
-	glViewport(vp[0] - mouse_x, vp[1] - mouse_y, vp[2], vp[3]);
-	glEnable(GL_DEPTH_TEST);
-	glDepthMask(GL_TRUE);
-	if (is_rev_float_z()) {
-		glDepthFunc(GL_GREATER);
-		glClearDepth(0);
-	}
+	t0 = microclock();
 	/*
-	 * We want to set the FBO's color to 1, which is 0xFFFF in 16-bit.
-	 * That way, if nothing covers it, we know that there is no valid
-	 * manipulator there.
+	 * A valid cache gives us everything we need, so we can skip the
+	 * full parse. Caches are only ever written for geometry which
+	 * passed the manipulator count check below.
 	 */
-	glClearColor(1, 0, 0, 1);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glClearColor(0, 0, 0, 0);
-
-	shader_obj_bind(&resolve_shader);
-	glUniformMatrix4fv(shader_obj_get_u(&resolve_shader, U_PVM),
-	    1, GL_FALSE, (const GLfloat *)pvm);
-	ASSERT(obj != NULL);
-	obj8_set_render_mode(obj, OBJ8_RENDER_MODE_MANIP_ONLY);
-	obj8_draw_group(obj, NULL, shader_obj_get_prog(&resolve_shader), pvm);
-
-	ASSERT(cursor_pbo != 0);
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, cursor_pbo);
-	glReadPixels(0, 0, 1, 1, GL_RED, GL_UNSIGNED_SHORT, NULL);
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-	cursor_xfer = true;
+	l_geom = mcache_load(o->cache_path, o->path);
+	t1 = microclock();
+	if (l_geom != NULL) {
+		cached = true;
+		goto build;
+	}
+	l_obj = obj8_parse(o->path, ZERO_VECT3);
+	t1 = microclock();
 	/*
-	 * Restore original XP viewport & framebuffer binding.
+	 * The manipulator geometry is only used to speed up picking, so
+	 * failing to get it isn't fatal. We just pick the slow way.
 	 */
-	glDisable(GL_DEPTH_TEST);
-	glDepthMask(GL_FALSE);
-	if (is_rev_float_z()) {
-		glDepthFunc(GL_LESS);
-		glClearDepth(1);
+	if (l_obj != NULL)
+		l_geom = mgeom_parse(o->path);
+	if (l_geom != NULL &&
+	    l_geom->n_manips != obj8_get_num_manips(l_obj)) {
+		logMsg("%s: manipulator count mismatch (%d vs %d), disabling "
+		    "pick culling", o->path, l_geom->n_manips,
+		    obj8_get_num_manips(l_obj));
+		mgeom_free(l_geom);
+		l_geom = NULL;
+	}
+	if (l_geom != NULL && l_geom->n_manips >= UINT16_MAX) {
+		logMsg("%s: too many manipulators (%d), disabling pick "
+		    "culling", o->path, l_geom->n_manips);
+		mgeom_free(l_geom);
+		l_geom = NULL;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER, dr_geti(&drs.fbo));
-	glViewport(vp[0], vp[1], vp[2], vp[3]);
+	if (l_geom != NULL &&
+	    !mcache_write(o->cache_path, o->path, l_geom)) {
+		logMsg("%s: failed to write manipulator cache",
+		    o->cache_path);
+	}
+build:
+	t2 = microclock();
+	if (l_geom != NULL)
+		l_bvh = bvh_build(l_geom, loader.pool);
+	t3 = microclock();
+
+	o->obj = l_obj;
+	o->geom = l_geom;
+	o->bvh = l_bvh;
+	o->cached = cached;
+	o->obj_us = t1 - t0;
+	o->geom_us = t2 - t1;
+	o->bvh_us = t3 - t2;
 }
 
 static void
-paint_manip(const mat4 pvm)
+load_worker(void *unused)
 {
-	uint64_t now = microclock(), delta_t = 0;
-	int vp[4];
-	float alpha;
+	UNUSED(unused);
+	thread_set_name("manipdraw_load");
 
-	ASSERT(pvm != NULL);
+	/* only lives for the load, so it doesn't idle along with the sim */
+	loader.pool = taskpool_new(0);
+	for (unsigned i = 0; i < n_objs; i++)
+		load_obj(&objs[i]);
+	taskpool_destroy(loader.pool);
+	loader.pool = NULL;
+
+	mutex_enter(&loader.lock);
+	loader.done = true;
+	mutex_exit(&loader.lock);
+}
 
-	VERIFY3S(dr_getvi(&drs.viewport, vp, 0, 4), ==, 4);
+static void
+load_start(void)
+{
+	ASSERT(!loader.running);
 
-	if (manip_idx != prev_manip_idx || now - last_draw_t > SEC2USEC(0.2)) {
-		blink_start_t = now;
-		prev_manip_idx = manip_idx;
+	mutex_init(&loader.lock);
+	loader.done = false;
+	loader.start_t = microclock();
+	loader.running = true;
+	VERIFY(thread_create(&loader.thr, load_worker, NULL));
+}
+
+/*
+ * Reaps the loader thread and returns true once it's done. The results
+ * are left in `objs' for the caller to take over.
+ */
+static bool
+load_reap(bool wait)
+{
+	bool done;
+
+	if (!loader.running)
+		return (false);
+	mutex_enter(&loader.lock);
+	done = loader.done;
+	mutex_exit(&loader.lock);
+	if (!done && !wait)
+		return (false);
+	thread_join(&loader.thr);
+	mutex_destroy(&loader.lock);
+	loader.running = false;
+	return (true);
+}
+
+/*
+ * Main thread half of loading a single object: binds datarefs and
+ * uploads our manipulator mesh.
+ */
+static void
+load_complete_obj(pick_obj_t *o)
+{
+	uint64_t start;
+
+	ASSERT(o != NULL);
+
+	if (o->obj == NULL && o->geom == NULL) {
+		logMsg("%s: failed to load object, manipulator picking "
+		    "disabled for it", o->path);
+		return;
 	}
-	last_draw_t = now;
-	delta_t = (now - blink_start_t) % 1000000;
-	if (delta_t < 500000)
-		alpha = delta_t / 500000.0;
-	else
-		alpha = 1 - (delta_t - 500000) / 500000.0;
+	start = microclock();
+	if (o->geom != NULL) {
+		mgeom_bind_drs(o->geom);
+		o->cands = safe_calloc(MAX(o->geom->n_manips, 1),
+		    sizeof (*o->cands));
+		o->deps = safe_calloc(MAX(o->geom->n_manips, 1),
+		    sizeof (*o->deps));
+		o->hover_rects = safe_calloc(MAX(o->geom->n_manips, 1),
+		    sizeof (*o->hover_rects));
+		/*
+		 * Once we have our own manipulator mesh, nothing needs the
+		 * full visual object anymore, so drop it and its memory.
+		 */
+		o->mesh = mmesh_new(o->geom);
+		if (o->obj != NULL) {
+			obj8_free(o->obj);
+			o->obj = NULL;
+		}
+	}
+	if (o->cached) {
+		logMsg("Loaded %s (cache %.1f ms, BVH %.1f ms, upload "
+		    "%.1f ms)", o->path, o->obj_us / 1000.0,
+		    o->bvh_us / 1000.0, (microclock() - start) / 1000.0);
+	} else {
+		logMsg("Loaded %s (obj8 parse %.1f ms, manipulator geometry "
+		    "%.1f ms, BVH %.1f ms, upload %.1f ms)", o->path,
+		    o->obj_us / 1000.0, o->geom_us / 1000.0,
+		    o->bvh_us / 1000.0, (microclock() - start) / 1000.0);
+	}
+	o->usable = true;
+}
+
+/*
+ * Main thread half of loading, run from the draw callback once the
+ * worker is done with all objects.
+ */
+static void
+load_complete(void)
+{
+	unsigned n_usable = 0;
+
+	if (!load_reap(false))
+		return;
+	have_all_geoms = have_all_meshes = have_all_bvhs = true;
+	pub_bvh_build_us = pub_bvh_nodes = 0;
+	for (unsigned i = 0; i < n_objs; i++) {
+		pick_obj_t *o = &objs[i];
+
+		load_complete_obj(o);
+		if (!o->usable)
+			continue;
+		n_usable++;
+		if (o->bvh != NULL) {
+			pub_bvh_build_us += o->bvh_us;
+			pub_bvh_nodes += bvh_get_num_nodes(o->bvh);
+		}
+		have_all_geoms = (have_all_geoms && o->geom != NULL);
+		have_all_meshes = (have_all_meshes && o->mesh != NULL);
+		have_all_bvhs = (have_all_bvhs && o->bvh != NULL);
+	}
+	logMsg("Loaded %d of %d objects in %.1f ms", n_usable, n_objs,
+	    (microclock() - loader.start_t) / 1000.0);
+	obj_ready = (n_usable != 0);
+	if (!obj_ready)
+		logMsg("No objects to pick, manipulator picking disabled");
+	memset(&loader, 0, sizeof (loader));
+}
+
+/*
+ * Abandons a load in progress. The worker can't be interrupted in the
+ * middle of a parse, so this waits for it to finish. Whatever it
+ * loaded is freed along with the objects by objs_fini().
+ */
+static void
+load_abort(void)
+{
+	if (load_reap(true))
+		memset(&loader, 0, sizeof (loader));
+}
+
+static void
+record_stop(void)
+{
+	rec_writer_close(recorder);
+	recorder = NULL;
+	free(rec_dr_values);
+	rec_dr_values = NULL;
+}
+
+static void
+record_start(void)
+{
+	char *dir = mkpathname(plugindir, "recordings", NULL);
+	char *filename = sprintf_alloc("rec-%llu.mdrec",
+	    (unsigned long long)time(NULL));
+	char *path = mkpathname(dir, filename, NULL);
+	const mgeom_t *geoms[MAX_OBJS];
+	unsigned n_drs = 0;
 
-	shader_obj_bind(&paint_shader);
-	glUniformMatrix4fv(shader_obj_get_u(&paint_shader, U_PVM),
-	    1, GL_FALSE, (const GLfloat *)pvm);
-	glUniform1f(shader_obj_get_u(&paint_shader, U_ALPHA), alpha);
-	ASSERT(obj != NULL);
-	glEnable(GL_BLEND);
-	obj8_set_render_mode2(obj, OBJ8_RENDER_MODE_MANIP_ONLY_ONE, manip_idx);
-	obj8_draw_group(obj, NULL, shader_obj_get_prog(&paint_shader), pvm);
+	ASSERT3P(recorder, ==, NULL);
+	for (unsigned i = 0; i < n_objs; i++) {
+		geoms[i] = objs[i].geom;
+		if (geoms[i] != NULL)
+			n_drs += geoms[i]->n_drs;
+	}
+	create_directory_recursive(dir);
+	recorder = rec_writer_open(path, geoms, n_objs);
+	if (recorder != NULL) {
+		logMsg("Recording to %s", path);
+		rec_dr_values = safe_calloc(MAX(n_drs, 1),
+		    sizeof (*rec_dr_values));
+	} else {
+		record_req = 0;
+	}
+	lacf_free(dir);
+	lacf_free(filename);
+	lacf_free(path);
+}
+
+static void
+record_frame(const frame_ctx_t *ctx, const resolve_key_t *key)
+{
+	rec_frame_t frame = {
+	    .data = {
+		.mouse_x = key->pts[0].x,
+		.mouse_y = key->pts[0].y,
+		.rev_float_z = ctx->rev_z
+	    },
+	    .dr_values = rec_dr_values
+	};
+
+	if (record_req && recorder == NULL)
+		record_start();
+	else if (!record_req && recorder != NULL)
+		record_stop();
+	if (recorder == NULL)
+		return;
+
+	memcpy(frame.data.vp, key->vp, sizeof (frame.data.vp));
+	memcpy(frame.data.acf_matrix, key->acf_matrix,
+	    sizeof (frame.data.acf_matrix));
+	memcpy(frame.data.proj_matrix, key->proj_matrix,
+	    sizeof (frame.data.proj_matrix));
+	for (unsigned i = 0, j = 0; i < n_objs; i++) {
+		const mgeom_t *geom = objs[i].geom;
+
+		if (geom == NULL)
+			continue;
+		for (unsigned k = 0; k < geom->n_drs; k++)
+			rec_dr_values[j++] = geom->drs[k].value;
+	}
+	if (!rec_writer_frame(recorder, &frame)) {
+		logMsg("Error writing recording, stopping");
+		record_stop();
+		record_req = 0;
+	}
+}
+
+/*
+ * Updates the mouse result datarefs from the newest pick results.
+ */
+static void
+pub_result(bool mouse_on_screen)
+{
+	manipdraw_result_t res = {
+	    .obj_idx = -1, .manip_idx = -1, .manip_type = -1, .depth = -1,
+	    .frame = manip_idx_frame
+	};
+
+	if (mouse_on_screen && pick_res_n != 0)
+		result_fill(&res, 0);
+	pub_obj_idx = res.obj_idx;
+	pub_manip_idx = res.manip_idx;
+	pub_manip_type = res.manip_type;
+	pub_hit_depth = res.depth;
+	pub_frame = res.frame;
+}
 
-	glViewport(vp[0], vp[1], vp[2], vp[3]);
+/*
+ * Starts or stops the shader watcher to follow manipdraw/dev/shader_reload
+ * and reloads our shaders if it saw something change. Without the
+ * watcher, this is just a couple of flag tests.
+ */
+static void
+shaders_reload_check(void)
+{
+	if ((shader_reload != 0) != shwatch_is_running()) {
+		if (shader_reload != 0)
+			shwatch_start(shader_dir);
+		else
+			shwatch_stop();
+	}
+	if (!shwatch_changed())
+		return;
+	progcache_reload_check(&resolve_shader);
+	progcache_reload_check(&resolve_mesh_shader);
+	if (have_multi_pick)
+		progcache_reload_check(&resolve_multi_shader);
+	if (have_compute_pick)
+		progcache_reload_check(&resolve_ray_shader);
+	progcache_reload_check(&paint_shader);
+	progcache_reload_check(&highlight_shader);
+	/* anything reloaded was relinked and lost its uniforms */
+	glstate_forget_uniforms();
 }
 
+/*
+ * Starts a new pick frame. Returns false if we can't pick yet.
+ */
 static bool
-should_draw_manip(uint16_t manip_idx)
+frame_begin(void)
 {
-	const obj8_manip_t *manip;
+	frame_num++;
+	if (cursor_xfer_depth_req != (int)cursor_xfer_depth)
+		cursor_xfer_reinit();
 
-	if (manip_idx == UINT16_MAX)
-		return (false);
-	ASSERT(obj != NULL);
-	manip = obj8_get_manip(obj, manip_idx);
-	return (manip->type != OBJ8_MANIP_NOOP);
+	if (!obj_ready) {
+		load_complete();
+		if (!obj_ready)
+			return (false);
+		pub_ready = 1;
+	}
+	return (true);
 }
 
-static int
-draw_cb(XPLMDrawingPhase phase, int before, void *refcon)
+static bool
+vr_picking(void)
 {
-	int mouse_x, mouse_y;
-	int vp[4];
-	mat4 proj_matrix, acf_matrix, pvm;
+	return (vr_rays != NULL && have_vr_dr && dr_geti(&drs.vr_enabled) != 0);
+}
 
-	UNUSED(phase);
-	UNUSED(before);
-	UNUSED(refcon);
+/*
+ * Picks with the registered controller rays. Without a pick point, the
+ * results go to zeroed slots, which also keeps hover_coherent() off.
+ */
+static void
+vr_resolve(const frame_ctx_t *ctx)
+{
+	pick_pt_t pts[MANIPDRAW_MAX_VR_RAYS] = {};
+	vec3 orig[MANIPDRAW_MAX_VR_RAYS], dir[MANIPDRAW_MAX_VR_RAYS];
+	unsigned n = MIN(vr_rays->n_rays, MANIPDRAW_MAX_VR_RAYS);
+	bool compute = (have_compute_pick && have_all_meshes &&
+	    (backend == BACKEND_COMPUTE || !have_all_bvhs));
+
+	ASSERT(ctx != NULL);
+	ASSERT(vr_rays != NULL);
+
+	objs_update(ctx->pvm);
+	resolve_manip_complete();
+	if (n == 0) {
+		pick_store_none(pts, 1, frame_num);
+		return;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		glm_vec3_copy(vr_rays->orig[i], orig[i]);
+		glm_vec3_copy(vr_rays->dir[i], dir[i]);
+	}
+	stats_begin(STATS_RESOLVE);
+	if (compute) {
+		cursor_xfer_t *xfer = &cursor_xfer[cursor_xfer_head];
+
+		/* controller rays can point anywhere, so don't cull */
+		if (!xfer->busy) {
+			resolve_rays_compute(ctx, xfer, pts,
+			    (const vec3 *)orig, (const vec3 *)dir, n, false);
+		}
+	} else if (have_all_bvhs) {
+		resolve_rays_bvh(ctx, pts, (const vec3 *)orig,
+		    (const vec3 *)dir, n);
+	} else {
+		pick_store_none(pts, n, frame_num);
+	}
+	stats_end(STATS_RESOLVE);
+}
+
+static void
+vr_publish(void)
+{
+	for (unsigned i = 0; i < MANIPDRAW_MAX_VR_RAYS; i++) {
+		manipdraw_result_t *res = &vr_rays->result[i];
+
+		if (i < pick_res_n && i < vr_rays->n_rays) {
+			result_fill(res, i);
+		} else {
+			res->obj_idx = -1;
+			res->manip_idx = -1;
+			res->manip_type = -1;
+			res->depth = -1;
+			res->frame = manip_idx_frame;
+		}
+	}
+	pub_result(true);
+}
+
+/*
+ * Called for every eye. Only the first call in a frame picks, the rest
+ * only paint the result into their own eye's view.
+ */
+static void
+draw_manips_vr(void)
+{
+	frame_ctx_t ctx;
+	bool hover;
+
+	if (vr_pick_frame == vr_sim_frame) {
+		if (!obj_ready)
+			return;
+		frame_ctx_init(&ctx);
+		/* this is the 3D phase, so we can't assume the GL state */
+		glstate_begin_probe(ctx.fbo, ctx.vp);
+		/*
+		 * The animations were updated for the first eye, we only
+		 * need this eye's matrices for the obj8 paint fallback.
+		 */
+		objs_set_pvm(ctx.pvm);
+	} else {
+		vr_pick_frame = vr_sim_frame;
+		if (!frame_begin())
+			return;
+		shaders_reload_check();
+		frame_ctx_init(&ctx);
+		glstate_begin_probe(ctx.fbo, ctx.vp);
+		vr_resolve(&ctx);
+	}
+	resolve_manip_complete();
+	vr_publish();
+	hover = should_draw_manip(pick_id);
+	if (hover || hl_ext_n > 0) {
+		stats_begin(STATS_PAINT);
+		paint_highlights(&ctx, hover, 0);
+		stats_end(STATS_PAINT);
+	}
+	glstate_end();
+}
+
+static void
+draw_manips(void)
+{
+	int mouse_x, mouse_y, n_ext;
+	unsigned n_queries;
+	frame_ctx_t ctx;
+	const int *vp = ctx.vp;
+	resolve_key_t key;
+	mat4 pick_region;
+	bool mouse_on_screen, hover;
+
+	/* in VR, draw_manips_vr() does all of the picking */
+	if (vr_picking() || !frame_begin())
+		return;
 
+	frame_ctx_init(&ctx);
 	XPLMGetMouseLocationGlobal(&mouse_x, &mouse_y);
-	VERIFY3S(dr_getvi(&drs.viewport, vp, 0, 4), ==, 4);
+	mouse_t[frame_num % LAT_RING] = microclock();
 
-	if (mouse_x < vp[0] || mouse_x > vp[0] + vp[2] ||
-	    mouse_y < vp[1] || mouse_y > vp[1] + vp[3]) {
+	mouse_on_screen = (mouse_x >= vp[0] && mouse_x <= vp[0] + vp[2] &&
+	    mouse_y >= vp[1] && mouse_y <= vp[1] + vp[3]);
+	n_ext = clampi(pick_ext_n_pts, 0, PICK_MAX_EXT_PTS);
+	n_queries = queries_num_active();
+	if (!mouse_on_screen && n_ext == 0 && n_queries == 0 &&
+	    hl_ext_n <= 0) {
 		/* Mouse off-screen, don't draw anything */
-		return (1);
+		pub_result(false);
+		return;
 	}
 	/*
-	 * Mouse is somewhere on the screen. Redraw the manipulator stack.
+	 * Mouse is somewhere on the screen, or somebody else wants to
+	 * know what's under their points. Redraw the manipulator stack.
 	 */
-	shader_obj_reload_check(&resolve_shader);
-	shader_obj_reload_check(&paint_shader);
+	shaders_reload_check();
+	glstate_begin(ctx.fbo, ctx.vp);
 
-	dr_getvf32(&drs.acf_matrix, (float *)acf_matrix, 0, 16);
-	dr_getvf32(&drs.proj_matrix_3d, (float *)proj_matrix, 0, 16);
-	glm_mat4_mul(proj_matrix, acf_matrix, pvm);
+	memset(&key, 0, sizeof (key));
+	key.n_pts = 1 + n_ext;
+	key.pts[0].x = mouse_x;
+	key.pts[0].y = mouse_y;
+	for (int i = 0; i < n_ext; i++) {
+		key.pts[i + 1].x = pick_ext_pts[2 * i];
+		key.pts[i + 1].y = pick_ext_pts[2 * i + 1];
+	}
+	queries_assign(&key);
+	memcpy(key.vp, vp, sizeof (key.vp));
+	glm_mat4_copy(ctx.acf_matrix, key.acf_matrix);
+	glm_mat4_copy(ctx.proj_matrix, key.proj_matrix);
+	key.backend = backend;
+	key.tol = pick_tol_dim();
+	key.tol_mode = pick_tol_mode_get();
+	objs_update(ctx.pvm);
+	key_pick_region(&key, pick_region);
+	key_anim_gens(&key, pick_region);
+	if (objs_changed() ||
+	    memcmp(ctx.vp, prev_view.vp, sizeof (ctx.vp)) != 0 ||
+	    memcmp(ctx.acf_matrix, prev_view.acf_matrix,
+	    sizeof (ctx.acf_matrix)) != 0 ||
+	    memcmp(ctx.proj_matrix, prev_view.proj_matrix,
+	    sizeof (ctx.proj_matrix)) != 0) {
+		view_change_frame = frame_num;
+		prev_view = ctx;
+	}
+	record_frame(&ctx, &key);
+	rsched_frame(mouse_x, mouse_y, key.acf_matrix);
 
 	UNUSED(resolve_manip);
-	resolve_manip(mouse_x, mouse_y, pvm);
-	if (should_draw_manip(manip_idx))
-		paint_manip(pvm);
-	glUseProgram(0);
+	paint_cond_query = 0;
+	if (backend == BACKEND_GPU)
+		scrcache_update(&ctx, &key);
+	if (backend == BACKEND_GPU &&
+	    scrcache_lookup(&ctx, key.pts, key.n_pts)) {
+		/*
+		 * Static camera, the cached ID buffer has the answer. This
+		 * supersedes anything still in flight in the ring.
+		 */
+		last_resolve_key = key;
+		last_resolve_valid = true;
+		deps_save(pick_region);
+	} else if (!resolve_needed(&key) ||
+	    (!low_latency(&key) && !rsched_should_resolve())) {
+		/*
+		 * Nothing moved, so the last result still stands, or things
+		 * move slowly enough for the scheduler to let it stand for
+		 * a little longer. We only need to collect it if it's still
+		 * in flight.
+		 */
+		resolve_manip_complete();
+	} else if (key.n_pts == 1 &&
+	    hover_coherent(&ctx, key.pts[0].x, key.pts[0].y)) {
+		/*
+		 * Only the mouse moved, and not by enough to leave the
+		 * manipulator it's over. Keep the result as it is.
+		 */
+		last_resolve_key = key;
+	} else {
+		/* the ray casters can't do the tolerance region */
+		bool rays = (key.tol == 1);
+		bool resolved;
+		uint64_t start = microclock();
+
+		stats_begin(STATS_RESOLVE);
+		if (rays && ((backend == BACKEND_BVH && have_all_bvhs) ||
+		    low_latency(&key))) {
+			resolve_manip_bvh(&ctx, key.pts, key.n_pts);
+			resolved = true;
+		} else if (rays && backend == BACKEND_COMPUTE &&
+		    have_compute_pick && have_all_meshes) {
+			resolved = resolve_manip_compute(&ctx, key.pts,
+			    key.n_pts);
+		} else {
+			resolved = resolve_manip(&ctx, key.pts, key.n_pts);
+		}
+		stats_end(STATS_RESOLVE);
+		rsched_resolved(microclock() - start);
+		last_resolve_valid = resolved;
+		if (resolved) {
+			last_resolve_key = key;
+			last_resolve_frame = frame_num;
+			deps_save(pick_region);
+		}
+	}
+	hover = (mouse_on_screen && should_draw_manip(pick_id));
+	if (hover || hl_ext_n > 0) {
+		stats_begin(STATS_PAINT);
+		paint_highlights(&ctx, hover, paint_cond_query);
+		stats_end(STATS_PAINT);
+	}
+	latency_sample();
+	glstate_end();
+	pub_result(mouse_on_screen);
+	queries_publish();
+}
+
+static float
+vr_floop_cb(float elapsed_since_last_call, float elapsed_since_last_floop,
+    int counter, void *refcon)
+{
+	UNUSED(elapsed_since_last_call);
+	UNUSED(elapsed_since_last_floop);
+	UNUSED(counter);
+	UNUSED(refcon);
+
+	vr_sim_frame++;
+
+	return (-1);
+}
+
+static int
+draw_vr_cb(XPLMDrawingPhase phase, int before, void *refcon)
+{
+	UNUSED(phase);
+	UNUSED(before);
+	UNUSED(refcon);
+
+	if (vr_picking())
+		draw_manips_vr();
+
+	return (1);
+}
+
+static int
+draw_cb(XPLMDrawingPhase phase, int before, void *refcon)
+{
+	UNUSED(phase);
+	UNUSED(before);
+	UNUSED(refcon);
+
+	stats_frame();
+	stats_begin(STATS_DRAW);
+	draw_manips();
+	stats_end(STATS_DRAW);
 
 	return (1);
 }
@@ -265,16 +3200,21 @@ create_cursor_objects(void)
 {
 	/*
 	 * Create the textures which will hold the rendered manipulator
-	 * pixel right under the user's cursor spot. We need two textures
-	 * here, one to hold the manipulator ID (16-bit single-channel
-	 * texture, using the GL_RED channel), and another one to hold
-	 * the depth buffer (to properly handle depth and occlusion).
+	 * pixels right under the user's cursor spot, plus as many more
+	 * for every other pick point in the batch. Each point gets up to
+	 * a PICKREDUCE_MAX_DIM square for the hover tolerance. We need
+	 * two textures here, one to hold the manipulator ID (16-bit
+	 * two-channel texture, with the manipulator index in GL_RED and
+	 * the object index in GL_GREEN), and another one to hold the depth
+	 * buffer (to properly handle depth and occlusion).
 	 */
 	glGenTextures(ARRAY_NUM_ELEM(cursor_tex), cursor_tex);
 	VERIFY(cursor_tex[0] != 0);
-	setup_texture(cursor_tex[0], GL_R16, 1, 1,
-	    GL_RED, GL_UNSIGNED_SHORT, NULL);
-	setup_texture(cursor_tex[1], GL_DEPTH_COMPONENT32F, 1, 1,
+	setup_texture(cursor_tex[0], GL_RG16,
+	    PICK_MAX_PTS * PICKREDUCE_MAX_DIM, PICKREDUCE_MAX_DIM,
+	    GL_RG, GL_UNSIGNED_SHORT, NULL);
+	setup_texture(cursor_tex[1], GL_DEPTH_COMPONENT32F,
+	    PICK_MAX_PTS * PICKREDUCE_MAX_DIM, PICKREDUCE_MAX_DIM,
 	    GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
 	/*
 	 * Set up the framebuffer object. This will be the target to draw
@@ -285,25 +3225,14 @@ create_cursor_objects(void)
 	VERIFY(cursor_fbo != 0);
 	setup_color_fbo_for_tex(cursor_fbo, cursor_tex[0], cursor_tex[1], 0,
 	    false);
-	/*
-	 * Set up the back-transfer pixel buffer. This is used to retrieve
-	 * the manipulator render result back from GPU VRAM.
-	 */
-	glGenBuffers(1, &cursor_pbo);
-	VERIFY(cursor_pbo != 0);
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, cursor_pbo);
-	glBufferData(GL_PIXEL_PACK_BUFFER, sizeof (uint16_t), NULL,
-	    GL_STREAM_READ);
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	cursor_xfer_init();
 }
 
 static void
 destroy_cursor_objects(void)
 {
-	if (cursor_pbo != 0) {
-		glDeleteBuffers(1, &cursor_pbo);
-		cursor_pbo = 0;
-	}
+	scrcache_fini();
+	cursor_xfer_fini();
 	if (cursor_fbo != 0) {
 		glDeleteFramebuffers(1, &cursor_fbo);
 		cursor_fbo = 0;
@@ -396,10 +3325,38 @@ XPluginStop(void)
 	log_fini();
 }
 
+static void
+our_drs_fini(void)
+{
+	dr_delete(&our_drs.xfer_depth);
+	dr_delete(&our_drs.backend);
+	dr_delete(&our_drs.latency_mode);
+	dr_delete(&our_drs.scrcache_div);
+	dr_delete(&our_drs.record);
+	dr_delete(&our_drs.shader_reload);
+	dr_delete(&our_drs.rev_z);
+	dr_delete(&our_drs.ready);
+	dr_delete(&our_drs.obj_idx);
+	dr_delete(&our_drs.manip_idx);
+	dr_delete(&our_drs.manip_type);
+	dr_delete(&our_drs.hit_depth);
+	dr_delete(&our_drs.frame);
+	dr_delete(&our_drs.pick_n_pts);
+	dr_delete(&our_drs.pick_pts);
+	dr_delete(&our_drs.pick_res);
+	dr_delete(&our_drs.pick_tol);
+	dr_delete(&our_drs.pick_tol_mode);
+	dr_delete(&our_drs.hl_n);
+	dr_delete(&our_drs.hl_ids);
+	dr_delete(&our_drs.hl_alpha);
+	dr_delete(&our_drs.bvh_build_us);
+	dr_delete(&our_drs.bvh_nodes);
+}
+
 PLUGIN_API int
 XPluginEnable(void)
 {
-	char *shader_dir, *obj_path;
+	char *prog_cache_dir;
 
 	fdr_find(&drs.fbo, "sim/graphics/view/current_gl_fbo");
 	fdr_find(&drs.viewport, "sim/graphics/view/viewport");
@@ -412,28 +3369,122 @@ XPluginEnable(void)
 	    "sim/graphics/view/using_modern_driver")) {
 		ASSERT3S(xpver, >=, 12000);
 	}
+	have_vr_dr = dr_find(&drs.vr_enabled, "sim/graphics/VR/enabled");
+	rev_float_z = is_rev_float_z();
+	pub_rev_z = rev_float_z;
+	dr_create_i(&our_drs.xfer_depth, &cursor_xfer_depth_req, true,
+	    "manipdraw/xfer_depth");
+	dr_create_i(&our_drs.backend, &backend, true, "manipdraw/backend");
+	dr_create_i(&our_drs.latency_mode, &latency_mode, true,
+	    "manipdraw/latency_mode");
+	dr_create_i(&our_drs.scrcache_div, &scrcache_div, true,
+	    "manipdraw/scrcache_div");
+	dr_create_i(&our_drs.record, &record_req, true, "manipdraw/record");
+	dr_create_i(&our_drs.shader_reload, &shader_reload, true,
+	    "manipdraw/dev/shader_reload");
+	dr_create_i(&our_drs.rev_z, &pub_rev_z, false, "manipdraw/dev/rev_z");
+	dr_create_i(&our_drs.ready, &pub_ready, false, "manipdraw/ready");
+	dr_create_i(&our_drs.obj_idx, &pub_obj_idx, false,
+	    "manipdraw/obj_idx");
+	dr_create_i(&our_drs.manip_idx, &pub_manip_idx, false,
+	    "manipdraw/manip_idx");
+	dr_create_i(&our_drs.manip_type, &pub_manip_type, false,
+	    "manipdraw/manip_type");
+	dr_create_f(&our_drs.hit_depth, &pub_hit_depth, false,
+	    "manipdraw/hit_depth");
+	dr_create_i(&our_drs.frame, &pub_frame, false, "manipdraw/frame");
+	for (unsigned i = 0; i < ARRAY_NUM_ELEM(pick_ext_res); i++)
+		pick_ext_res[i] = -1;
+	dr_create_i(&our_drs.pick_n_pts, &pick_ext_n_pts, true,
+	    "manipdraw/pick/n_points");
+	dr_create_vi(&our_drs.pick_pts, pick_ext_pts,
+	    ARRAY_NUM_ELEM(pick_ext_pts), true, "manipdraw/pick/points");
+	dr_create_vi(&our_drs.pick_res, pick_ext_res,
+	    ARRAY_NUM_ELEM(pick_ext_res), false, "manipdraw/pick/results");
+	dr_create_i(&our_drs.pick_tol, &pick_tol, true,
+	    "manipdraw/pick/tolerance");
+	dr_create_i(&our_drs.pick_tol_mode, &pick_tol_mode, true,
+	    "manipdraw/pick/tolerance_mode");
+	dr_create_i(&our_drs.hl_n, &hl_ext_n, true, "manipdraw/highlight/n");
+	dr_create_vi(&our_drs.hl_ids, hl_ext_ids, ARRAY_NUM_ELEM(hl_ext_ids),
+	    true, "manipdraw/highlight/ids");
+	dr_create_vf32(&our_drs.hl_alpha, hl_ext_alpha,
+	    ARRAY_NUM_ELEM(hl_ext_alpha), true, "manipdraw/highlight/alpha");
+	dr_create_i(&our_drs.bvh_build_us, &pub_bvh_build_us, false,
+	    "manipdraw/stats/bvh/build_us");
+	dr_create_i(&our_drs.bvh_nodes, &pub_bvh_nodes, false,
+	    "manipdraw/stats/bvh/nodes");
+	stats_init();
+	rsched_init();
+	glstate_init();
 	VERIFY(XPLMRegisterDrawCallback(draw_cb, xplm_Phase_Window, 1, NULL));
+	VERIFY(XPLMRegisterDrawCallback(draw_vr_cb, xplm_Phase_Modern3D, 0,
+	    NULL));
+	XPLMRegisterFlightLoopCallback(vr_floop_cb, -1, NULL);
 
 	create_cursor_objects();
 
 	shader_dir = mkpathname(plugindir, "shaders", NULL);
-	if (!shader_obj_init(&resolve_shader, shader_dir, &resolve_prog_info,
-	    NULL, 0, uniforms, NUM_UNIFORMS) ||
-	    !shader_obj_init(&paint_shader, shader_dir, &paint_prog_info,
-	    NULL, 0, uniforms, NUM_UNIFORMS)) {
+	prog_cache_dir = mkpathname(plugindir, "cache", "shaders", NULL);
+	if (!progcache_init(&resolve_shader, shader_dir, prog_cache_dir,
+	    &resolve_prog_info, NULL, 0, uniforms, NUM_UNIFORMS) ||
+	    !progcache_init(&resolve_mesh_shader, shader_dir, prog_cache_dir,
+	    &resolve_mesh_prog_info, NULL, 0, uniforms, NUM_UNIFORMS) ||
+	    !progcache_init(&paint_shader, shader_dir, prog_cache_dir,
+	    &paint_prog_info, NULL, 0, uniforms, NUM_UNIFORMS) ||
+	    !progcache_init(&highlight_shader, shader_dir, prog_cache_dir,
+	    &highlight_prog_info, NULL, 0, uniforms, NUM_UNIFORMS)) {
 		goto errout;
 	}
-	obj_path = mkpathname(plugindir, "..", "..", "objects",
-	    "CL650_cockpit.obj", NULL);
-	obj = obj8_parse(obj_path, ZERO_VECT3);
-	lacf_free(obj_path);
-	if (obj == NULL)
-		goto errout;
+	hl_mesh = hlmesh_new();
+	/*
+	 * The single-pass batched pick needs instancing and clip distances.
+	 * Without it, we fall back to drawing the pick points one by one.
+	 */
+	have_multi_pick = (GLEW_VERSION_3_1 &&
+	    progcache_init(&resolve_multi_shader, shader_dir, prog_cache_dir,
+	    &resolve_multi_prog_info, NULL, 0, uniforms, NUM_UNIFORMS));
+	/*
+	 * The compute backend needs compute shaders, storage buffers and
+	 * buffer clears, all of which are core in GL 4.3. Without them,
+	 * selecting it falls back to the GPU backend.
+	 */
+	have_compute_pick = ((GLEW_VERSION_4_3 ||
+	    (GLEW_ARB_compute_shader &&
+	    GLEW_ARB_shader_storage_buffer_object &&
+	    GLEW_ARB_clear_buffer_object)) &&
+	    progcache_init(&resolve_ray_shader, shader_dir, prog_cache_dir,
+	    &resolve_ray_prog_info, NULL, 0, uniforms, NUM_UNIFORMS));
+	if (have_compute_pick) {
+		glGenBuffers(1, &compute_res_buf);
+		VERIFY(compute_res_buf != 0);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, compute_res_buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, COMPUTE_RES_SIZE, NULL,
+		    GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+	objs_init();
+	load_start();
 
-	lacf_free(shader_dir);
+	lacf_free(prog_cache_dir);
 	return (1);
 errout:
+	/* unwind in reverse, the same as XPluginDisable() */
+	progcache_fini(&highlight_shader);
+	progcache_fini(&paint_shader);
+	progcache_fini(&resolve_mesh_shader);
+	progcache_fini(&resolve_shader);
 	lacf_free(shader_dir);
+	shader_dir = NULL;
+	lacf_free(prog_cache_dir);
+	destroy_cursor_objects();
+	XPLMUnregisterFlightLoopCallback(vr_floop_cb, NULL);
+	XPLMUnregisterDrawCallback(draw_vr_cb, xplm_Phase_Modern3D, 0, NULL);
+	XPLMUnregisterDrawCallback(draw_cb, xplm_Phase_Window, 1, NULL);
+	glstate_fini();
+	rsched_fini();
+	stats_fini();
+	our_drs_fini();
 	return (0);
 }
 
@@ -441,20 +3492,90 @@ PLUGIN_API void
 XPluginDisable(void)
 {
 	XPLMUnregisterDrawCallback(draw_cb, xplm_Phase_Window, 1, NULL);
+	XPLMUnregisterDrawCallback(draw_vr_cb, xplm_Phase_Modern3D, 0, NULL);
+	XPLMUnregisterFlightLoopCallback(vr_floop_cb, NULL);
+	our_drs_fini();
+	record_stop();
+	record_req = 0;
+	pub_ready = 0;
+	pub_obj_idx = -1;
+	pub_manip_idx = -1;
+	pub_manip_type = -1;
+	pub_hit_depth = -1;
+	pub_frame = 0;
+	memset(queries, 0, sizeof (queries));
+	vr_rays = NULL;
 
+	load_abort();
+	obj_ready = false;
 	destroy_cursor_objects();
-	shader_obj_fini(&resolve_shader);
-	shader_obj_fini(&paint_shader);
-	if (obj != NULL) {
-		obj8_free(obj);
-		obj = NULL;
+	stats_fini();
+	rsched_fini();
+	glstate_fini();
+	progcache_fini(&resolve_shader);
+	progcache_fini(&resolve_mesh_shader);
+	progcache_fini(&resolve_multi_shader);
+	have_multi_pick = false;
+	progcache_fini(&resolve_ray_shader);
+	have_compute_pick = false;
+	if (compute_res_buf != 0) {
+		glDeleteBuffers(1, &compute_res_buf);
+		compute_res_buf = 0;
 	}
+	progcache_fini(&paint_shader);
+	progcache_fini(&highlight_shader);
+	hlmesh_free(hl_mesh);
+	hl_mesh = NULL;
+	shwatch_stop();
+	lacf_free(shader_dir);
+	shader_dir = NULL;
+	objs_fini();
+	pick_id = PICK_NONE;
+	pick_res_n = 0;
+	last_resolve_valid = false;
 }
 
 PLUGIN_API void
 XPluginReceiveMessage(XPLMPluginID from, int msg, void *param)
 {
 	UNUSED(from);
-	UNUSED(msg);
-	UNUSED(param);
+
+	switch (msg) {
+	case MANIPDRAW_MSG_GET_RESULT: {
+		manipdraw_result_t *res = param;
+
+		if (res == NULL || res->version != MANIPDRAW_API_VERSION)
+			break;
+		res->obj_idx = pub_obj_idx;
+		res->manip_idx = pub_manip_idx;
+		res->manip_type = pub_manip_type;
+		res->depth = pub_hit_depth;
+		res->frame = manip_idx_frame;
+		break;
+	}
+	case MANIPDRAW_MSG_QUERY_ADD:
+	case MANIPDRAW_MSG_QUERY_REMOVE: {
+		manipdraw_query_t *q = param;
+
+		if (q == NULL || q->version != MANIPDRAW_API_VERSION)
+			break;
+		if (msg == MANIPDRAW_MSG_QUERY_ADD)
+			query_add(q);
+		else
+			query_remove(q);
+		break;
+	}
+	case MANIPDRAW_MSG_VR_RAYS_SET:
+	case MANIPDRAW_MSG_VR_RAYS_CLEAR: {
+		manipdraw_vr_rays_t *rays = param;
+
+		if (rays == NULL || rays->version != MANIPDRAW_API_VERSION)
+			break;
+		if (msg == MANIPDRAW_MSG_VR_RAYS_SET)
+			vr_rays = rays;
+		else if (vr_rays == rays)
+			vr_rays = NULL;
+		break;
+	}
+	}
 }
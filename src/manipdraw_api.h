@@ -0,0 +1,186 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_MANIPDRAW_API_H_
+#define	_MANIPDRAW_API_H_
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Public interface for other plugins which want to know which cockpit
+ * manipulator is under the mouse, or under points of their own, without
+ * rendering the manipulators again themselves. This header has no
+ * dependencies on manipdraw internals and can be copied into consumer
+ * projects as-is.
+ *
+ * The mouse result is also available through datarefs:
+ *
+ *	manipdraw/obj_idx	int	index of the object in manipdraw.cfg
+ *				the manipulator belongs to, -1 if none
+ *	manipdraw/manip_idx	int	manipulator index within the object,
+ *				-1 if none
+ *	manipdraw/manip_type	int	manipdraw_manip_type_t, -1 if none
+ *	manipdraw/hit_depth	float	distance of the hit from the
+ *					viewpoint in meters, -1 if none
+ *	manipdraw/frame		int	frame number the result was
+ *					rendered in
+ *
+ * Other plugins can also have manipulators highlighted, the same way
+ * as the one under the mouse, through these writable datarefs:
+ *
+ *	manipdraw/highlight/n	  int	  number of highlights, up to 31
+ *	manipdraw/highlight/ids	  int[]	  obj_idx * 65536 + manip_idx of
+ *					  each, negative entries are skipped
+ *	manipdraw/highlight/alpha float[] opacity of each, 0 to 1
+ *
+ * Everything else goes through XPLMSendMessageToPlugin(), with the
+ * plugin found using XPLMFindPluginBySignature(MANIPDRAW_PLUGIN_SIG).
+ * All message parameters start with a `version' field, which the
+ * sender must set to MANIPDRAW_API_VERSION. Messages with any other
+ * version are ignored.
+ */
+
+#define	MANIPDRAW_PLUGIN_SIG	"skiselkov.manipdraw"
+#define	MANIPDRAW_API_VERSION	2
+/*
+ * Maximum number of queries which can be registered at the same time.
+ * Queries are resolved in the same pass as the mouse, so if there are
+ * too many points in the pass overall, the ones registered last are
+ * left unresolved until room frees up.
+ */
+#define	MANIPDRAW_MAX_QUERIES	16
+/* Maximum number of VR controller rays, see MANIPDRAW_MSG_VR_RAYS_SET. */
+#define	MANIPDRAW_MAX_VR_RAYS	4
+
+enum {
+	/*
+	 * param: manipdraw_result_t *. Fills in the result for the mouse,
+	 * the same as the datarefs above.
+	 */
+	MANIPDRAW_MSG_GET_RESULT = 0x4d440001,
+	/*
+	 * param: manipdraw_query_t *. Registers a query, which is then
+	 * resolved every frame in the same pass as the mouse. The
+	 * structure is owned by the sender and must stay valid until it
+	 * is removed again with MANIPDRAW_MSG_QUERY_REMOVE. All queries
+	 * are dropped when manipdraw gets disabled.
+	 */
+	MANIPDRAW_MSG_QUERY_ADD,
+	/* param: manipdraw_query_t *, previously passed to QUERY_ADD */
+	MANIPDRAW_MSG_QUERY_REMOVE,
+	/*
+	 * param: manipdraw_vr_rays_t *. Registers the controller rays to
+	 * pick with while the sim is in VR, replacing any previously set.
+	 * The structure is owned by the sender, same as with queries.
+	 * While in VR with rays set, the mouse, the pick points and the
+	 * queries are not resolved. Instead, the rays are picked once per
+	 * frame, and ray 0 takes the place of the mouse: it drives the
+	 * result datarefs, MANIPDRAW_MSG_GET_RESULT and the highlight,
+	 * which is drawn into both eyes. Ray picking uses the compute
+	 * backend if selected and available, otherwise the BVH backend.
+	 */
+	MANIPDRAW_MSG_VR_RAYS_SET,
+	/* param: manipdraw_vr_rays_t *, previously passed to VR_RAYS_SET */
+	MANIPDRAW_MSG_VR_RAYS_CLEAR
+};
+
+/*
+ * Same order as the ATTR_manip_* commands sorted by name.
+ */
+typedef enum {
+	MANIPDRAW_MANIP_AXIS_KNOB,
+	MANIPDRAW_MANIP_AXIS_SWITCH_LR,
+	MANIPDRAW_MANIP_AXIS_SWITCH_UD,
+	MANIPDRAW_MANIP_COMMAND,
+	MANIPDRAW_MANIP_COMMAND_AXIS,
+	MANIPDRAW_MANIP_COMMAND_KNOB,
+	MANIPDRAW_MANIP_COMMAND_KNOB2,
+	MANIPDRAW_MANIP_COMMAND_SWITCH_LR,
+	MANIPDRAW_MANIP_COMMAND_SWITCH_LR2,
+	MANIPDRAW_MANIP_COMMAND_SWITCH_UD,
+	MANIPDRAW_MANIP_COMMAND_SWITCH_UD2,
+	MANIPDRAW_MANIP_DELTA,
+	MANIPDRAW_MANIP_DRAG_AXIS,
+	MANIPDRAW_MANIP_DRAG_AXIS_PIX,
+	MANIPDRAW_MANIP_DRAG_ROTATE,
+	MANIPDRAW_MANIP_DRAG_XY,
+	MANIPDRAW_MANIP_NOOP,
+	MANIPDRAW_MANIP_PUSH,
+	MANIPDRAW_MANIP_RADIO,
+	MANIPDRAW_MANIP_TOGGLE,
+	MANIPDRAW_MANIP_WRAP,
+	MANIPDRAW_MANIP_UNKNOWN
+} manipdraw_manip_type_t;
+
+typedef struct {
+	uint32_t	version;
+	int32_t		obj_idx;	/* -1 if none */
+	int32_t		manip_idx;	/* -1 if none */
+	int32_t		manip_type;	/* manipdraw_manip_type_t, or -1 */
+	float		depth;		/* meters from the viewpoint, or -1 */
+	/*
+	 * Frame number in which the result was rendered. Results can
+	 * lag the current frame by a few frames, and this stays at 0
+	 * until a query has been resolved for the first time.
+	 */
+	uint64_t	frame;
+} manipdraw_result_t;
+
+typedef struct {
+	uint32_t		version;
+	/* set by the consumer, and can be changed at any time */
+	int32_t			x;	/* window coordinates */
+	int32_t			y;
+	int32_t			active;	/* 0 to skip, without removing */
+	/*
+	 * Filled in by manipdraw from its draw callback. Only ever
+	 * describes the point currently in x/y: results for a point the
+	 * consumer has since moved away from are not written back.
+	 */
+	manipdraw_result_t	result;
+} manipdraw_query_t;
+
+typedef struct {
+	uint32_t		version;
+	/*
+	 * Set by the consumer, and can be changed at any time. Rays are
+	 * in the aircraft's coordinates in meters, the same space the
+	 * cockpit objects are in, and need not be normalized. Depths in
+	 * the results are measured from the viewpoint, as for the mouse.
+	 */
+	uint32_t		n_rays;
+	float			orig[MANIPDRAW_MAX_VR_RAYS][3];
+	float			dir[MANIPDRAW_MAX_VR_RAYS][3];
+	/* filled in by manipdraw once per frame */
+	manipdraw_result_t	result[MANIPDRAW_MAX_VR_RAYS];
+} manipdraw_vr_rays_t;
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _MANIPDRAW_API_H_ */
@@ -0,0 +1,555 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if	IBM
+#include <windows.h>
+#else	/* !IBM */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif	/* !IBM */
+
+#include <acfutils/assert.h>
+#include <acfutils/crc64.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "mcache.h"
+
+#define	MCACHE_MAGIC	0x3143444dU	/* "MDC1" */
+#define	MCACHE_VERSION	1
+#define	CRC_BUFSZ	(1 << 20)
+
+/*
+ * On-disk layout. The header is followed by the sections below, in this
+ * order, each an array of the stated element type:
+ *
+ *	vtx	n_vtx x float[3]
+ *	idx	n_idx x uint32_t
+ *	spans	n_spans x mcache_span_t
+ *	manips	n_manips x mcache_manip_t
+ *	anims	n_anims x mcache_anim_t
+ *	keys	n_keys x mcache_key_t (all animations' keys, in order)
+ *	drs	n_drs x mcache_dr_t
+ *
+ * Every element is a multiple of 4 bytes in size, so all sections stay
+ * naturally aligned in the mapping.
+ */
+typedef struct {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	src_size;
+	int64_t		src_mtime;
+	uint64_t	src_crc;
+	uint32_t	n_vtx;
+	uint32_t	n_idx;
+	uint32_t	n_spans;
+	uint32_t	n_manips;
+	uint32_t	n_anims;
+	uint32_t	n_keys;
+	uint32_t	n_drs;
+	uint32_t	pad;
+} mcache_hdr_t;
+
+typedef struct {
+	uint32_t	manip;
+	uint32_t	anim;
+	uint32_t	off;
+	uint32_t	len;
+	float		min[3];
+	float		max[3];
+} mcache_span_t;
+
+typedef struct {
+	uint32_t	type;
+	uint32_t	first_span;
+	uint32_t	n_spans;
+	uint32_t	animated;
+} mcache_manip_t;
+
+typedef struct {
+	uint32_t	parent;
+	uint32_t	type;
+	uint32_t	dr;
+	float		axis[3];
+	float		loop;
+	uint32_t	n_keys;
+} mcache_anim_t;
+
+typedef struct {
+	float		value;
+	float		v[3];
+} mcache_key_t;
+
+typedef struct {
+	char		name[128];
+	uint32_t	arr_idx;
+	uint32_t	is_array;
+} mcache_dr_t;
+
+typedef struct {
+	uint64_t	size;
+	int64_t		mtime;
+	uint64_t	crc;
+} src_key_t;
+
+typedef struct {
+	const uint8_t	*base;
+	size_t		size;
+#if	IBM
+	HANDLE		file;
+	HANDLE		mapping;
+#endif
+} mapping_t;
+
+static bool
+src_stat(const char *src_path, src_key_t *key)
+{
+	struct stat st;
+
+	if (stat(src_path, &st) != 0) {
+		logMsg("Can't stat %s: %s", src_path, strerror(errno));
+		return (false);
+	}
+	key->size = st.st_size;
+	key->mtime = st.st_mtime;
+	return (true);
+}
+
+static bool
+src_crc(const char *src_path, src_key_t *key)
+{
+	FILE *fp = fopen(src_path, "rb");
+	uint8_t *buf;
+	size_t n;
+	uint64_t crc = 0;
+
+	if (fp == NULL) {
+		logMsg("Can't open %s: %s", src_path, strerror(errno));
+		return (false);
+	}
+	buf = safe_malloc(CRC_BUFSZ);
+	while ((n = fread(buf, 1, CRC_BUFSZ, fp)) != 0)
+		crc = crc64_append(crc, buf, n);
+	free(buf);
+	fclose(fp);
+	key->crc = crc;
+
+	return (true);
+}
+
+static bool
+map_file(const char *path, mapping_t *m)
+{
+#if	IBM
+	WCHAR pathW[MAX_PATH];
+	LARGE_INTEGER sz;
+
+	memset(m, 0, sizeof (*m));
+	MultiByteToWideChar(CP_UTF8, 0, path, -1, pathW, MAX_PATH);
+	m->file = CreateFileW(pathW, GENERIC_READ, FILE_SHARE_READ, NULL,
+	    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m->file == INVALID_HANDLE_VALUE)
+		return (false);
+	if (!GetFileSizeEx(m->file, &sz) || sz.QuadPart == 0)
+		goto errout;
+	m->size = sz.QuadPart;
+	m->mapping = CreateFileMapping(m->file, NULL, PAGE_READONLY, 0, 0,
+	    NULL);
+	if (m->mapping == NULL)
+		goto errout;
+	m->base = MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m->base == NULL) {
+		CloseHandle(m->mapping);
+		goto errout;
+	}
+	return (true);
+errout:
+	CloseHandle(m->file);
+	memset(m, 0, sizeof (*m));
+	return (false);
+#else	/* !IBM */
+	int fd;
+	struct stat st;
+	void *base;
+
+	memset(m, 0, sizeof (*m));
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (false);
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return (false);
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* the mapping holds its own reference to the file */
+	close(fd);
+	if (base == MAP_FAILED)
+		return (false);
+	m->base = base;
+	m->size = st.st_size;
+	return (true);
+#endif	/* !IBM */
+}
+
+static void
+unmap_file(mapping_t *m)
+{
+	if (m->base == NULL)
+		return;
+#if	IBM
+	UnmapViewOfFile(m->base);
+	CloseHandle(m->mapping);
+	CloseHandle(m->file);
+#else
+	munmap((void *)m->base, m->size);
+#endif
+	memset(m, 0, sizeof (*m));
+}
+
+static size_t
+cache_size(const mcache_hdr_t *hdr)
+{
+	return (sizeof (*hdr) +
+	    (size_t)hdr->n_vtx * sizeof (vec3) +
+	    (size_t)hdr->n_idx * sizeof (uint32_t) +
+	    (size_t)hdr->n_spans * sizeof (mcache_span_t) +
+	    (size_t)hdr->n_manips * sizeof (mcache_manip_t) +
+	    (size_t)hdr->n_anims * sizeof (mcache_anim_t) +
+	    (size_t)hdr->n_keys * sizeof (mcache_key_t) +
+	    (size_t)hdr->n_drs * sizeof (mcache_dr_t));
+}
+
+/*
+ * Reconstructs an mgeom_t from a mapped cache file, validating every
+ * cross-reference on the way, so a corrupt cache can't lead us astray.
+ */
+static mgeom_t *
+decode(const char *cache_path, const mcache_hdr_t *hdr, const uint8_t *p)
+{
+	mgeom_t *geom = safe_calloc(1, sizeof (*geom));
+	const mcache_span_t *spans;
+	const mcache_manip_t *manips;
+	const mcache_anim_t *anims;
+	const mcache_key_t *keys;
+	const mcache_dr_t *drs;
+	unsigned key_i = 0;
+
+	p += sizeof (*hdr);
+	geom->n_vtx = hdr->n_vtx;
+	geom->vtx = safe_malloc(MAX(hdr->n_vtx, 1) * sizeof (*geom->vtx));
+	memcpy(geom->vtx, p, hdr->n_vtx * sizeof (*geom->vtx));
+	p += hdr->n_vtx * sizeof (vec3);
+
+	geom->n_idx = hdr->n_idx;
+	geom->idx = safe_malloc(MAX(hdr->n_idx, 1) * sizeof (*geom->idx));
+	memcpy(geom->idx, p, hdr->n_idx * sizeof (*geom->idx));
+	p += hdr->n_idx * sizeof (uint32_t);
+	for (unsigned i = 0; i < geom->n_idx; i++) {
+		if (geom->idx[i] >= geom->n_vtx)
+			goto errout;
+	}
+
+	spans = (const mcache_span_t *)p;
+	p += hdr->n_spans * sizeof (*spans);
+	manips = (const mcache_manip_t *)p;
+	p += hdr->n_manips * sizeof (*manips);
+	anims = (const mcache_anim_t *)p;
+	p += hdr->n_anims * sizeof (*anims);
+	keys = (const mcache_key_t *)p;
+	p += hdr->n_keys * sizeof (*keys);
+	drs = (const mcache_dr_t *)p;
+
+	geom->n_drs = hdr->n_drs;
+	geom->drs = safe_calloc(MAX(hdr->n_drs, 1), sizeof (*geom->drs));
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		mgeom_dr_t *dr = &geom->drs[i];
+
+		if (memchr(drs[i].name, '\0', sizeof (drs[i].name)) == NULL)
+			goto errout;
+		strlcpy(dr->name, drs[i].name, sizeof (dr->name));
+		dr->arr_idx = drs[i].arr_idx;
+		dr->is_array = (drs[i].is_array != 0);
+	}
+
+	geom->n_anims = hdr->n_anims;
+	geom->anims = safe_calloc(MAX(hdr->n_anims, 1),
+	    sizeof (*geom->anims));
+	for (unsigned i = 0; i < geom->n_anims; i++) {
+		const mcache_anim_t *in = &anims[i];
+		mgeom_anim_t *anim = &geom->anims[i];
+
+		/* parents always precede their children */
+		if ((in->parent != MGEOM_ANIM_NONE && in->parent >= i) ||
+		    in->type > MGEOM_XFORM_SHOW ||
+		    (in->dr != MGEOM_DR_NONE && in->dr >= geom->n_drs) ||
+		    in->n_keys > hdr->n_keys - key_i)
+			goto errout;
+		anim->parent = in->parent;
+		anim->type = in->type;
+		anim->dr = in->dr;
+		memcpy(anim->axis, in->axis, sizeof (anim->axis));
+		anim->loop = in->loop;
+		anim->n_keys = in->n_keys;
+		anim->keys = safe_calloc(MAX(in->n_keys, 1),
+		    sizeof (*anim->keys));
+		for (unsigned j = 0; j < in->n_keys; j++, key_i++) {
+			anim->keys[j].value = keys[key_i].value;
+			memcpy(anim->keys[j].v, keys[key_i].v,
+			    sizeof (anim->keys[j].v));
+		}
+		glm_mat4_identity(anim->xform);
+	}
+	if (key_i != hdr->n_keys)
+		goto errout;
+
+	geom->n_manips = hdr->n_manips;
+	geom->manips = safe_calloc(MAX(hdr->n_manips, 1),
+	    sizeof (*geom->manips));
+	for (unsigned i = 0; i < geom->n_manips; i++) {
+		const mcache_manip_t *in = &manips[i];
+		mgeom_manip_t *manip = &geom->manips[i];
+
+		if (in->type > MGEOM_MANIP_UNKNOWN ||
+		    in->first_span > hdr->n_spans ||
+		    in->n_spans > hdr->n_spans - in->first_span)
+			goto errout;
+		manip->type = in->type;
+		manip->first_span = in->first_span;
+		manip->n_spans = in->n_spans;
+		manip->animated = (in->animated != 0);
+		mgeom_aabb_clear(&manip->bounds);
+	}
+
+	geom->n_spans = hdr->n_spans;
+	geom->spans = safe_calloc(MAX(hdr->n_spans, 1),
+	    sizeof (*geom->spans));
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mcache_span_t *in = &spans[i];
+		mgeom_span_t *span = &geom->spans[i];
+
+		if (in->manip >= geom->n_manips ||
+		    (in->anim != MGEOM_ANIM_NONE &&
+		    in->anim >= geom->n_anims) ||
+		    in->off > geom->n_idx || in->len > geom->n_idx - in->off ||
+		    in->len % 3 != 0)
+			goto errout;
+		span->manip = in->manip;
+		span->anim = in->anim;
+		span->off = in->off;
+		span->len = in->len;
+		memcpy(span->bounds.min, in->min, sizeof (span->bounds.min));
+		memcpy(span->bounds.max, in->max, sizeof (span->bounds.max));
+	}
+
+	return (geom);
+errout:
+	logMsg("%s: cache file is corrupt, ignoring it", cache_path);
+	mgeom_free(geom);
+	return (NULL);
+}
+
+/*
+ * Loads the manipulator geometry of `src_path' from the cache file at
+ * `cache_path'. Returns NULL if the cache is missing, stale or corrupt,
+ * in which case the caller should parse the source and write a new one.
+ */
+mgeom_t *
+mcache_load(const char *cache_path, const char *src_path)
+{
+	mapping_t m;
+	mcache_hdr_t hdr;
+	src_key_t key;
+	mgeom_t *geom = NULL;
+
+	ASSERT(cache_path != NULL);
+	ASSERT(src_path != NULL);
+
+	if (!src_stat(src_path, &key) || !map_file(cache_path, &m))
+		return (NULL);
+	if (m.size < sizeof (hdr))
+		goto out;
+	memcpy(&hdr, m.base, sizeof (hdr));
+	if (hdr.magic != MCACHE_MAGIC || hdr.version != MCACHE_VERSION ||
+	    hdr.src_size != key.size || hdr.src_mtime != key.mtime ||
+	    cache_size(&hdr) != m.size)
+		goto out;
+	/*
+	 * The size and mtime matched, so this is most likely good. Only
+	 * now pay for reading in the whole source to confirm it.
+	 */
+	if (!src_crc(src_path, &key) || hdr.src_crc != key.crc)
+		goto out;
+	geom = decode(cache_path, &hdr, m.base);
+out:
+	unmap_file(&m);
+	return (geom);
+}
+
+static bool
+write_all(FILE *fp, const void *buf, size_t sz)
+{
+	return (sz == 0 || fwrite(buf, 1, sz, fp) == sz);
+}
+
+static bool
+encode(FILE *fp, const mcache_hdr_t *hdr, const mgeom_t *geom)
+{
+	if (!write_all(fp, hdr, sizeof (*hdr)) ||
+	    !write_all(fp, geom->vtx, geom->n_vtx * sizeof (*geom->vtx)) ||
+	    !write_all(fp, geom->idx, geom->n_idx * sizeof (*geom->idx)))
+		return (false);
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+		mcache_span_t out = {
+		    .manip = span->manip, .anim = span->anim,
+		    .off = span->off, .len = span->len
+		};
+
+		memcpy(out.min, span->bounds.min, sizeof (out.min));
+		memcpy(out.max, span->bounds.max, sizeof (out.max));
+		if (!write_all(fp, &out, sizeof (out)))
+			return (false);
+	}
+	for (unsigned i = 0; i < geom->n_manips; i++) {
+		const mgeom_manip_t *manip = &geom->manips[i];
+		mcache_manip_t out = {
+		    .type = manip->type, .first_span = manip->first_span,
+		    .n_spans = manip->n_spans, .animated = manip->animated
+		};
+
+		if (!write_all(fp, &out, sizeof (out)))
+			return (false);
+	}
+	for (unsigned i = 0; i < geom->n_anims; i++) {
+		const mgeom_anim_t *anim = &geom->anims[i];
+		mcache_anim_t out = {
+		    .parent = anim->parent, .type = anim->type,
+		    .dr = anim->dr, .loop = anim->loop,
+		    .n_keys = anim->n_keys
+		};
+
+		memcpy(out.axis, anim->axis, sizeof (out.axis));
+		if (!write_all(fp, &out, sizeof (out)))
+			return (false);
+	}
+	for (unsigned i = 0; i < geom->n_anims; i++) {
+		const mgeom_anim_t *anim = &geom->anims[i];
+
+		for (unsigned j = 0; j < anim->n_keys; j++) {
+			mcache_key_t out = { .value = anim->keys[j].value };
+
+			memcpy(out.v, anim->keys[j].v, sizeof (out.v));
+			if (!write_all(fp, &out, sizeof (out)))
+				return (false);
+		}
+	}
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		const mgeom_dr_t *dr = &geom->drs[i];
+		mcache_dr_t out = {
+		    .arr_idx = dr->arr_idx, .is_array = dr->is_array
+		};
+
+		strlcpy(out.name, dr->name, sizeof (out.name));
+		if (!write_all(fp, &out, sizeof (out)))
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Writes the cache for `src_path'. `geom' must be fresh out of
+ * mgeom_parse(), before any datarefs were bound. The file is written
+ * under a temporary name and renamed into place, so a concurrent reader
+ * never sees a partially written cache.
+ */
+bool
+mcache_write(const char *cache_path, const char *src_path,
+    const mgeom_t *geom)
+{
+	mcache_hdr_t hdr = {
+	    .magic = MCACHE_MAGIC, .version = MCACHE_VERSION
+	};
+	src_key_t key;
+	char *tmp_path, *dir, *p;
+	FILE *fp;
+	bool ok;
+
+	ASSERT(cache_path != NULL);
+	ASSERT(src_path != NULL);
+	ASSERT(geom != NULL);
+
+	if (!src_stat(src_path, &key) || !src_crc(src_path, &key))
+		return (false);
+	hdr.src_size = key.size;
+	hdr.src_mtime = key.mtime;
+	hdr.src_crc = key.crc;
+	hdr.n_vtx = geom->n_vtx;
+	hdr.n_idx = geom->n_idx;
+	hdr.n_spans = geom->n_spans;
+	hdr.n_manips = geom->n_manips;
+	hdr.n_anims = geom->n_anims;
+	for (unsigned i = 0; i < geom->n_anims; i++)
+		hdr.n_keys += geom->anims[i].n_keys;
+	hdr.n_drs = geom->n_drs;
+
+	dir = safe_strdup(cache_path);
+	if ((p = strrchr(dir, DIRSEP)) != NULL) {
+		*p = '\0';
+		create_directory_recursive(dir);
+	}
+	free(dir);
+
+	tmp_path = sprintf_alloc("%s.tmp", cache_path);
+	fp = fopen(tmp_path, "wb");
+	if (fp == NULL) {
+		logMsg("Can't write %s: %s", tmp_path, strerror(errno));
+		lacf_free(tmp_path);
+		return (false);
+	}
+	ok = encode(fp, &hdr, geom);
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok) {
+#if	IBM
+		/* rename() won't replace an existing file on Windows */
+		remove_file(cache_path, true);
+#endif
+		ok = (rename(tmp_path, cache_path) == 0);
+	}
+	if (!ok) {
+		logMsg("Error writing %s: %s", cache_path, strerror(errno));
+		remove_file(tmp_path, true);
+	}
+	lacf_free(tmp_path);
+
+	return (ok);
+}
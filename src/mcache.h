@@ -0,0 +1,50 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_MCACHE_H_
+#define	_MCACHE_H_
+
+#include "mgeom.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary cache of the manipulator geometry parsed out of an OBJ8 file.
+ * The cache is keyed by the source file's size, modification time and
+ * CRC64, so any edit to the object invalidates it. The file is native
+ * endian and only meant to be read back on the machine which wrote it.
+ *
+ * Neither function touches any X-Plane APIs, so both are safe to call
+ * from a worker thread. crc64_init() must have been called beforehand.
+ */
+mgeom_t *mcache_load(const char *cache_path, const char *src_path);
+bool mcache_write(const char *cache_path, const char *src_path,
+    const mgeom_t *geom);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _MCACHE_H_ */
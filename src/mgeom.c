@@ -0,0 +1,903 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "mgeom.h"
+
+#define	MAX_ANIM_DEPTH		64
+#define	MAX_ARGS		16
+#define	MAX_BATCH_LEN		64	/* elements per array read */
+
+typedef struct {
+	const char		*name;
+	mgeom_manip_type_t	type;
+} manip_type_name_t;
+
+static const manip_type_name_t manip_types[] = {
+    { "ATTR_manip_axis_knob", MGEOM_MANIP_AXIS_KNOB },
+    { "ATTR_manip_axis_switch_left_right", MGEOM_MANIP_AXIS_SWITCH_LR },
+    { "ATTR_manip_axis_switch_up_down", MGEOM_MANIP_AXIS_SWITCH_UD },
+    { "ATTR_manip_command", MGEOM_MANIP_COMMAND },
+    { "ATTR_manip_command_axis", MGEOM_MANIP_COMMAND_AXIS },
+    { "ATTR_manip_command_knob", MGEOM_MANIP_COMMAND_KNOB },
+    { "ATTR_manip_command_knob2", MGEOM_MANIP_COMMAND_KNOB2 },
+    { "ATTR_manip_command_switch_left_right",
+      MGEOM_MANIP_COMMAND_SWITCH_LR },
+    { "ATTR_manip_command_switch_left_right2",
+      MGEOM_MANIP_COMMAND_SWITCH_LR2 },
+    { "ATTR_manip_command_switch_up_down", MGEOM_MANIP_COMMAND_SWITCH_UD },
+    { "ATTR_manip_command_switch_up_down2",
+      MGEOM_MANIP_COMMAND_SWITCH_UD2 },
+    { "ATTR_manip_delta", MGEOM_MANIP_DELTA },
+    { "ATTR_manip_drag_axis", MGEOM_MANIP_DRAG_AXIS },
+    { "ATTR_manip_drag_axis_pix", MGEOM_MANIP_DRAG_AXIS_PIX },
+    { "ATTR_manip_drag_rotate", MGEOM_MANIP_DRAG_ROTATE },
+    { "ATTR_manip_drag_xy", MGEOM_MANIP_DRAG_XY },
+    { "ATTR_manip_noop", MGEOM_MANIP_NOOP },
+    { "ATTR_manip_push", MGEOM_MANIP_PUSH },
+    { "ATTR_manip_radio", MGEOM_MANIP_RADIO },
+    { "ATTR_manip_toggle", MGEOM_MANIP_TOGGLE },
+    { "ATTR_manip_wrap", MGEOM_MANIP_WRAP }
+};
+
+typedef struct {
+	const char	*filename;
+	unsigned	lineno;
+	mgeom_t		*geom;
+	unsigned	cap_vtx;
+	unsigned	cap_idx;
+	unsigned	cap_spans;
+	unsigned	cap_manips;
+	unsigned	cap_anims;
+	unsigned	cap_drs;
+	uint32_t	cur_anim;
+	uint32_t	cur_manip;
+	uint32_t	anim_stack[MAX_ANIM_DEPTH];
+	unsigned	anim_depth;
+	/* node receiving ANIM_*_key lines inside an ANIM_*_begin block */
+	uint32_t	keyed_anim;
+} parse_t;
+
+static void *
+grow_array(void *arr, unsigned n, unsigned *cap, size_t elem_sz)
+{
+	ASSERT(cap != NULL);
+	if (n < *cap)
+		return (arr);
+	*cap = MAX(*cap * 2, 64);
+	return (safe_realloc(arr, *cap * elem_sz));
+}
+
+#define	GROW(arr, n, cap) \
+	((arr) = grow_array((arr), (n), &(cap), sizeof (*(arr))))
+
+static unsigned
+tokenize(char *line, char *argv[MAX_ARGS])
+{
+	unsigned argc = 0;
+	char *p = line;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (*p == '\0' || *p == '#' || argc == MAX_ARGS)
+			break;
+		argv[argc++] = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' &&
+		    *p != '\n')
+			p++;
+		if (*p == '\0')
+			break;
+		*p++ = '\0';
+	}
+	return (argc);
+}
+
+static uint32_t
+add_dr(parse_t *pt, const char *name)
+{
+	mgeom_t *geom = pt->geom;
+	const char *bracket;
+	mgeom_dr_t *dr;
+	size_t len;
+
+	if (strcmp(name, "none") == 0 || strcmp(name, "no_ref") == 0)
+		return (MGEOM_DR_NONE);
+	bracket = strchr(name, '[');
+	len = (bracket != NULL ? (size_t)(bracket - name) : strlen(name));
+	len = MIN(len, sizeof (dr->name) - 1);
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		dr = &geom->drs[i];
+		if (strncmp(dr->name, name, len) == 0 &&
+		    dr->name[len] == '\0' &&
+		    dr->is_array == (bracket != NULL) &&
+		    (bracket == NULL ||
+		    dr->arr_idx == (unsigned)atoi(bracket + 1)))
+			return (i);
+	}
+	GROW(geom->drs, geom->n_drs, pt->cap_drs);
+	dr = &geom->drs[geom->n_drs];
+	memset(dr, 0, sizeof (*dr));
+	memcpy(dr->name, name, len);
+	dr->name[len] = '\0';
+	if (bracket != NULL) {
+		dr->is_array = true;
+		dr->arr_idx = atoi(bracket + 1);
+	}
+	return (geom->n_drs++);
+}
+
+static mgeom_anim_t *
+add_anim(parse_t *pt, mgeom_xform_type_t type, const char *dr_name,
+    unsigned n_keys)
+{
+	mgeom_t *geom = pt->geom;
+	mgeom_anim_t *anim;
+
+	GROW(geom->anims, geom->n_anims, pt->cap_anims);
+	anim = &geom->anims[geom->n_anims];
+	memset(anim, 0, sizeof (*anim));
+	anim->parent = pt->cur_anim;
+	anim->type = type;
+	anim->dr = add_dr(pt, dr_name);
+	anim->n_keys = n_keys;
+	if (n_keys != 0)
+		anim->keys = safe_calloc(n_keys, sizeof (*anim->keys));
+	glm_mat4_identity(anim->xform);
+	pt->cur_anim = geom->n_anims++;
+
+	return (anim);
+}
+
+static void
+add_key(mgeom_anim_t *anim, float value, float x, float y, float z)
+{
+	anim->keys = safe_realloc(anim->keys,
+	    (anim->n_keys + 1) * sizeof (*anim->keys));
+	anim->keys[anim->n_keys].value = value;
+	anim->keys[anim->n_keys].v[0] = x;
+	anim->keys[anim->n_keys].v[1] = y;
+	anim->keys[anim->n_keys].v[2] = z;
+	anim->n_keys++;
+}
+
+static bool
+parse_line(parse_t *pt, unsigned argc, char *argv[MAX_ARGS])
+{
+	mgeom_t *geom = pt->geom;
+	const char *cmd = argv[0];
+
+#define	CHECK_ARGS(n) \
+	do { \
+		if (argc < (n)) { \
+			logMsg("%s:%d: malformed %s line", pt->filename, \
+			    pt->lineno, cmd); \
+			return (false); \
+		} \
+	} while (0)
+
+	if (strcmp(cmd, "VT") == 0) {
+		CHECK_ARGS(4);
+		GROW(geom->vtx, geom->n_vtx, pt->cap_vtx);
+		for (int i = 0; i < 3; i++)
+			geom->vtx[geom->n_vtx][i] = atof(argv[i + 1]);
+		geom->n_vtx++;
+	} else if (strcmp(cmd, "IDX10") == 0 || strcmp(cmd, "IDX") == 0) {
+		for (unsigned i = 1; i < argc; i++) {
+			GROW(geom->idx, geom->n_idx, pt->cap_idx);
+			geom->idx[geom->n_idx++] = strtoul(argv[i], NULL, 10);
+		}
+	} else if (strcmp(cmd, "TRIS") == 0) {
+		mgeom_span_t *span;
+		unsigned off, len;
+
+		CHECK_ARGS(3);
+		off = strtoul(argv[1], NULL, 10);
+		len = strtoul(argv[2], NULL, 10) / 3 * 3;
+		if (pt->cur_manip == UINT32_MAX || len == 0)
+			return (true);
+		GROW(geom->spans, geom->n_spans, pt->cap_spans);
+		span = &geom->spans[geom->n_spans++];
+		memset(span, 0, sizeof (*span));
+		span->manip = pt->cur_manip;
+		span->anim = pt->cur_anim;
+		span->off = off;
+		span->len = len;
+	} else if (strcmp(cmd, "ANIM_begin") == 0) {
+		if (pt->anim_depth == MAX_ANIM_DEPTH) {
+			logMsg("%s:%d: animations nested too deep",
+			    pt->filename, pt->lineno);
+			return (false);
+		}
+		pt->anim_stack[pt->anim_depth++] = pt->cur_anim;
+	} else if (strcmp(cmd, "ANIM_end") == 0) {
+		if (pt->anim_depth == 0) {
+			logMsg("%s:%d: ANIM_end without ANIM_begin",
+			    pt->filename, pt->lineno);
+			return (false);
+		}
+		pt->cur_anim = pt->anim_stack[--pt->anim_depth];
+	} else if (strcmp(cmd, "ANIM_trans") == 0) {
+		mgeom_anim_t *anim;
+
+		CHECK_ARGS(9);
+		anim = add_anim(pt, MGEOM_XFORM_TRANS,
+		    argc > 9 ? argv[9] : "none", 2);
+		for (int i = 0; i < 2; i++) {
+			anim->keys[i].value = atof(argv[7 + i]);
+			for (int j = 0; j < 3; j++)
+				anim->keys[i].v[j] = atof(argv[1 + i * 3 + j]);
+		}
+	} else if (strcmp(cmd, "ANIM_rotate") == 0) {
+		mgeom_anim_t *anim;
+
+		CHECK_ARGS(8);
+		anim = add_anim(pt, MGEOM_XFORM_ROTATE,
+		    argc > 8 ? argv[8] : "none", 2);
+		for (int i = 0; i < 3; i++)
+			anim->axis[i] = atof(argv[1 + i]);
+		for (int i = 0; i < 2; i++) {
+			anim->keys[i].v[0] = atof(argv[4 + i]);
+			anim->keys[i].value = atof(argv[6 + i]);
+		}
+	} else if (strcmp(cmd, "ANIM_trans_begin") == 0) {
+		CHECK_ARGS(2);
+		add_anim(pt, MGEOM_XFORM_TRANS, argv[1], 0);
+		pt->keyed_anim = pt->cur_anim;
+	} else if (strcmp(cmd, "ANIM_rotate_begin") == 0) {
+		mgeom_anim_t *anim;
+
+		CHECK_ARGS(5);
+		anim = add_anim(pt, MGEOM_XFORM_ROTATE, argv[4], 0);
+		for (int i = 0; i < 3; i++)
+			anim->axis[i] = atof(argv[1 + i]);
+		pt->keyed_anim = pt->cur_anim;
+	} else if (strcmp(cmd, "ANIM_trans_key") == 0 ||
+	    strcmp(cmd, "ANIM_rotate_key") == 0) {
+		bool trans = (strcmp(cmd, "ANIM_trans_key") == 0);
+
+		CHECK_ARGS(trans ? 5 : 3);
+		if (pt->keyed_anim == UINT32_MAX) {
+			logMsg("%s:%d: %s outside of keyframe table",
+			    pt->filename, pt->lineno, cmd);
+			return (false);
+		}
+		add_key(&geom->anims[pt->keyed_anim], atof(argv[1]),
+		    atof(argv[2]), trans ? atof(argv[3]) : 0,
+		    trans ? atof(argv[4]) : 0);
+	} else if (strcmp(cmd, "ANIM_trans_end") == 0 ||
+	    strcmp(cmd, "ANIM_rotate_end") == 0) {
+		if (pt->keyed_anim != UINT32_MAX &&
+		    geom->anims[pt->keyed_anim].n_keys == 0) {
+			logMsg("%s:%d: empty keyframe table",
+			    pt->filename, pt->lineno);
+			return (false);
+		}
+		pt->keyed_anim = UINT32_MAX;
+	} else if (strcmp(cmd, "ANIM_keyframe_loop") == 0) {
+		CHECK_ARGS(2);
+		if (pt->cur_anim != UINT32_MAX)
+			geom->anims[pt->cur_anim].loop = atof(argv[1]);
+	} else if (strcmp(cmd, "ANIM_hide") == 0 ||
+	    strcmp(cmd, "ANIM_show") == 0) {
+		mgeom_anim_t *anim;
+
+		CHECK_ARGS(3);
+		anim = add_anim(pt, strcmp(cmd, "ANIM_hide") == 0 ?
+		    MGEOM_XFORM_HIDE : MGEOM_XFORM_SHOW,
+		    argc > 3 ? argv[3] : "none", 2);
+		anim->keys[0].value = atof(argv[1]);
+		anim->keys[1].value = atof(argv[2]);
+	} else if (strcmp(cmd, "ATTR_manip_none") == 0) {
+		pt->cur_manip = UINT32_MAX;
+	} else if (strcmp(cmd, "ATTR_manip_wheel") == 0 ||
+	    strcmp(cmd, "ATTR_manip_keyframe") == 0) {
+		/* modifiers of the previous manipulator, not new ones */
+	} else if (strncmp(cmd, "ATTR_manip_", 11) == 0) {
+		mgeom_manip_t *manip;
+
+		GROW(geom->manips, geom->n_manips, pt->cap_manips);
+		manip = &geom->manips[geom->n_manips];
+		memset(manip, 0, sizeof (*manip));
+		manip->type = MGEOM_MANIP_UNKNOWN;
+		for (unsigned i = 0; i < ARRAY_NUM_ELEM(manip_types); i++) {
+			if (strcmp(cmd, manip_types[i].name) == 0) {
+				manip->type = manip_types[i].type;
+				break;
+			}
+		}
+		pt->cur_manip = geom->n_manips++;
+	}
+
+#undef	CHECK_ARGS
+
+	return (true);
+}
+
+static int
+span_compar(const void *a, const void *b)
+{
+	const mgeom_span_t *sa = a, *sb = b;
+
+	if (sa->manip != sb->manip)
+		return (sa->manip < sb->manip ? -1 : 1);
+	if (sa->anim != sb->anim)
+		return (sa->anim < sb->anim ? -1 : 1);
+	if (sa->off != sb->off)
+		return (sa->off < sb->off ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Sorts the spans, drops all vertices and indices not referenced by any
+ * manipulator and computes the per-span and per-manipulator tables.
+ */
+static bool
+finalize(parse_t *pt)
+{
+	mgeom_t *geom = pt->geom;
+	uint32_t *vtx_map, *idx;
+	vec3 *vtx;
+	unsigned n_vtx = 0, n_idx = 0;
+
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+
+		if (span->off + span->len > geom->n_idx) {
+			logMsg("%s: TRIS command references indices beyond "
+			    "the end of the index table", pt->filename);
+			return (false);
+		}
+		n_idx += span->len;
+	}
+	qsort(geom->spans, geom->n_spans, sizeof (*geom->spans), span_compar);
+
+	vtx_map = safe_malloc(MAX(geom->n_vtx, 1) * sizeof (*vtx_map));
+	memset(vtx_map, 0xff, geom->n_vtx * sizeof (*vtx_map));
+	idx = safe_calloc(MAX(n_idx, 1), sizeof (*idx));
+	vtx = safe_calloc(MAX(n_idx, 1), sizeof (*vtx));
+	n_idx = 0;
+
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		mgeom_span_t *span = &geom->spans[i];
+
+		mgeom_aabb_clear(&span->bounds);
+		for (unsigned j = 0; j < span->len; j++) {
+			uint32_t v = geom->idx[span->off + j];
+
+			if (v >= geom->n_vtx) {
+				logMsg("%s: index %d out of range",
+				    pt->filename, v);
+				free(vtx_map);
+				free(idx);
+				free(vtx);
+				return (false);
+			}
+			if (vtx_map[v] == UINT32_MAX) {
+				vtx_map[v] = n_vtx;
+				glm_vec3_copy(geom->vtx[v], vtx[n_vtx]);
+				n_vtx++;
+			}
+			idx[n_idx + j] = vtx_map[v];
+			mgeom_aabb_add_pt(&span->bounds, geom->vtx[v]);
+		}
+		span->off = n_idx;
+		n_idx += span->len;
+	}
+	free(vtx_map);
+	free(geom->idx);
+	free(geom->vtx);
+	geom->idx = idx;
+	geom->n_idx = n_idx;
+	geom->vtx = safe_realloc(vtx, MAX(n_vtx, 1) * sizeof (*vtx));
+	geom->n_vtx = n_vtx;
+
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+		mgeom_manip_t *manip = &geom->manips[span->manip];
+
+		if (manip->n_spans == 0)
+			manip->first_span = i;
+		manip->n_spans++;
+		if (span->anim != MGEOM_ANIM_NONE)
+			manip->animated = true;
+	}
+
+	return (true);
+}
+
+/*
+ * Parses the manipulator geometry out of an OBJ8 file. This doesn't
+ * touch any X-Plane APIs, so it's safe to call from a worker thread.
+ * Before the result can be animated, call mgeom_bind_drs() from the
+ * main thread.
+ */
+mgeom_t *
+mgeom_parse(const char *filename)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linecap = 0;
+	parse_t pt = {
+	    .filename = filename,
+	    .cur_anim = MGEOM_ANIM_NONE,
+	    .cur_manip = UINT32_MAX,
+	    .keyed_anim = UINT32_MAX
+	};
+
+	ASSERT(filename != NULL);
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		logMsg("Can't open %s: %s", filename, strerror(errno));
+		return (NULL);
+	}
+	pt.geom = safe_calloc(1, sizeof (*pt.geom));
+	while (lacf_getline(&line, &linecap, fp) > 0) {
+		char *argv[MAX_ARGS];
+		unsigned argc;
+
+		pt.lineno++;
+		argc = tokenize(line, argv);
+		if (argc != 0 && !parse_line(&pt, argc, argv))
+			goto errout;
+	}
+	if (!finalize(&pt))
+		goto errout;
+	free(line);
+	fclose(fp);
+
+	return (pt.geom);
+errout:
+	free(line);
+	fclose(fp);
+	mgeom_free(pt.geom);
+	return (NULL);
+}
+
+void
+mgeom_free(mgeom_t *geom)
+{
+	if (geom == NULL)
+		return;
+	for (unsigned i = 0; i < geom->n_anims; i++)
+		free(geom->anims[i].keys);
+	free(geom->anims);
+	for (unsigned i = 0; i < geom->n_drs; i++)
+		free(geom->drs[i].manips);
+	free(geom->drs);
+	for (unsigned i = 0; i < geom->n_batches; i++)
+		free(geom->batches[i].values);
+	free(geom->batches);
+	free(geom->dirty);
+	free(geom->vtx);
+	free(geom->idx);
+	free(geom->spans);
+	free(geom->manips);
+	free(geom);
+}
+
+/*
+ * Groups the elements of array datarefs into batches, so that
+ * mgeom_update() can read each array with as few calls as possible.
+ */
+static void
+bind_batches(mgeom_t *geom)
+{
+	unsigned cap = 0;
+
+	for (unsigned i = 0; i < geom->n_batches; i++)
+		free(geom->batches[i].values);
+	free(geom->batches);
+	geom->batches = NULL;
+	geom->n_batches = 0;
+	for (unsigned i = 0; i < geom->n_drs; i++)
+		geom->drs[i].batch = UINT32_MAX;
+
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		mgeom_dr_t *dr = &geom->drs[i];
+		mgeom_batch_t *batch;
+		unsigned lo, hi;
+
+		if (!dr->found || !dr->is_array || dr->batch != UINT32_MAX)
+			continue;
+		GROW(geom->batches, geom->n_batches, cap);
+		batch = &geom->batches[geom->n_batches];
+		dr->batch = geom->n_batches++;
+		lo = hi = dr->arr_idx;
+		for (unsigned j = i + 1; j < geom->n_drs; j++) {
+			mgeom_dr_t *other = &geom->drs[j];
+			unsigned n_lo, n_hi;
+
+			if (!other->found || !other->is_array ||
+			    other->batch != UINT32_MAX ||
+			    strcmp(other->name, dr->name) != 0)
+				continue;
+			n_lo = MIN(lo, other->arr_idx);
+			n_hi = MAX(hi, other->arr_idx);
+			if (n_hi - n_lo >= MAX_BATCH_LEN)
+				continue;
+			other->batch = dr->batch;
+			lo = n_lo;
+			hi = n_hi;
+		}
+		batch->dr = i;
+		batch->off = lo;
+		batch->n = hi - lo + 1;
+		batch->values = safe_calloc(batch->n, sizeof (*batch->values));
+	}
+}
+
+/*
+ * Records which manipulators each dataref moves, i.e. which ones have
+ * a span under an animation node driven by it, directly or through
+ * one of the node's parents.
+ */
+static void
+bind_dr_manips(mgeom_t *geom)
+{
+	uint32_t *last = safe_malloc(MAX(geom->n_drs, 1) * sizeof (*last));
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned i = 0; i < geom->n_drs; i++) {
+			mgeom_dr_t *dr = &geom->drs[i];
+
+			if (pass == 0) {
+				free(dr->manips);
+				dr->manips = NULL;
+			} else {
+				dr->manips = safe_calloc(MAX(dr->n_manips, 1),
+				    sizeof (*dr->manips));
+			}
+			dr->n_manips = 0;
+			last[i] = UINT32_MAX;
+		}
+		for (unsigned m = 0; m < geom->n_manips; m++) {
+			const mgeom_manip_t *manip = &geom->manips[m];
+
+			for (unsigned j = 0; j < manip->n_spans; j++) {
+				const mgeom_span_t *span =
+				    &geom->spans[manip->first_span + j];
+
+				for (uint32_t a = span->anim;
+				    a != MGEOM_ANIM_NONE;
+				    a = geom->anims[a].parent) {
+					uint32_t d = geom->anims[a].dr;
+					mgeom_dr_t *dr;
+
+					if (d == MGEOM_DR_NONE || last[d] == m)
+						continue;
+					last[d] = m;
+					dr = &geom->drs[d];
+					if (pass != 0)
+						dr->manips[dr->n_manips] = m;
+					dr->n_manips++;
+				}
+			}
+		}
+	}
+	free(last);
+}
+
+/*
+ * Looks up all animation datarefs the object references and sets up
+ * the tables mgeom_update() uses to read them and to tell which
+ * manipulators they move. Must be called from the main thread.
+ * Datarefs which don't exist are treated as permanently zero, the same
+ * as X-Plane does.
+ */
+void
+mgeom_bind_drs(mgeom_t *geom)
+{
+	ASSERT(geom != NULL);
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		mgeom_dr_t *dr = &geom->drs[i];
+
+		dr->found = dr_find(&dr->dr, "%s", dr->name);
+		dr->value = 0;
+	}
+	bind_batches(geom);
+	bind_dr_manips(geom);
+	free(geom->dirty);
+	geom->dirty = safe_calloc(MAX((geom->n_manips + 63) / 64, 1),
+	    sizeof (*geom->dirty));
+	geom->evaluated = false;
+}
+
+static void
+interp_keys(const mgeom_key_t *keys, unsigned n_keys, float value,
+    vec3 out)
+{
+	bool asc;
+
+	ASSERT(n_keys != 0);
+	if (n_keys == 1) {
+		glm_vec3_copy((float *)keys[0].v, out);
+		return;
+	}
+	asc = (keys[n_keys - 1].value >= keys[0].value);
+	for (unsigned i = 0; i + 1 < n_keys; i++) {
+		float v1 = keys[i].value, v2 = keys[i + 1].value;
+
+		if ((asc ? value <= v2 : value >= v2) || i + 2 == n_keys) {
+			float t = (v2 != v1 ? (value - v1) / (v2 - v1) : 0);
+
+			t = clamp(t, 0, 1);
+			glm_vec3_lerp((float *)keys[i].v,
+			    (float *)keys[i + 1].v, t, out);
+			return;
+		}
+	}
+}
+
+static void
+eval_anim(mgeom_t *geom, mgeom_anim_t *anim)
+{
+	float value = 0;
+	vec3 v;
+
+	if (anim->parent != MGEOM_ANIM_NONE) {
+		const mgeom_anim_t *parent = &geom->anims[anim->parent];
+
+		ASSERT3U(anim->parent, <, anim - geom->anims);
+		glm_mat4_copy((vec4 *)parent->xform, anim->xform);
+		anim->hidden = parent->hidden;
+	} else {
+		glm_mat4_identity(anim->xform);
+		anim->hidden = false;
+	}
+	if (anim->dr != MGEOM_DR_NONE)
+		value = geom->drs[anim->dr].value;
+	if (anim->loop != 0)
+		value = fmodf(value, anim->loop);
+
+	switch (anim->type) {
+	case MGEOM_XFORM_TRANS:
+		interp_keys(anim->keys, anim->n_keys, value, v);
+		glm_translate(anim->xform, v);
+		break;
+	case MGEOM_XFORM_ROTATE:
+		interp_keys(anim->keys, anim->n_keys, value, v);
+		if (glm_vec3_norm(anim->axis) > 0)
+			glm_rotate(anim->xform, glm_rad(v[0]), anim->axis);
+		break;
+	case MGEOM_XFORM_HIDE:
+	case MGEOM_XFORM_SHOW:
+		if (value >= MIN(anim->keys[0].value, anim->keys[1].value) &&
+		    value <= MAX(anim->keys[0].value, anim->keys[1].value))
+			anim->hidden = (anim->type == MGEOM_XFORM_HIDE);
+		break;
+	}
+}
+
+static void
+update_manip_bounds(mgeom_t *geom, mgeom_manip_t *manip)
+{
+	mgeom_aabb_clear(&manip->bounds);
+	manip->hidden = true;
+	for (unsigned j = 0; j < manip->n_spans; j++) {
+		const mgeom_span_t *span = &geom->spans[manip->first_span + j];
+		const mgeom_anim_t *anim;
+		mgeom_aabb_t bounds;
+
+		if (span->anim == MGEOM_ANIM_NONE) {
+			mgeom_aabb_add_aabb(&manip->bounds, &span->bounds);
+			manip->hidden = false;
+			continue;
+		}
+		anim = &geom->anims[span->anim];
+		if (anim->hidden)
+			continue;
+		mgeom_aabb_xform(&span->bounds, (vec4 *)anim->xform, &bounds);
+		mgeom_aabb_add_aabb(&manip->bounds, &bounds);
+		manip->hidden = false;
+	}
+}
+
+static void
+read_drs(mgeom_t *geom, bool all)
+{
+	for (unsigned i = 0; i < geom->n_batches; i++) {
+		mgeom_batch_t *batch = &geom->batches[i];
+		int n = dr_getvf32(&geom->drs[batch->dr].dr, batch->values,
+		    batch->off, batch->n);
+
+		/* elements past the end of the array read as zero */
+		for (unsigned j = MAX(n, 0); j < batch->n; j++)
+			batch->values[j] = 0;
+	}
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		mgeom_dr_t *dr = &geom->drs[i];
+		float value;
+
+		if (!dr->found) {
+			dr->changed = all;
+			continue;
+		}
+		if (dr->batch != UINT32_MAX) {
+			const mgeom_batch_t *batch = &geom->batches[dr->batch];
+
+			value = batch->values[dr->arr_idx - batch->off];
+		} else {
+			value = dr_getf(&dr->dr);
+		}
+		dr->changed = (all || value != dr->value);
+		dr->value = value;
+	}
+}
+
+/*
+ * Reads the current values of all animation datarefs and re-evaluates
+ * the parts of the animation tree and the object-space manipulator
+ * bounds which are affected by datarefs whose value has changed, as
+ * well as the overall bounds of the visible manipulators. After
+ * this, the `changed' flags on the datarefs and animation nodes and
+ * the `dirty' bitmap of manipulators tell which parts of the object
+ * moved since the previous update, and the `gen' fields tell in which
+ * update they last moved. The first update after mgeom_bind_drs()
+ * evaluates everything.
+ */
+void
+mgeom_update(mgeom_t *geom)
+{
+	uint64_t update_num;
+	bool all;
+
+	ASSERT(geom != NULL);
+	ASSERT(geom->dirty != NULL);
+	all = !geom->evaluated;
+	update_num = geom->update_num + 1;
+
+	read_drs(geom, all);
+	for (unsigned i = 0; i < geom->n_anims; i++) {
+		mgeom_anim_t *anim = &geom->anims[i];
+
+		anim->changed = (all ||
+		    (anim->dr != MGEOM_DR_NONE &&
+		    geom->drs[anim->dr].changed) ||
+		    (anim->parent != MGEOM_ANIM_NONE &&
+		    geom->anims[anim->parent].changed));
+		if (anim->changed) {
+			eval_anim(geom, anim);
+			anim->gen = update_num;
+		}
+	}
+	/*
+	 * Animations which don't move any manipulator don't count as a
+	 * change, so they don't invalidate anything downstream.
+	 */
+	memset(geom->dirty, 0, ((geom->n_manips + 63) / 64) *
+	    sizeof (*geom->dirty));
+	geom->changed = false;
+	for (unsigned i = 0; i < geom->n_drs; i++) {
+		const mgeom_dr_t *dr = &geom->drs[i];
+
+		if (!all && !dr->changed)
+			continue;
+		for (unsigned j = 0; j < dr->n_manips; j++) {
+			uint32_t m = dr->manips[j];
+
+			geom->dirty[m / 64] |= (1ull << (m % 64));
+			geom->changed = true;
+		}
+	}
+	if (all) {
+		for (unsigned i = 0; i < geom->n_manips; i++)
+			geom->dirty[i / 64] |= (1ull << (i % 64));
+		geom->changed = true;
+	}
+	if (geom->changed) {
+		for (unsigned i = 0; i < geom->n_manips; i++) {
+			if (!mgeom_manip_dirty(geom, i))
+				continue;
+			update_manip_bounds(geom, &geom->manips[i]);
+			geom->manips[i].gen = update_num;
+		}
+		mgeom_aabb_clear(&geom->bounds);
+		for (unsigned i = 0; i < geom->n_manips; i++) {
+			if (!geom->manips[i].hidden) {
+				mgeom_aabb_add_aabb(&geom->bounds,
+				    &geom->manips[i].bounds);
+			}
+		}
+		geom->gen = update_num;
+	}
+	geom->evaluated = true;
+	geom->update_num = update_num;
+}
+
+const char *
+mgeom_manip_type2str(mgeom_manip_type_t type)
+{
+	for (unsigned i = 0; i < ARRAY_NUM_ELEM(manip_types); i++) {
+		if (manip_types[i].type == type)
+			return (manip_types[i].name + 11);
+	}
+	return ("unknown");
+}
+
+void
+mgeom_aabb_clear(mgeom_aabb_t *aabb)
+{
+	ASSERT(aabb != NULL);
+	for (int i = 0; i < 3; i++) {
+		aabb->min[i] = INFINITY;
+		aabb->max[i] = -INFINITY;
+	}
+}
+
+void
+mgeom_aabb_add_pt(mgeom_aabb_t *aabb, const vec3 pt)
+{
+	ASSERT(aabb != NULL);
+	for (int i = 0; i < 3; i++) {
+		aabb->min[i] = MIN(aabb->min[i], pt[i]);
+		aabb->max[i] = MAX(aabb->max[i], pt[i]);
+	}
+}
+
+void
+mgeom_aabb_add_aabb(mgeom_aabb_t *aabb, const mgeom_aabb_t *other)
+{
+	ASSERT(aabb != NULL);
+	ASSERT(other != NULL);
+	if (mgeom_aabb_is_empty(other))
+		return;
+	mgeom_aabb_add_pt(aabb, other->min);
+	mgeom_aabb_add_pt(aabb, other->max);
+}
+
+/*
+ * Transforms an AABB by an affine matrix, producing the tightest AABB
+ * enclosing the transformed box (Arvo's method).
+ */
+void
+mgeom_aabb_xform(const mgeom_aabb_t *in, const mat4 m, mgeom_aabb_t *out)
+{
+	ASSERT(in != NULL);
+	ASSERT(out != NULL);
+
+	if (mgeom_aabb_is_empty(in)) {
+		mgeom_aabb_clear(out);
+		return;
+	}
+	for (int i = 0; i < 3; i++) {
+		out->min[i] = out->max[i] = m[3][i];
+		for (int j = 0; j < 3; j++) {
+			float a = m[j][i] * in->min[j];
+			float b = m[j][i] * in->max[j];
+
+			out->min[i] += MIN(a, b);
+			out->max[i] += MAX(a, b);
+		}
+	}
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_MGEOM_H_
+#define	_MGEOM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cglm/cglm.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/dr.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Manipulator geometry extracted from an OBJ8 file. libobj8 (from
+ * librain) keeps all of its geometry private and only lets us draw it,
+ * so for anything where we need to reason about manipulators on the CPU
+ * (bounds, ray casting, building our own meshes), we re-parse the
+ * manipulator-carrying parts of the object here. Only vertex positions,
+ * the TRIS commands which have a manipulator attached and the animation
+ * chain above them are retained.
+ *
+ * Manipulator indices are assigned in the order in which the ATTR_manip_*
+ * commands appear in the file, the same as libobj8 does it. This lets us
+ * use them interchangeably with the indices libobj8 writes into the
+ * resolve framebuffer and with obj8_get_manip().
+ */
+
+#define	MGEOM_ANIM_NONE		UINT32_MAX
+#define	MGEOM_DR_NONE		UINT32_MAX
+
+typedef enum {
+	MGEOM_MANIP_AXIS_KNOB,
+	MGEOM_MANIP_AXIS_SWITCH_LR,
+	MGEOM_MANIP_AXIS_SWITCH_UD,
+	MGEOM_MANIP_COMMAND,
+	MGEOM_MANIP_COMMAND_AXIS,
+	MGEOM_MANIP_COMMAND_KNOB,
+	MGEOM_MANIP_COMMAND_KNOB2,
+	MGEOM_MANIP_COMMAND_SWITCH_LR,
+	MGEOM_MANIP_COMMAND_SWITCH_LR2,
+	MGEOM_MANIP_COMMAND_SWITCH_UD,
+	MGEOM_MANIP_COMMAND_SWITCH_UD2,
+	MGEOM_MANIP_DELTA,
+	MGEOM_MANIP_DRAG_AXIS,
+	MGEOM_MANIP_DRAG_AXIS_PIX,
+	MGEOM_MANIP_DRAG_ROTATE,
+	MGEOM_MANIP_DRAG_XY,
+	MGEOM_MANIP_NOOP,
+	MGEOM_MANIP_PUSH,
+	MGEOM_MANIP_RADIO,
+	MGEOM_MANIP_TOGGLE,
+	MGEOM_MANIP_WRAP,
+	MGEOM_MANIP_UNKNOWN
+} mgeom_manip_type_t;
+
+typedef struct {
+	vec3		min;
+	vec3		max;
+} mgeom_aabb_t;
+
+typedef enum {
+	MGEOM_XFORM_TRANS,
+	MGEOM_XFORM_ROTATE,
+	MGEOM_XFORM_HIDE,
+	MGEOM_XFORM_SHOW
+} mgeom_xform_type_t;
+
+typedef struct {
+	float		value;		/* dataref value */
+	vec3		v;		/* offset, or angle in v[0] */
+} mgeom_key_t;
+
+/*
+ * A single node in the animation tree. Every ANIM_trans, ANIM_rotate,
+ * ANIM_hide and ANIM_show command produces one node, whose parent is
+ * the node which was current just before it. Nodes are stored in parse
+ * order, so a parent always precedes its children.
+ */
+typedef struct {
+	uint32_t		parent;		/* or MGEOM_ANIM_NONE */
+	mgeom_xform_type_t	type;
+	uint32_t		dr;		/* or MGEOM_DR_NONE */
+	vec3			axis;		/* rotation axis */
+	float			loop;		/* ANIM_keyframe_loop, or 0 */
+	unsigned		n_keys;
+	mgeom_key_t		*keys;
+	/* evaluated state, filled in by mgeom_update() */
+	mat4			xform;		/* node local -> object space */
+	bool			hidden;
+	bool			changed;	/* in the last update */
+	uint64_t		gen;		/* update_num of last change */
+} mgeom_anim_t;
+
+typedef struct {
+	char		name[128];
+	unsigned	arr_idx;
+	bool		is_array;
+	bool		found;
+	dr_t		dr;
+	float		value;
+	bool		changed;	/* in the last update */
+	/* filled in by mgeom_bind_drs() */
+	uint32_t	batch;		/* into batches, or UINT32_MAX */
+	unsigned	n_manips;
+	uint32_t	*manips;	/* manipulators this dataref moves */
+} mgeom_dr_t;
+
+/*
+ * Array datarefs are read in batches: all elements of one array which
+ * the object references and which lie close enough together are read
+ * with a single call, instead of one call per element.
+ */
+typedef struct {
+	uint32_t	dr;		/* mgeom_dr_t to read through */
+	unsigned	off;		/* first array element read */
+	unsigned	n;		/* number of elements read */
+	float		*values;
+} mgeom_batch_t;
+
+/*
+ * A contiguous run of triangle indices belonging to one manipulator
+ * and drawn under one animation node. Bounds are in the node's local
+ * coordinate space.
+ */
+typedef struct {
+	uint32_t	manip;
+	uint32_t	anim;		/* or MGEOM_ANIM_NONE */
+	uint32_t	off;		/* first index in mgeom_t.idx */
+	uint32_t	len;		/* number of indices, multiple of 3 */
+	mgeom_aabb_t	bounds;
+} mgeom_span_t;
+
+typedef struct {
+	mgeom_manip_type_t	type;
+	uint32_t		first_span;
+	uint32_t		n_spans;
+	bool			animated;
+	/* evaluated state, filled in by mgeom_update() */
+	mgeom_aabb_t		bounds;		/* object space */
+	bool			hidden;		/* all spans hidden */
+	uint64_t		gen;		/* update_num of last move */
+} mgeom_manip_t;
+
+typedef struct {
+	unsigned	n_vtx;
+	vec3		*vtx;
+	unsigned	n_idx;
+	uint32_t	*idx;
+	unsigned	n_spans;
+	mgeom_span_t	*spans;		/* sorted by manip, then anim */
+	unsigned	n_manips;
+	mgeom_manip_t	*manips;
+	unsigned	n_anims;
+	mgeom_anim_t	*anims;
+	unsigned	n_drs;
+	mgeom_dr_t	*drs;
+	unsigned	n_batches;
+	mgeom_batch_t	*batches;
+	bool		evaluated;	/* mgeom_update() was called */
+	bool		changed;	/* any manip moved in last update */
+	uint64_t	*dirty;		/* manips moved in last update */
+	mgeom_aabb_t	bounds;		/* of all visible manipulators */
+	uint64_t	update_num;	/* incremented by mgeom_update() */
+	uint64_t	gen;		/* update_num of last manip move */
+} mgeom_t;
+
+mgeom_t *mgeom_parse(const char *filename);
+void mgeom_free(mgeom_t *geom);
+
+void mgeom_bind_drs(mgeom_t *geom);
+void mgeom_update(mgeom_t *geom);
+
+const char *mgeom_manip_type2str(mgeom_manip_type_t type);
+
+/*
+ * Whether manipulator `idx' moved, got hidden or got shown in the last
+ * mgeom_update().
+ */
+static inline bool
+mgeom_manip_dirty(const mgeom_t *geom, unsigned idx)
+{
+	ASSERT3U(idx, <, geom->n_manips);
+	return ((geom->dirty[idx / 64] >> (idx % 64)) & 1);
+}
+
+/*
+ * Whether manipulator `idx' moved in any update after the one which
+ * left the geometry at `update_num'. Lets consumers which don't look at
+ * every update (caches, refits) tell what they need to redo.
+ */
+static inline bool
+mgeom_manip_moved_since(const mgeom_t *geom, unsigned idx,
+    uint64_t update_num)
+{
+	ASSERT3U(idx, <, geom->n_manips);
+	return (geom->manips[idx].gen > update_num);
+}
+
+static inline bool
+mgeom_aabb_is_empty(const mgeom_aabb_t *aabb)
+{
+	return (aabb->min[0] > aabb->max[0]);
+}
+
+void mgeom_aabb_clear(mgeom_aabb_t *aabb);
+void mgeom_aabb_add_pt(mgeom_aabb_t *aabb, const vec3 pt);
+void mgeom_aabb_add_aabb(mgeom_aabb_t *aabb, const mgeom_aabb_t *other);
+void mgeom_aabb_xform(const mgeom_aabb_t *in, const mat4 m,
+    mgeom_aabb_t *out);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _MGEOM_H_ */
@@ -0,0 +1,442 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+
+#include "glstate.h"
+#include "mmesh.h"
+
+/*
+ * Positions are quantized to 16 bits per axis against the bounding box
+ * of the mesh, which comes out below 0.1 mm per step for anything the
+ * size of a cockpit. The shaders never see the quantized values, as
+ * the attribute gets normalized to [0, 1] by GL and the box mapping is
+ * folded into the transforms we hand out (see `dequant').
+ */
+typedef struct {
+	GLushort	pos[3];
+	GLushort	manip;
+} mmesh_vtx_t;
+
+typedef struct {
+	uint32_t	anim;
+	uint32_t	off;		/* in indices */
+	uint32_t	len;
+} draw_range_t;
+
+struct mmesh_s {
+	GLuint		vbo;
+	GLuint		ibo;
+	unsigned	n_vtx;
+	unsigned	n_idx;
+	GLenum		idx_type;	/* GL_UNSIGNED_SHORT or _INT */
+	size_t		idx_sz;
+	mat4		dequant;	/* [0, 1] -> mesh space */
+	/* scratch space for building multi-draw lists */
+	unsigned	max_ranges;
+	draw_range_t	*ranges;
+	GLsizei		*counts;
+	const void	**offsets;
+	/* created on first use by mmesh_bind_compute() */
+	GLuint		tri_anim_buf;
+	GLuint		xform_buf;
+	uint64_t	xform_gen;	/* geom->gen of the uploaded xforms */
+	mat4		*xforms;
+};
+
+static void
+quantize(mmesh_t *mesh, const mgeom_t *geom, const uint32_t *src,
+    mmesh_vtx_t *vtx)
+{
+	mgeom_aabb_t box;
+	vec3 ext;
+
+	mgeom_aabb_clear(&box);
+	for (unsigned i = 0; i < mesh->n_vtx; i++)
+		mgeom_aabb_add_pt(&box, geom->vtx[src[i]]);
+	if (mgeom_aabb_is_empty(&box)) {
+		glm_mat4_identity(mesh->dequant);
+		return;
+	}
+	glm_vec3_sub(box.max, box.min, ext);
+	for (unsigned i = 0; i < mesh->n_vtx; i++) {
+		for (int j = 0; j < 3; j++) {
+			float f = (ext[j] > 0 ? (geom->vtx[src[i]][j] -
+			    box.min[j]) / ext[j] : 0);
+
+			vtx[i].pos[j] = roundf(clamp(f, 0, 1) * UINT16_MAX);
+		}
+	}
+	glm_translate_make(mesh->dequant, box.min);
+	glm_scale(mesh->dequant, ext);
+}
+
+static void
+upload_idx(mmesh_t *mesh, const uint32_t *idx)
+{
+	void *buf = (void *)idx;
+	/* padded to whole 32-bit words for the compute shader */
+	size_t sz = ((mesh->n_idx * mesh->idx_sz + 3) / 4) * 4;
+
+	if (mesh->idx_type == GL_UNSIGNED_SHORT) {
+		GLushort *idx16 = safe_calloc(MAX(sz, 4), 1);
+
+		for (unsigned i = 0; i < mesh->n_idx; i++)
+			idx16[i] = idx[i];
+		buf = idx16;
+	}
+	glGenBuffers(1, &mesh->ibo);
+	VERIFY(mesh->ibo != 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, MAX(sz, 4), buf,
+	    GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	if (buf != idx)
+		free(buf);
+}
+
+/*
+ * Builds and uploads the mesh. Vertices shared between manipulators get
+ * duplicated, since each one needs to carry its own manipulator index.
+ * Positions get quantized to 16 bits and indices are 16 bits wide too
+ * if the vertex count allows, which makes the mesh a quarter of the
+ * size of the full-precision one. Must be called with a GL context.
+ */
+mmesh_t *
+mmesh_new(const mgeom_t *geom)
+{
+	mmesh_t *mesh = safe_calloc(1, sizeof (*mesh));
+	uint32_t *remap, *remap_manip, *idx, *src;
+	mmesh_vtx_t *vtx;
+
+	ASSERT(geom != NULL);
+	/* the manipulator index has to fit into the vertex */
+	ASSERT3U(geom->n_manips, <=, UINT16_MAX);
+
+	remap = safe_calloc(MAX(geom->n_vtx, 1), sizeof (*remap));
+	remap_manip = safe_malloc(MAX(geom->n_vtx, 1) *
+	    sizeof (*remap_manip));
+	memset(remap_manip, 0xff, geom->n_vtx * sizeof (*remap_manip));
+	vtx = safe_calloc(MAX(geom->n_idx, 1), sizeof (*vtx));
+	idx = safe_calloc(MAX(geom->n_idx, 1), sizeof (*idx));
+	src = safe_calloc(MAX(geom->n_idx, 1), sizeof (*src));
+	/*
+	 * Spans are sorted by manipulator, so each vertex only needs to
+	 * remember which manipulator it was last emitted for.
+	 */
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+
+		for (unsigned j = 0; j < span->len; j++) {
+			uint32_t v = geom->idx[span->off + j];
+
+			if (remap_manip[v] != span->manip) {
+				src[mesh->n_vtx] = v;
+				vtx[mesh->n_vtx].manip = span->manip;
+				remap_manip[v] = span->manip;
+				remap[v] = mesh->n_vtx++;
+			}
+			idx[span->off + j] = remap[v];
+		}
+	}
+	mesh->n_idx = geom->n_idx;
+	quantize(mesh, geom, src, vtx);
+	if (mesh->n_vtx <= UINT16_MAX + 1) {
+		mesh->idx_type = GL_UNSIGNED_SHORT;
+		mesh->idx_sz = sizeof (GLushort);
+	} else {
+		mesh->idx_type = GL_UNSIGNED_INT;
+		mesh->idx_sz = sizeof (GLuint);
+	}
+
+	glGenBuffers(1, &mesh->vbo);
+	VERIFY(mesh->vbo != 0);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	glBufferData(GL_ARRAY_BUFFER, mesh->n_vtx * sizeof (*vtx), vtx,
+	    GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	upload_idx(mesh, idx);
+
+	mesh->max_ranges = MAX(geom->n_spans, 1);
+	mesh->ranges = safe_calloc(mesh->max_ranges, sizeof (*mesh->ranges));
+	mesh->counts = safe_calloc(mesh->max_ranges, sizeof (*mesh->counts));
+	mesh->offsets = safe_calloc(mesh->max_ranges,
+	    sizeof (*mesh->offsets));
+
+	free(remap);
+	free(remap_manip);
+	free(vtx);
+	free(idx);
+	free(src);
+
+	return (mesh);
+}
+
+void
+mmesh_free(mmesh_t *mesh)
+{
+	if (mesh == NULL)
+		return;
+	if (mesh->vbo != 0)
+		glDeleteBuffers(1, &mesh->vbo);
+	if (mesh->ibo != 0)
+		glDeleteBuffers(1, &mesh->ibo);
+	if (mesh->tri_anim_buf != 0)
+		glDeleteBuffers(1, &mesh->tri_anim_buf);
+	if (mesh->xform_buf != 0)
+		glDeleteBuffers(1, &mesh->xform_buf);
+	free(mesh->xforms);
+	free(mesh->ranges);
+	free(mesh->counts);
+	free(mesh->offsets);
+	free(mesh);
+}
+
+static int
+range_compar(const void *a, const void *b)
+{
+	const draw_range_t *ra = a, *rb = b;
+
+	if (ra->anim != rb->anim)
+		return (ra->anim < rb->anim ? -1 : 1);
+	if (ra->off != rb->off)
+		return (ra->off < rb->off ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Draws the given set of manipulators. All ranges hanging under the same
+ * animation node are issued as one glMultiDrawElements, with the node's
+ * current transform folded into the `pvm' uniform. Hidden animation
+ * nodes are skipped. The program must already be bound.
+ */
+void
+mmesh_draw_manips(mmesh_t *mesh, const mgeom_t *geom,
+    const uint32_t *manips, unsigned n_manips, GLuint prog, GLint u_pvm,
+    const mat4 pvm)
+{
+	mmesh_draw_manips_inst(mesh, geom, manips, n_manips, prog, u_pvm,
+	    pvm, 1);
+}
+
+/*
+ * Same as mmesh_draw_manips(), but draws `n_inst' instances of every
+ * range. There's no instanced multi-draw without indirect draws, so
+ * with more than one instance, merged ranges are issued one by one.
+ */
+void
+mmesh_draw_manips_inst(mmesh_t *mesh, const mgeom_t *geom,
+    const uint32_t *manips, unsigned n_manips, GLuint prog, GLint u_pvm,
+    const mat4 pvm, unsigned n_inst)
+{
+	unsigned n_ranges = 0;
+	GLint pos_loc, manip_loc;
+
+	ASSERT(mesh != NULL);
+	ASSERT(geom != NULL);
+	ASSERT(manips != NULL || n_manips == 0);
+	ASSERT(pvm != NULL);
+	ASSERT(n_inst != 0);
+
+	for (unsigned i = 0; i < n_manips; i++) {
+		const mgeom_manip_t *manip;
+
+		ASSERT3U(manips[i], <, geom->n_manips);
+		manip = &geom->manips[manips[i]];
+		for (unsigned j = 0; j < manip->n_spans; j++) {
+			const mgeom_span_t *span =
+			    &geom->spans[manip->first_span + j];
+
+			if (span->anim != MGEOM_ANIM_NONE &&
+			    geom->anims[span->anim].hidden)
+				continue;
+			ASSERT3U(n_ranges, <, mesh->max_ranges);
+			mesh->ranges[n_ranges].anim = span->anim;
+			mesh->ranges[n_ranges].off = span->off;
+			mesh->ranges[n_ranges].len = span->len;
+			n_ranges++;
+		}
+	}
+	if (n_ranges == 0)
+		return;
+	if (n_ranges > 1) {
+		qsort(mesh->ranges, n_ranges, sizeof (*mesh->ranges),
+		    range_compar);
+	}
+
+	pos_loc = glGetAttribLocation(prog, "vtx_pos");
+	manip_loc = glGetAttribLocation(prog, "vtx_manip");
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+	if (pos_loc != -1) {
+		glEnableVertexAttribArray(pos_loc);
+		glVertexAttribPointer(pos_loc, 3, GL_UNSIGNED_SHORT, GL_TRUE,
+		    sizeof (mmesh_vtx_t),
+		    (void *)offsetof(mmesh_vtx_t, pos));
+	}
+	if (manip_loc != -1) {
+		glEnableVertexAttribArray(manip_loc);
+		glVertexAttribPointer(manip_loc, 1, GL_UNSIGNED_SHORT,
+		    GL_FALSE, sizeof (mmesh_vtx_t),
+		    (void *)offsetof(mmesh_vtx_t, manip));
+	}
+
+	for (unsigned i = 0; i < n_ranges;) {
+		uint32_t anim = mesh->ranges[i].anim;
+		unsigned n_draws = 0;
+		mat4 m;
+
+		if (anim != MGEOM_ANIM_NONE) {
+			glm_mat4_mul((vec4 *)pvm,
+			    (vec4 *)geom->anims[anim].xform, m);
+		} else {
+			glm_mat4_copy((vec4 *)pvm, m);
+		}
+		glm_mat4_mul(m, mesh->dequant, m);
+		glstate_uniform_mat4(prog, u_pvm, m);
+		for (; i < n_ranges && mesh->ranges[i].anim == anim; i++) {
+			const draw_range_t *r = &mesh->ranges[i];
+
+			/* merge ranges adjacent in the index buffer */
+			if (n_draws != 0 &&
+			    (uintptr_t)mesh->offsets[n_draws - 1] +
+			    mesh->counts[n_draws - 1] * mesh->idx_sz ==
+			    r->off * mesh->idx_sz) {
+				mesh->counts[n_draws - 1] += r->len;
+				continue;
+			}
+			mesh->counts[n_draws] = r->len;
+			mesh->offsets[n_draws] =
+			    (const void *)(uintptr_t)(r->off * mesh->idx_sz);
+			n_draws++;
+		}
+		if (n_inst > 1) {
+			for (unsigned j = 0; j < n_draws; j++) {
+				glDrawElementsInstanced(GL_TRIANGLES,
+				    mesh->counts[j], mesh->idx_type,
+				    mesh->offsets[j], n_inst);
+			}
+		} else if (n_draws == 1) {
+			glDrawElements(GL_TRIANGLES, mesh->counts[0],
+			    mesh->idx_type, mesh->offsets[0]);
+		} else {
+			glMultiDrawElements(GL_TRIANGLES, mesh->counts,
+			    mesh->idx_type, mesh->offsets, n_draws);
+		}
+	}
+
+	if (pos_loc != -1)
+		glDisableVertexAttribArray(pos_loc);
+	if (manip_loc != -1)
+		glDisableVertexAttribArray(manip_loc);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+static void
+compute_init(mmesh_t *mesh, const mgeom_t *geom)
+{
+	unsigned n_tris = mesh->n_idx / 3;
+	uint32_t *tri_anim = safe_calloc(MAX(n_tris, 1), sizeof (*tri_anim));
+
+	/* the last transform is the identity, for unanimated spans */
+	for (unsigned i = 0; i < geom->n_spans; i++) {
+		const mgeom_span_t *span = &geom->spans[i];
+		uint32_t anim = (span->anim != MGEOM_ANIM_NONE ? span->anim :
+		    geom->n_anims);
+		unsigned first = span->off / 3, n = span->len / 3;
+
+		for (unsigned j = first; j < first + n; j++)
+			tri_anim[j] = anim;
+	}
+	glGenBuffers(1, &mesh->tri_anim_buf);
+	VERIFY(mesh->tri_anim_buf != 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mesh->tri_anim_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, MAX(n_tris, 1) *
+	    sizeof (*tri_anim), tri_anim, GL_STATIC_DRAW);
+	free(tri_anim);
+
+	mesh->xforms = safe_calloc(geom->n_anims + 1, sizeof (*mesh->xforms));
+	glGenBuffers(1, &mesh->xform_buf);
+	VERIFY(mesh->xform_buf != 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mesh->xform_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (geom->n_anims + 1) *
+	    sizeof (*mesh->xforms), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	/* force an upload */
+	mesh->xform_gen = UINT64_MAX;
+}
+
+/*
+ * Binds the mesh for ray casting in a compute shader: the vertex and
+ * index buffers as they are, plus the animation node of every triangle
+ * and the current transform of every node, with the dequantization
+ * folded in. Whether the indices are 16 bits wide goes to the uniform
+ * `u_idx_short'. A hidden node gets an all zero transform, which
+ * collapses its triangles so they can't be hit.
+ * The transforms are only re-uploaded after an mgeom_update() moved
+ * a manipulator. Returns the number of triangles to dispatch over.
+ */
+unsigned
+mmesh_bind_compute(mmesh_t *mesh, const mgeom_t *geom, GLint u_idx_short)
+{
+	ASSERT(mesh != NULL);
+	ASSERT(geom != NULL);
+
+	if (mesh->tri_anim_buf == 0)
+		compute_init(mesh, geom);
+	if (mesh->xform_gen != geom->gen) {
+		for (unsigned i = 0; i < geom->n_anims; i++) {
+			if (geom->anims[i].hidden) {
+				memset(mesh->xforms[i], 0,
+				    sizeof (mesh->xforms[i]));
+			} else {
+				glm_mat4_mul((vec4 *)geom->anims[i].xform,
+				    mesh->dequant, mesh->xforms[i]);
+			}
+		}
+		glm_mat4_copy(mesh->dequant, mesh->xforms[geom->n_anims]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mesh->xform_buf);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		    (geom->n_anims + 1) * sizeof (*mesh->xforms),
+		    mesh->xforms);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		mesh->xform_gen = geom->gen;
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MMESH_BIND_VTX, mesh->vbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MMESH_BIND_IDX, mesh->ibo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MMESH_BIND_TRI_ANIM,
+	    mesh->tri_anim_buf);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MMESH_BIND_XFORMS,
+	    mesh->xform_buf);
+	glUniform1i(u_idx_short, mesh->idx_type == GL_UNSIGNED_SHORT);
+
+	return (mesh->n_idx / 3);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_MMESH_H_
+#define	_MMESH_H_
+
+#include <stdint.h>
+
+#include <cglm/cglm.h>
+
+#include <acfutils/glew.h>
+
+#include "mgeom.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A tightly packed GPU mesh of only the manipulator triangles of an
+ * object. Every vertex carries its manipulator index as an attribute,
+ * so any set of manipulators can be drawn for ID resolution in a single
+ * multi-draw per animation node, without walking the object's full
+ * command stream. Indices are sorted by manipulator, so a single
+ * manipulator is a handful of ranged draws at most.
+ */
+typedef struct mmesh_s mmesh_t;
+
+mmesh_t *mmesh_new(const mgeom_t *geom);
+void mmesh_free(mmesh_t *mesh);
+
+void mmesh_draw_manips(mmesh_t *mesh, const mgeom_t *geom,
+    const uint32_t *manips, unsigned n_manips, GLuint prog, GLint u_pvm,
+    const mat4 pvm);
+void mmesh_draw_manips_inst(mmesh_t *mesh, const mgeom_t *geom,
+    const uint32_t *manips, unsigned n_manips, GLuint prog, GLint u_pvm,
+    const mat4 pvm, unsigned n_inst);
+
+/*
+ * Shader storage bindings used by mmesh_bind_compute(), as declared in
+ * resolve_ray.comp.
+ */
+#define	MMESH_BIND_VTX		0
+#define	MMESH_BIND_IDX		1
+#define	MMESH_BIND_TRI_ANIM	2
+#define	MMESH_BIND_XFORMS	3
+
+unsigned mmesh_bind_compute(mmesh_t *mesh, const mgeom_t *geom,
+    GLint u_idx_short);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _MMESH_H_ */
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#if	defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+
+#include "pickreduce.h"
+
+/* padded to whole SSE vectors */
+#define	MAX_PX_PAD	((PICKREDUCE_MAX_PX + 3) & ~3u)
+/*
+ * Pixel keys are the squared distance from the center times KEY_SCALE
+ * plus the pixel index, so the smallest key is the nearest pixel, with
+ * ties going to the lowest index. KEY_NONE sorts after all of them.
+ */
+#define	KEY_SCALE	128
+#define	KEY_NONE	INT32_MAX
+_Static_assert(PICKREDUCE_MAX_PX <= KEY_SCALE, "pixel index overflows key");
+
+typedef struct {
+	bool		inited;
+	int32_t		keys[MAX_PX_PAD];
+	uint8_t		order[PICKREDUCE_MAX_PX];   /* pixels by distance */
+} dim_info_t;
+
+static dim_info_t	dims[PICKREDUCE_MAX_DIM + 1];
+
+static const dim_info_t *
+dim_info(unsigned dim)
+{
+	dim_info_t *di = &dims[dim];
+	unsigned n = dim * dim;
+	int c = dim / 2;
+
+	if (di->inited)
+		return (di);
+	for (unsigned i = 0; i < MAX_PX_PAD; i++) {
+		int dx = (int)(i % dim) - c, dy = (int)(i / dim) - c;
+
+		di->keys[i] = (i < n ? (dx * dx + dy * dy) * KEY_SCALE + i :
+		    KEY_NONE);
+	}
+	/* insertion sort, this runs at most once per size */
+	for (unsigned i = 0; i < n; i++) {
+		unsigned j = i;
+
+		while (j > 0 && di->keys[di->order[j - 1]] > di->keys[i]) {
+			di->order[j] = di->order[j - 1];
+			j--;
+		}
+		di->order[j] = i;
+	}
+	di->inited = true;
+
+	return (di);
+}
+
+/*
+ * Returns the smallest key of a covered pixel, or KEY_NONE.
+ */
+static int32_t
+min_key(const uint32_t *ids, const int32_t *keys, unsigned n_pad,
+    uint32_t none)
+{
+#if	defined(__SSE2__)
+	const __m128i none_v = _mm_set1_epi32(none);
+	const __m128i key_none_v = _mm_set1_epi32(KEY_NONE);
+	__m128i best = key_none_v;
+	int32_t lanes[4];
+
+	for (unsigned i = 0; i < n_pad; i += 4) {
+		__m128i id = _mm_loadu_si128((const __m128i *)&ids[i]);
+		__m128i key = _mm_loadu_si128((const __m128i *)&keys[i]);
+		__m128i empty = _mm_cmpeq_epi32(id, none_v);
+		__m128i lt;
+
+		/* SSE2 has no 32-bit min, so select through a compare */
+		key = _mm_or_si128(_mm_and_si128(empty, key_none_v),
+		    _mm_andnot_si128(empty, key));
+		lt = _mm_cmplt_epi32(key, best);
+		best = _mm_or_si128(_mm_and_si128(lt, key),
+		    _mm_andnot_si128(lt, best));
+	}
+	_mm_storeu_si128((__m128i *)lanes, best);
+	return (MIN(MIN(lanes[0], lanes[1]), MIN(lanes[2], lanes[3])));
+#else	/* !defined(__SSE2__) */
+	int32_t best = KEY_NONE;
+
+	for (unsigned i = 0; i < n_pad; i++) {
+		if (ids[i] != none && keys[i] < best)
+			best = keys[i];
+	}
+	return (best);
+#endif	/* !defined(__SSE2__) */
+}
+
+/*
+ * Returns the number of pixels holding `id'.
+ */
+static unsigned
+count_id(const uint32_t *ids, unsigned n_pad, uint32_t id)
+{
+#if	defined(__SSE2__)
+	const __m128i id_v = _mm_set1_epi32(id);
+	__m128i cnt = _mm_setzero_si128();
+	int32_t lanes[4];
+
+	/* matching lanes compare to -1, so subtracting counts them */
+	for (unsigned i = 0; i < n_pad; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&ids[i]);
+
+		cnt = _mm_sub_epi32(cnt, _mm_cmpeq_epi32(v, id_v));
+	}
+	_mm_storeu_si128((__m128i *)lanes, cnt);
+	return (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+#else	/* !defined(__SSE2__) */
+	unsigned cnt = 0;
+
+	for (unsigned i = 0; i < n_pad; i++)
+		cnt += (ids[i] == id);
+	return (cnt);
+#endif	/* !defined(__SSE2__) */
+}
+
+int
+pickreduce(const uint32_t *ids_in, unsigned dim, uint32_t none,
+    pickreduce_mode_t mode)
+{
+	const dim_info_t *di;
+	uint32_t ids[MAX_PX_PAD];
+	unsigned n, n_pad, best_cnt = 0;
+	int best = -1;
+
+	ASSERT(ids_in != NULL);
+	ASSERT3U(dim, >=, 1);
+	ASSERT3U(dim, <=, PICKREDUCE_MAX_DIM);
+	ASSERT(dim & 1);
+
+	di = dim_info(dim);
+	n = dim * dim;
+	n_pad = (n + 3) & ~3u;
+	memcpy(ids, ids_in, n * sizeof (*ids));
+	for (unsigned i = n; i < n_pad; i++)
+		ids[i] = none;
+
+	if (mode == PICKREDUCE_NEAREST) {
+		int32_t key = min_key(ids, di->keys, n_pad, none);
+
+		return (key != KEY_NONE ? key % KEY_SCALE : -1);
+	}
+	ASSERT3U(mode, ==, PICKREDUCE_COVERAGE);
+	/*
+	 * Visiting pixels nearest first means we meet every ID at its
+	 * nearest pixel, and that ties go to the nearer ID.
+	 */
+	for (unsigned i = 0; i < n; i++) {
+		unsigned px = di->order[i], cnt;
+		bool seen = false;
+
+		if (ids[px] == none)
+			continue;
+		for (unsigned j = 0; j < i && !seen; j++)
+			seen = (ids[di->order[j]] == ids[px]);
+		if (seen)
+			continue;
+		cnt = count_id(ids, n_pad, ids[px]);
+		if (cnt > best_cnt) {
+			best_cnt = cnt;
+			best = px;
+		}
+		/* nobody else can beat it anymore */
+		if (best_cnt * 2 > n)
+			break;
+	}
+
+	return (best);
+}
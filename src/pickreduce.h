@@ -0,0 +1,62 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_PICKREDUCE_H_
+#define	_PICKREDUCE_H_
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Reduction of a square pick region around a pick point down to a
+ * single pick ID, for hover tolerance. The region is `dim' x `dim'
+ * pixels (dim odd, at most PICKREDUCE_MAX_DIM), in row-major order,
+ * centered on the pick point. Pixels without a manipulator hold `none'.
+ *
+ * PICKREDUCE_NEAREST picks the covered pixel closest to the center,
+ * so anything right under the point always wins. PICKREDUCE_COVERAGE
+ * picks the ID covering the most pixels, with ties going to whichever
+ * comes closest to the center. Either way, the result is the index of
+ * the pixel chosen (the nearest one of its ID), or -1 if no pixel is
+ * covered. On x86 the scans use SSE2.
+ */
+#define	PICKREDUCE_MAX_DIM	9
+#define	PICKREDUCE_MAX_PX	(PICKREDUCE_MAX_DIM * PICKREDUCE_MAX_DIM)
+
+typedef enum {
+    PICKREDUCE_NEAREST,
+    PICKREDUCE_COVERAGE,
+    NUM_PICKREDUCE_MODES
+} pickreduce_mode_t;
+
+int pickreduce(const uint32_t *ids, unsigned dim, uint32_t none,
+    pickreduce_mode_t mode);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _PICKREDUCE_H_ */
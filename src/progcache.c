@@ -0,0 +1,400 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/crc64.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "glstate.h"
+#include "progcache.h"
+
+#define	PROGCACHE_MAGIC		0x3150444dU	/* "MDP1" */
+#define	PROGCACHE_VERSION	1
+
+/*
+ * On-disk layout: the header, immediately followed by `len' bytes of
+ * the driver's program binary in format `fmt'.
+ */
+typedef struct {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	drv_crc;
+	uint64_t	src_crc;
+	uint32_t	fmt;
+	uint32_t	len;
+} progcache_hdr_t;
+
+/*
+ * The GLSL fallbacks which shaders/src/Makefile generates next to each
+ * SPIR-V file. Which one gets used depends on the driver, so we simply
+ * hash all of them.
+ */
+static const char *const glsl_exts[] = {
+    ".glsl", ".glsl420", ".glsl430", ".glsl460"
+};
+
+static bool
+supported(void)
+{
+	GLint n_fmts = 0;
+
+	if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+		return (false);
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_fmts);
+	return (n_fmts > 0);
+}
+
+static uint64_t
+crc_append_str(uint64_t crc, const GLubyte *str)
+{
+	const char *s = (str != NULL ? (const char *)str : "");
+
+	/* include the terminator, so consecutive strings can't run together */
+	return (crc64_append(crc, s, strlen(s) + 1));
+}
+
+static uint64_t
+drv_crc(void)
+{
+	uint64_t crc = 0;
+
+	crc = crc_append_str(crc, glGetString(GL_VENDOR));
+	crc = crc_append_str(crc, glGetString(GL_RENDERER));
+	crc = crc_append_str(crc, glGetString(GL_VERSION));
+
+	return (crc);
+}
+
+static uint64_t
+file_crc_append(uint64_t crc, const char *path)
+{
+	size_t sz;
+	void *buf = file2buf(path, &sz);
+
+	if (buf == NULL)
+		return (crc);
+	crc = crc_append_str(crc, (const GLubyte *)path);
+	crc = crc64_append(crc, buf, sz);
+	lacf_free(buf);
+
+	return (crc);
+}
+
+static uint64_t
+stage_crc_append(uint64_t crc, const char *shader_dir,
+    const shader_info_t *stage)
+{
+	char *path, *p;
+
+	if (stage == NULL)
+		return (crc);
+	ASSERT(stage->filename != NULL);
+	if (stage->entry_pt != NULL)
+		crc = crc_append_str(crc, (const GLubyte *)stage->entry_pt);
+	path = mkpathname(shader_dir, stage->filename, NULL);
+	crc = file_crc_append(crc, path);
+	if ((p = strrchr(path, '.')) != NULL && strcmp(p, ".spv") == 0) {
+		*p = '\0';
+		for (unsigned i = 0; i < ARRAY_NUM_ELEM(glsl_exts); i++) {
+			char *glsl_path = sprintf_alloc("%s%s", path,
+			    glsl_exts[i]);
+
+			crc = file_crc_append(crc, glsl_path);
+			lacf_free(glsl_path);
+		}
+	}
+	lacf_free(path);
+
+	return (crc);
+}
+
+static uint64_t
+src_crc(const char *shader_dir, const shader_prog_info_t *info)
+{
+	uint64_t crc = 0;
+
+	crc = stage_crc_append(crc, shader_dir, info->vert);
+	crc = stage_crc_append(crc, shader_dir, info->frag);
+	crc = stage_crc_append(crc, shader_dir, info->comp);
+
+	return (crc);
+}
+
+static char *
+cache_path(const char *cache_dir, const shader_prog_info_t *info,
+    uint64_t drv)
+{
+	char *name = sprintf_alloc("%s.%016llx.glprog", info->progname,
+	    (unsigned long long)drv);
+	char *path = mkpathname(cache_dir, name, NULL);
+
+	lacf_free(name);
+	return (path);
+}
+
+static void
+get_uniforms(progcache_prog_t *pcp, const char **uniform_names,
+    size_t num_uniforms)
+{
+	for (size_t i = 0; i < num_uniforms; i++)
+		pcp->u[i] = glGetUniformLocation(pcp->prog, uniform_names[i]);
+}
+
+/*
+ * Tries to recreate the program from its cached binary. Returns false if
+ * there's no usable cache, in which case the caller compiles from source.
+ */
+static bool
+cache_load(progcache_prog_t *pcp, const char *path, uint64_t drv,
+    uint64_t src)
+{
+	progcache_hdr_t hdr;
+	size_t sz;
+	uint8_t *buf = file2buf(path, &sz);
+	GLint linked = GL_FALSE;
+
+	if (buf == NULL)
+		return (false);
+	if (sz < sizeof (hdr))
+		goto stale;
+	memcpy(&hdr, buf, sizeof (hdr));
+	if (hdr.magic != PROGCACHE_MAGIC || hdr.version != PROGCACHE_VERSION ||
+	    hdr.drv_crc != drv || hdr.src_crc != src ||
+	    hdr.len != sz - sizeof (hdr))
+		goto stale;
+
+	pcp->prog = glCreateProgram();
+	VERIFY(pcp->prog != 0);
+	glProgramBinary(pcp->prog, hdr.fmt, buf + sizeof (hdr), hdr.len);
+	glGetProgramiv(pcp->prog, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		/*
+		 * Drivers may reject binaries for reasons of their own,
+		 * such as a driver update which didn't change GL_VERSION.
+		 */
+		logMsg("%s: driver rejected cached program binary, "
+		    "recompiling", path);
+		glDeleteProgram(pcp->prog);
+		pcp->prog = 0;
+		goto stale;
+	}
+	lacf_free(buf);
+	return (true);
+stale:
+	lacf_free(buf);
+	remove_file(path, true);
+	return (false);
+}
+
+/*
+ * Stores the program we just compiled from source. The file is written
+ * under a temporary name and renamed into place, like the geometry cache.
+ */
+static void
+cache_write(const progcache_prog_t *pcp, const char *cache_dir,
+    const char *path, uint64_t drv, uint64_t src)
+{
+	GLuint prog = shader_obj_get_prog(&pcp->obj);
+	progcache_hdr_t hdr = {
+	    .magic = PROGCACHE_MAGIC, .version = PROGCACHE_VERSION,
+	    .drv_crc = drv, .src_crc = src
+	};
+	GLint len = 0;
+	GLenum fmt = 0;
+	void *buf;
+	char *tmp_path;
+	FILE *fp;
+	bool ok;
+
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &len);
+	if (len <= 0)
+		return;
+	buf = safe_malloc(len);
+	glGetProgramBinary(prog, len, &len, &fmt, buf);
+	if (len <= 0) {
+		free(buf);
+		return;
+	}
+	hdr.fmt = fmt;
+	hdr.len = len;
+
+	create_directory_recursive(cache_dir);
+	tmp_path = sprintf_alloc("%s.tmp", path);
+	fp = fopen(tmp_path, "wb");
+	if (fp == NULL) {
+		logMsg("Can't write %s: %s", tmp_path, strerror(errno));
+		lacf_free(tmp_path);
+		free(buf);
+		return;
+	}
+	ok = (fwrite(&hdr, 1, sizeof (hdr), fp) == sizeof (hdr) &&
+	    fwrite(buf, 1, len, fp) == (size_t)len);
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok) {
+#if	IBM
+		/* rename() won't replace an existing file on Windows */
+		remove_file(path, true);
+#endif
+		ok = (rename(tmp_path, path) == 0);
+	}
+	if (!ok) {
+		logMsg("Error writing %s: %s", path, strerror(errno));
+		remove_file(tmp_path, true);
+	}
+	lacf_free(tmp_path);
+	free(buf);
+}
+
+/*
+ * Same contract as shader_obj_init(), except that the linked program
+ * comes out of `cache_dir' if possible. Passing a NULL `cache_dir'
+ * simply compiles from source.
+ */
+bool
+progcache_init(progcache_prog_t *pcp, const char *shader_dir,
+    const char *cache_dir, const shader_prog_info_t *info,
+    const shader_attr_bind_t *attr_binds, size_t num_attr_binds,
+    const char **uniform_names, size_t num_uniforms)
+{
+	uint64_t drv, src;
+	char *path;
+
+	ASSERT(pcp != NULL);
+	ASSERT(shader_dir != NULL);
+	ASSERT(info != NULL);
+	ASSERT(info->progname != NULL);
+	ASSERT3U(num_uniforms, <=, PROGCACHE_MAX_UNIFORMS);
+
+	memset(pcp, 0, sizeof (*pcp));
+	pcp->shader_dir = safe_strdup(shader_dir);
+	pcp->info = info;
+	pcp->attr_binds = attr_binds;
+	pcp->num_attr_binds = num_attr_binds;
+	pcp->uniform_names = uniform_names;
+	pcp->num_uniforms = num_uniforms;
+	if (cache_dir == NULL || !supported()) {
+		return (shader_obj_init(&pcp->obj, shader_dir, info,
+		    attr_binds, num_attr_binds, uniform_names, num_uniforms));
+	}
+	drv = drv_crc();
+	src = src_crc(shader_dir, info);
+	pcp->src_crc = src;
+	path = cache_path(cache_dir, info, drv);
+	if (cache_load(pcp, path, drv, src)) {
+		get_uniforms(pcp, uniform_names, num_uniforms);
+		lacf_free(path);
+		return (true);
+	}
+	if (!shader_obj_init(&pcp->obj, shader_dir, info, attr_binds,
+	    num_attr_binds, uniform_names, num_uniforms)) {
+		lacf_free(path);
+		return (false);
+	}
+	/*
+	 * shader_obj_init() links the program itself, so we can't set
+	 * GL_PROGRAM_BINARY_RETRIEVABLE_HINT beforehand. All drivers we
+	 * care about hand out the binary regardless.
+	 */
+	cache_write(pcp, cache_dir, path, drv, src);
+	lacf_free(path);
+
+	return (true);
+}
+
+void
+progcache_fini(progcache_prog_t *pcp)
+{
+	ASSERT(pcp != NULL);
+
+	if (pcp->prog != 0) {
+		glDeleteProgram(pcp->prog);
+		pcp->prog = 0;
+	}
+	shader_obj_fini(&pcp->obj);
+	free(pcp->shader_dir);
+	pcp->shader_dir = NULL;
+}
+
+/*
+ * Picks up any changes to the program's shader files. A program which
+ * came from the cache has no sources attached to it, so if its files
+ * changed, it is switched over to being compiled from source. The stale
+ * cache file is replaced on the next start. This reads the shader files,
+ * so it's only meant to be called once something says they changed.
+ */
+void
+progcache_reload_check(progcache_prog_t *pcp)
+{
+	ASSERT(pcp != NULL);
+
+	if (pcp->prog == 0) {
+		shader_obj_reload_check(&pcp->obj);
+		return;
+	}
+	if (src_crc(pcp->shader_dir, pcp->info) == pcp->src_crc)
+		return;
+	if (!shader_obj_init(&pcp->obj, pcp->shader_dir, pcp->info,
+	    pcp->attr_binds, pcp->num_attr_binds, pcp->uniform_names,
+	    pcp->num_uniforms)) {
+		/* keep using the cached program, like a failed reload does */
+		return;
+	}
+	glDeleteProgram(pcp->prog);
+	pcp->prog = 0;
+}
+
+void
+progcache_bind(const progcache_prog_t *pcp)
+{
+	ASSERT(pcp != NULL);
+	glstate_use_program(progcache_get_prog(pcp));
+}
+
+GLint
+progcache_get_u(const progcache_prog_t *pcp, unsigned idx)
+{
+	ASSERT(pcp != NULL);
+	if (pcp->prog != 0) {
+		ASSERT3U(idx, <, PROGCACHE_MAX_UNIFORMS);
+		return (pcp->u[idx]);
+	}
+	return (shader_obj_get_u(&pcp->obj, idx));
+}
+
+GLuint
+progcache_get_prog(const progcache_prog_t *pcp)
+{
+	ASSERT(pcp != NULL);
+	if (pcp->prog != 0)
+		return (pcp->prog);
+	return (shader_obj_get_prog(&pcp->obj));
+}
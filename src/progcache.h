@@ -0,0 +1,83 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_PROGCACHE_H_
+#define	_PROGCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <acfutils/glew.h>
+#include <acfutils/shader.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define	PROGCACHE_MAX_UNIFORMS	32
+
+/*
+ * A shader program, which is either loaded straight out of a cache of
+ * linked program binaries (glProgramBinary), or compiled from source
+ * through shader_obj_init() and then stored in the cache for next time.
+ *
+ * Cache files live in `cache_dir' and are named after the program and a
+ * hash of GL_VENDOR, GL_RENDERER and GL_VERSION, so switching drivers
+ * or GPUs simply leaves the old binaries unused. Each file is also keyed
+ * by the CRC64 of the shader files of all stages (including the GLSL
+ * fallbacks), so a rebuilt shader invalidates it. A binary which the
+ * driver rejects is deleted and the program is compiled normally.
+ *
+ * crc64_init() must have been called beforehand.
+ */
+typedef struct {
+	shader_obj_t	obj;		/* when compiled from source */
+	GLuint		prog;		/* when loaded from the cache */
+	GLint		u[PROGCACHE_MAX_UNIFORMS];
+
+	/* what we need to switch a cached program over to its sources */
+	char			*shader_dir;
+	const shader_prog_info_t *info;
+	const shader_attr_bind_t *attr_binds;
+	size_t			num_attr_binds;
+	const char		**uniform_names;
+	size_t			num_uniforms;
+	uint64_t		src_crc;
+} progcache_prog_t;
+
+bool progcache_init(progcache_prog_t *pcp, const char *shader_dir,
+    const char *cache_dir, const shader_prog_info_t *info,
+    const shader_attr_bind_t *attr_binds, size_t num_attr_binds,
+    const char **uniform_names, size_t num_uniforms);
+void progcache_fini(progcache_prog_t *pcp);
+void progcache_reload_check(progcache_prog_t *pcp);
+void progcache_bind(const progcache_prog_t *pcp);
+GLint progcache_get_u(const progcache_prog_t *pcp, unsigned idx);
+GLuint progcache_get_prog(const progcache_prog_t *pcp);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _PROGCACHE_H_ */
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "record.h"
+
+#define	REC_MAGIC	0x4345524dU	/* "MREC" */
+#define	REC_VERSION	2
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	n_drs;
+	uint32_t	pad;
+} rec_hdr_t;
+
+struct rec_writer_s {
+	FILE		*fp;
+	unsigned	n_drs;
+};
+
+struct rec_reader_s {
+	FILE		*fp;
+	char		*path;
+	unsigned	n_drs;
+	rec_dr_t	*drs;
+};
+
+/*
+ * Starts a new recording of the animation datarefs of all objects in
+ * `geoms', in that order. NULL entries are skipped.
+ */
+rec_writer_t *
+rec_writer_open(const char *path, const mgeom_t *const *geoms,
+    unsigned n_geoms)
+{
+	rec_writer_t *w;
+	rec_hdr_t hdr = { .magic = REC_MAGIC, .version = REC_VERSION };
+	FILE *fp;
+
+	ASSERT(path != NULL);
+	ASSERT(geoms != NULL || n_geoms == 0);
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		logMsg("Can't open %s for writing: %s", path, strerror(errno));
+		return (NULL);
+	}
+	for (unsigned i = 0; i < n_geoms; i++)
+		hdr.n_drs += (geoms[i] != NULL ? geoms[i]->n_drs : 0);
+	if (fwrite(&hdr, sizeof (hdr), 1, fp) != 1)
+		goto errout;
+	for (unsigned i = 0; i < n_geoms; i++) {
+		const mgeom_t *geom = geoms[i];
+
+		if (geom == NULL)
+			continue;
+		for (unsigned j = 0; j < geom->n_drs; j++) {
+			const mgeom_dr_t *dr = &geom->drs[j];
+			rec_dr_t out = {
+			    .arr_idx = dr->arr_idx, .is_array = dr->is_array
+			};
+
+			strlcpy(out.name, dr->name, sizeof (out.name));
+			if (fwrite(&out, sizeof (out), 1, fp) != 1)
+				goto errout;
+		}
+	}
+	w = safe_calloc(1, sizeof (*w));
+	w->fp = fp;
+	w->n_drs = hdr.n_drs;
+
+	return (w);
+errout:
+	logMsg("Error writing %s: %s", path, strerror(errno));
+	fclose(fp);
+	return (NULL);
+}
+
+bool
+rec_writer_frame(rec_writer_t *w, const rec_frame_t *frame)
+{
+	ASSERT(w != NULL);
+	ASSERT(frame != NULL);
+	ASSERT(frame->dr_values != NULL || w->n_drs == 0);
+
+	if (fwrite(&frame->data, sizeof (frame->data), 1, w->fp) != 1)
+		return (false);
+	if (w->n_drs != 0 && fwrite(frame->dr_values,
+	    sizeof (*frame->dr_values), w->n_drs, w->fp) != w->n_drs)
+		return (false);
+	return (true);
+}
+
+void
+rec_writer_close(rec_writer_t *w)
+{
+	if (w == NULL)
+		return;
+	fclose(w->fp);
+	free(w);
+}
+
+rec_reader_t *
+rec_reader_open(const char *path)
+{
+	rec_reader_t *r;
+	rec_hdr_t hdr;
+	FILE *fp;
+
+	ASSERT(path != NULL);
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		logMsg("Can't open %s: %s", path, strerror(errno));
+		return (NULL);
+	}
+	if (fread(&hdr, sizeof (hdr), 1, fp) != 1 ||
+	    hdr.magic != REC_MAGIC || hdr.version != REC_VERSION) {
+		logMsg("%s: not a manipdraw recording", path);
+		fclose(fp);
+		return (NULL);
+	}
+	r = safe_calloc(1, sizeof (*r));
+	r->fp = fp;
+	r->path = safe_strdup(path);
+	r->n_drs = hdr.n_drs;
+	r->drs = safe_calloc(MAX(hdr.n_drs, 1), sizeof (*r->drs));
+	if (hdr.n_drs != 0 &&
+	    fread(r->drs, sizeof (*r->drs), hdr.n_drs, fp) != hdr.n_drs) {
+		logMsg("%s: recording truncated", path);
+		rec_reader_close(r);
+		return (NULL);
+	}
+	for (unsigned i = 0; i < r->n_drs; i++)
+		r->drs[i].name[sizeof (r->drs[i].name) - 1] = '\0';
+
+	return (r);
+}
+
+unsigned
+rec_reader_num_drs(const rec_reader_t *r)
+{
+	ASSERT(r != NULL);
+	return (r->n_drs);
+}
+
+const rec_dr_t *
+rec_reader_dr(const rec_reader_t *r, unsigned i)
+{
+	ASSERT(r != NULL);
+	ASSERT3U(i, <, r->n_drs);
+	return (&r->drs[i]);
+}
+
+/*
+ * Reads the next frame. `frame->dr_values' must point to an array of at
+ * least rec_reader_num_drs() floats. Returns false at the end of the
+ * recording.
+ */
+bool
+rec_reader_next(rec_reader_t *r, rec_frame_t *frame)
+{
+	ASSERT(r != NULL);
+	ASSERT(frame != NULL);
+	ASSERT(frame->dr_values != NULL || r->n_drs == 0);
+
+	if (fread(&frame->data, sizeof (frame->data), 1, r->fp) != 1)
+		return (false);
+	if (r->n_drs != 0 && fread(frame->dr_values,
+	    sizeof (*frame->dr_values), r->n_drs, r->fp) != r->n_drs) {
+		logMsg("%s: last frame truncated", r->path);
+		return (false);
+	}
+	return (true);
+}
+
+void
+rec_reader_close(rec_reader_t *r)
+{
+	if (r == NULL)
+		return;
+	fclose(r->fp);
+	free(r->drs);
+	free(r->path);
+	free(r);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_RECORD_H_
+#define	_RECORD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgeom.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Recordings of everything the manipulator resolve depends on, one
+ * record per frame, for offline replay by the benchmark harness. The
+ * file starts with the list of animation datarefs the objects reference,
+ * and every frame then carries one value for each of them. Like the
+ * geometry cache, the format is native endian.
+ *
+ * Neither the writer nor the reader touch any X-Plane APIs.
+ */
+typedef struct {
+	char		name[128];
+	uint32_t	arr_idx;
+	uint32_t	is_array;
+} rec_dr_t;
+
+/*
+ * The fixed part of every frame, written to the file as is. All fields
+ * are 32 bits wide, so it has no padding and the same layout on every
+ * target.
+ */
+typedef struct {
+	int32_t		mouse_x;
+	int32_t		mouse_y;
+	int32_t		vp[4];
+	float		acf_matrix[16];
+	float		proj_matrix[16];
+	int32_t		rev_float_z;
+} rec_frame_data_t;
+_Static_assert(sizeof (rec_frame_data_t) == 39 * 4,
+    "rec_frame_data_t must not contain padding");
+
+typedef struct {
+	rec_frame_data_t data;
+	float		*dr_values;	/* one per rec_dr_t */
+} rec_frame_t;
+
+typedef struct rec_writer_s rec_writer_t;
+typedef struct rec_reader_s rec_reader_t;
+
+rec_writer_t *rec_writer_open(const char *path, const mgeom_t *const *geoms,
+    unsigned n_geoms);
+bool rec_writer_frame(rec_writer_t *w, const rec_frame_t *frame);
+void rec_writer_close(rec_writer_t *w);
+
+rec_reader_t *rec_reader_open(const char *path);
+unsigned rec_reader_num_drs(const rec_reader_t *r);
+const rec_dr_t *rec_reader_dr(const rec_reader_t *r, unsigned i);
+bool rec_reader_next(rec_reader_t *r, rec_frame_t *frame);
+void rec_reader_close(rec_reader_t *r);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _RECORD_H_ */
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/dr.h>
+#include <acfutils/helpers.h>
+#include <acfutils/time.h>
+
+#include "rsched.h"
+#include "stats.h"
+
+#define	SCHED_LATENCY_BUDGET_DFL	50	/* ms */
+#define	SCHED_LATENCY_BUDGET_MAX	500	/* ms */
+/*
+ * Mouse and camera speeds at or above which we resolve every frame.
+ * Below them, the resolve interval stretches out linearly towards the
+ * latency budget.
+ */
+#define	SCHED_FAST_MOUSE		150	/* pixels per second */
+#define	SCHED_FAST_CAM			20	/* degrees per second */
+/*
+ * Resolves cheaper than this aren't worth deferring at all. More
+ * expensive ones may be deferred by one frame per this much cost.
+ */
+#define	SCHED_CHEAP_US			30
+/* weight of a new sample in the resolve cost moving average */
+#define	SCHED_COST_ALPHA		0.1
+/* frame times beyond this (pauses, loading) don't produce speeds */
+#define	SCHED_MAX_DT			SEC2USEC(0.25)
+
+static bool		inited = false;
+static int		enabled = 1;
+static float		latency_budget = SCHED_LATENCY_BUDGET_DFL;
+static int		interval = 1;
+
+static struct {
+	bool		valid;
+	uint64_t	t;
+	int		mouse_x, mouse_y;
+	mat4		acf_matrix;
+} prev = {};
+
+static float		frame_dt = 0;		/* us */
+static float		mouse_speed = 0;	/* px/s */
+static float		cam_speed = 0;		/* deg/s */
+static float		cpu_cost = 0;		/* us, moving average */
+static unsigned		deferred = 0;		/* frames */
+static uint64_t		deferred_t = 0;		/* first deferral */
+
+static struct {
+	dr_t	enable;
+	dr_t	latency_budget;
+	dr_t	interval;
+} drs;
+
+void
+rsched_init(void)
+{
+	ASSERT(!inited);
+
+	dr_create_i(&drs.enable, &enabled, true, "manipdraw/sched/enable");
+	dr_create_f(&drs.latency_budget, &latency_budget, true,
+	    "manipdraw/sched/latency_budget_ms");
+	dr_create_i(&drs.interval, &interval, false,
+	    "manipdraw/sched/interval");
+	memset(&prev, 0, sizeof (prev));
+	mouse_speed = cam_speed = cpu_cost = 0;
+	deferred = 0;
+	interval = 1;
+	inited = true;
+}
+
+void
+rsched_fini(void)
+{
+	if (!inited)
+		return;
+	dr_delete(&drs.enable);
+	dr_delete(&drs.latency_budget);
+	dr_delete(&drs.interval);
+	inited = false;
+}
+
+/*
+ * Angle in degrees between the rotation parts of two view matrices.
+ */
+static float
+rot_angle(const mat4 a, const mat4 b)
+{
+	float trace = 0;
+
+	/* trace(A^T * B), just the sum of element-wise products */
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++)
+			trace += a[i][j] * b[i][j];
+	}
+	return (glm_deg(acosf(clamp((trace - 1) / 2, -1, 1))));
+}
+
+/*
+ * Must be called every frame, whether a resolve is due or not, to keep
+ * track of how fast the mouse and camera are moving.
+ */
+void
+rsched_frame(int mouse_x, int mouse_y, const mat4 acf_matrix)
+{
+	uint64_t now = microclock();
+
+	ASSERT(acf_matrix != NULL);
+
+	if (prev.valid && now - prev.t < SCHED_MAX_DT && now > prev.t) {
+		float dt = USEC2SEC((double)(now - prev.t));
+
+		frame_dt = now - prev.t;
+		mouse_speed = hypot(mouse_x - prev.mouse_x,
+		    mouse_y - prev.mouse_y) / dt;
+		cam_speed = rot_angle(prev.acf_matrix, acf_matrix) / dt;
+	} else {
+		frame_dt = 0;
+		mouse_speed = cam_speed = 0;
+	}
+	prev.valid = true;
+	prev.t = now;
+	prev.mouse_x = mouse_x;
+	prev.mouse_y = mouse_y;
+	glm_mat4_copy((vec4 *)acf_matrix, prev.acf_matrix);
+}
+
+static float
+resolve_cost(void)
+{
+	float cpu, gpu;
+
+	if (stats_get_avg(STATS_RESOLVE, &cpu, &gpu))
+		return (cpu + gpu);
+	return (cpu_cost);
+}
+
+static int
+pick_interval(void)
+{
+	float motion, cost;
+	int max_n, n;
+
+	if (!enabled || frame_dt <= 0)
+		return (1);
+	motion = MAX(mouse_speed / SCHED_FAST_MOUSE,
+	    cam_speed / SCHED_FAST_CAM);
+	if (motion >= 1)
+		return (1);
+	cost = resolve_cost();
+	if (cost < SCHED_CHEAP_US)
+		return (1);
+	latency_budget = clamp(latency_budget, 0, SCHED_LATENCY_BUDGET_MAX);
+	max_n = MAX(1000 * latency_budget / frame_dt, 1);
+	max_n = MIN(max_n, cost / SCHED_CHEAP_US);
+	n = round(1 + (max_n - 1) * (1 - motion));
+
+	return (clampi(n, 1, MAX(max_n, 1)));
+}
+
+/*
+ * Called when change detection says a resolve is due. Returns false if
+ * it should be deferred to a later frame.
+ */
+bool
+rsched_should_resolve(void)
+{
+	uint64_t now = microclock();
+
+	interval = pick_interval();
+	if (deferred == 0)
+		deferred_t = now;
+	if (deferred + 1 >= (unsigned)interval ||
+	    now - deferred_t >= 1000 * latency_budget) {
+		deferred = 0;
+		return (true);
+	}
+	deferred++;
+	return (false);
+}
+
+/*
+ * Reports the CPU time a resolve took, for when the timing stats are
+ * off.
+ */
+void
+rsched_resolved(uint64_t cpu_us)
+{
+	if (cpu_cost == 0)
+		cpu_cost = cpu_us;
+	else
+		cpu_cost += SCHED_COST_ALPHA * (cpu_us - cpu_cost);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_RSCHED_H_
+#define	_RSCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cglm/cglm.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Resolve rate scheduler. Once change detection says the pick result
+ * might have changed, this decides whether it's worth finding out right
+ * away, or whether the resolve can wait for a few frames:
+ *
+ *	- while the mouse moves quickly, or the camera turns quickly, we
+ *	  resolve every frame, since the result is likely to change,
+ *	- during slow head movement we resolve every Nth frame, where N
+ *	  grows the slower things move and the more a resolve costs, but
+ *	  never defers a resolve by more than the latency budget,
+ *	- while idle, change detection doesn't ask for a resolve at all.
+ *
+ * The resolve cost comes from the timing stats when those are enabled,
+ * otherwise from the CPU time the callers report via rsched_resolved().
+ *
+ * Datarefs:
+ *	manipdraw/sched/enable			int, default 1
+ *	manipdraw/sched/latency_budget_ms	float, default 50
+ *	manipdraw/sched/interval		int, read-only, current N
+ */
+void rsched_init(void);
+void rsched_fini(void);
+
+void rsched_frame(int mouse_x, int mouse_y, const mat4 acf_matrix);
+bool rsched_should_resolve(void);
+void rsched_resolved(uint64_t cpu_us);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _RSCHED_H_ */
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if	!IBM
+#include <dirent.h>
+#endif
+
+#include <acfutils/assert.h>
+#include <acfutils/crc64.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+#include <acfutils/time.h>
+
+#include "shwatch.h"
+
+#define	SCAN_INTERVAL	SEC2USEC(1)
+
+static struct {
+	bool		running;
+	char		*dirpath;
+	thread_t	thr;
+	mutex_t		lock;
+	condvar_t	cv;
+	bool		stop;		/* protected by lock */
+	atomic_bool	changed;
+} watch = {};
+
+/*
+ * Boils the names, sizes and modification times of everything in the
+ * directory down to a single hash. Shader edits and rebuilds always
+ * change at least one of these.
+ */
+static uint64_t
+scan_dir(const char *dirpath)
+{
+	DIR *dp = opendir(dirpath);
+	struct dirent *de;
+	uint64_t sig = 0;
+
+	if (dp == NULL)
+		return (0);
+	while ((de = readdir(dp)) != NULL) {
+		char *path;
+		struct stat st;
+
+		if (de->d_name[0] == '.')
+			continue;
+		path = mkpathname(dirpath, de->d_name, NULL);
+		if (stat(path, &st) == 0) {
+			uint64_t item[2] = {
+			    (uint64_t)st.st_mtime, (uint64_t)st.st_size
+			};
+			uint64_t crc = crc64(de->d_name, strlen(de->d_name));
+
+			crc = crc64_append(crc, item, sizeof (item));
+			/*
+			 * readdir order isn't stable, so combine entries
+			 * in an order-independent way.
+			 */
+			sig += crc;
+		}
+		lacf_free(path);
+	}
+	closedir(dp);
+
+	return (sig);
+}
+
+static void
+watch_worker(void *unused)
+{
+	uint64_t sig;
+
+	UNUSED(unused);
+	thread_set_name("manipdraw_shwatch");
+
+	sig = scan_dir(watch.dirpath);
+	mutex_enter(&watch.lock);
+	while (!watch.stop) {
+		uint64_t new_sig;
+
+		cv_timedwait(&watch.cv, &watch.lock,
+		    microclock() + SCAN_INTERVAL);
+		if (watch.stop)
+			break;
+		mutex_exit(&watch.lock);
+		new_sig = scan_dir(watch.dirpath);
+		if (new_sig != sig) {
+			sig = new_sig;
+			atomic_store(&watch.changed, true);
+		}
+		mutex_enter(&watch.lock);
+	}
+	mutex_exit(&watch.lock);
+}
+
+/*
+ * Starts watching `dirpath'. Changes are only reported for things which
+ * happen after this call.
+ */
+void
+shwatch_start(const char *dirpath)
+{
+	ASSERT(dirpath != NULL);
+	ASSERT(!watch.running);
+
+	watch.dirpath = safe_strdup(dirpath);
+	mutex_init(&watch.lock);
+	cv_init(&watch.cv);
+	watch.stop = false;
+	atomic_store(&watch.changed, false);
+	watch.running = true;
+	VERIFY(thread_create(&watch.thr, watch_worker, NULL));
+}
+
+void
+shwatch_stop(void)
+{
+	if (!watch.running)
+		return;
+	mutex_enter(&watch.lock);
+	watch.stop = true;
+	cv_broadcast(&watch.cv);
+	mutex_exit(&watch.lock);
+	thread_join(&watch.thr);
+	cv_destroy(&watch.cv);
+	mutex_destroy(&watch.lock);
+	free(watch.dirpath);
+	watch.dirpath = NULL;
+	atomic_store(&watch.changed, false);
+	watch.running = false;
+}
+
+bool
+shwatch_is_running(void)
+{
+	return (watch.running);
+}
+
+/*
+ * Returns true, once, if anything in the directory changed since the
+ * last call. This is all the draw callback pays for per frame.
+ */
+bool
+shwatch_changed(void)
+{
+	if (!atomic_load_explicit(&watch.changed, memory_order_relaxed))
+		return (false);
+	return (atomic_exchange(&watch.changed, false));
+}
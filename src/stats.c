@@ -0,0 +1,375 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/dr.h>
+#include <acfutils/glew.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/time.h>
+
+#include "stats.h"
+
+#define	STATS_WINDOW		128
+/*
+ * Number of frames worth of GPU queries we keep in flight per section.
+ * If the GPU is further behind than this, we skip timing a frame.
+ */
+#define	STATS_QUERY_RING	4
+#define	STATS_PUBLISH_INTVAL	SEC2USEC(0.5)
+
+typedef struct {
+	float		samples[STATS_WINDOW];
+	unsigned	n_samples;
+	unsigned	head;
+	float		pub[3];		/* min, avg, p99 */
+	dr_t		dr;
+} series_t;
+
+typedef struct {
+	GLuint		q[2];		/* start & end timestamps */
+	bool		busy;
+} query_t;
+
+typedef struct {
+	const char	*name;
+	uint64_t	cpu_start;
+	bool		active;
+	query_t		*cur_query;
+	query_t		queries[STATS_QUERY_RING];
+	unsigned	q_head;
+	series_t	cpu;
+	series_t	gpu;
+} section_t;
+
+static bool		inited = false;
+static bool		have_queries = false;
+static bool		queries_created = false;
+static int		enabled = 0;
+static int		log_interval = 0;
+static uint64_t		last_publish_t = 0;
+static uint64_t		last_log_t = 0;
+static section_t	sections[NUM_STATS_SECTIONS] = {
+    [STATS_DRAW] = { .name = "draw" },
+    [STATS_RESOLVE] = { .name = "resolve" },
+    [STATS_PAINT] = { .name = "paint" }
+};
+static struct {
+	const char	*name;
+	series_t	series;
+} values[NUM_STATS_VALUES] = {
+    [STATS_HOVER_LATENCY] = { .name = "hover_latency" }
+};
+
+static struct {
+	dr_t	enable;
+	dr_t	log_interval;
+} drs;
+
+static void
+series_add(series_t *series, float value)
+{
+	series->samples[series->head] = value;
+	series->head = (series->head + 1) % STATS_WINDOW;
+	series->n_samples = MIN(series->n_samples + 1, STATS_WINDOW);
+}
+
+static int
+float_compar(const void *a, const void *b)
+{
+	float fa = *(const float *)a, fb = *(const float *)b;
+
+	if (fa < fb)
+		return (-1);
+	if (fa > fb)
+		return (1);
+	return (0);
+}
+
+static void
+series_publish(series_t *series)
+{
+	float sorted[STATS_WINDOW];
+	double sum = 0;
+	unsigned n = series->n_samples;
+
+	if (n == 0) {
+		memset(series->pub, 0, sizeof (series->pub));
+		return;
+	}
+	memcpy(sorted, series->samples, n * sizeof (*sorted));
+	qsort(sorted, n, sizeof (*sorted), float_compar);
+	for (unsigned i = 0; i < n; i++)
+		sum += sorted[i];
+	series->pub[0] = sorted[0];
+	series->pub[1] = sum / n;
+	series->pub[2] = sorted[(unsigned)ceil(0.99 * n) - 1];
+}
+
+static void
+queries_create(void)
+{
+	for (int i = 0; i < NUM_STATS_SECTIONS; i++) {
+		section_t *sect = &sections[i];
+
+		for (int j = 0; j < STATS_QUERY_RING; j++) {
+			glGenQueries(2, sect->queries[j].q);
+			sect->queries[j].busy = false;
+		}
+		sect->q_head = 0;
+	}
+	queries_created = true;
+}
+
+static void
+queries_destroy(void)
+{
+	for (int i = 0; i < NUM_STATS_SECTIONS; i++) {
+		section_t *sect = &sections[i];
+
+		for (int j = 0; j < STATS_QUERY_RING; j++) {
+			glDeleteQueries(2, sect->queries[j].q);
+			memset(&sect->queries[j], 0,
+			    sizeof (sect->queries[j]));
+		}
+		sect->cur_query = NULL;
+	}
+	queries_created = false;
+}
+
+/*
+ * Reads back all finished queries of a section, oldest first. Queries
+ * complete in submission order, so we can stop at the first one which
+ * isn't available yet.
+ */
+static void
+queries_collect(section_t *sect)
+{
+	for (unsigned i = 0; i < STATS_QUERY_RING; i++) {
+		query_t *q = &sect->queries[(sect->q_head + i) %
+		    STATS_QUERY_RING];
+		GLuint avail = 0;
+		GLuint64 start, end;
+
+		if (!q->busy)
+			continue;
+		glGetQueryObjectuiv(q->q[1], GL_QUERY_RESULT_AVAILABLE,
+		    &avail);
+		if (!avail)
+			break;
+		glGetQueryObjectui64v(q->q[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(q->q[1], GL_QUERY_RESULT, &end);
+		series_add(&sect->gpu, NANSEC2USEC(end - start));
+		q->busy = false;
+	}
+}
+
+void
+stats_init(void)
+{
+	ASSERT(!inited);
+
+	/*
+	 * GL_TIME_ELAPSED queries can't be nested, but our sections do
+	 * nest, so we bracket them with timestamp queries instead.
+	 */
+	have_queries = (GLEW_VERSION_3_3 || GLEW_ARB_timer_query);
+	dr_create_i(&drs.enable, &enabled, true, "manipdraw/stats/enable");
+	dr_create_i(&drs.log_interval, &log_interval, true,
+	    "manipdraw/stats/log_interval");
+	for (int i = 0; i < NUM_STATS_SECTIONS; i++) {
+		section_t *sect = &sections[i];
+
+		dr_create_vf32(&sect->cpu.dr, sect->cpu.pub, 3, false,
+		    "manipdraw/stats/%s/cpu_us", sect->name);
+		dr_create_vf32(&sect->gpu.dr, sect->gpu.pub, 3, false,
+		    "manipdraw/stats/%s/gpu_us", sect->name);
+	}
+	for (int i = 0; i < NUM_STATS_VALUES; i++) {
+		series_t *series = &values[i].series;
+
+		dr_create_vf32(&series->dr, series->pub, 3, false,
+		    "manipdraw/stats/%s_us", values[i].name);
+	}
+	inited = true;
+}
+
+void
+stats_fini(void)
+{
+	if (!inited)
+		return;
+	if (queries_created)
+		queries_destroy();
+	dr_delete(&drs.enable);
+	dr_delete(&drs.log_interval);
+	for (int i = 0; i < NUM_STATS_SECTIONS; i++) {
+		section_t *sect = &sections[i];
+
+		dr_delete(&sect->cpu.dr);
+		dr_delete(&sect->gpu.dr);
+		memset(&sect->cpu, 0, sizeof (sect->cpu));
+		memset(&sect->gpu, 0, sizeof (sect->gpu));
+		sect->active = false;
+	}
+	for (int i = 0; i < NUM_STATS_VALUES; i++) {
+		dr_delete(&values[i].series.dr);
+		memset(&values[i].series, 0, sizeof (values[i].series));
+	}
+	inited = false;
+}
+
+static void
+stats_log(void)
+{
+	for (int i = 0; i < NUM_STATS_SECTIONS; i++) {
+		const section_t *sect = &sections[i];
+
+		logMsg("stats: %-8s cpu min/avg/p99 %6.1f/%6.1f/%6.1f us  "
+		    "gpu min/avg/p99 %6.1f/%6.1f/%6.1f us", sect->name,
+		    sect->cpu.pub[0], sect->cpu.pub[1], sect->cpu.pub[2],
+		    sect->gpu.pub[0], sect->gpu.pub[1], sect->gpu.pub[2]);
+	}
+	for (int i = 0; i < NUM_STATS_VALUES; i++) {
+		const series_t *series = &values[i].series;
+
+		logMsg("stats: %-14s min/avg/p99 %6.1f/%6.1f/%6.1f us",
+		    values[i].name, series->pub[0], series->pub[1],
+		    series->pub[2]);
+	}
+}
+
+/*
+ * Must be called once per frame, outside of any section.
+ */
+void
+stats_frame(void)
+{
+	uint64_t now;
+
+	if (!enabled) {
+		if (queries_created)
+			queries_destroy();
+		return;
+	}
+	if (have_queries && !queries_created)
+		queries_create();
+	if (queries_created) {
+		for (int i = 0; i < NUM_STATS_SECTIONS; i++)
+			queries_collect(&sections[i]);
+	}
+	now = microclock();
+	if (now - last_publish_t >= STATS_PUBLISH_INTVAL) {
+		for (int i = 0; i < NUM_STATS_SECTIONS; i++) {
+			series_publish(&sections[i].cpu);
+			series_publish(&sections[i].gpu);
+		}
+		for (int i = 0; i < NUM_STATS_VALUES; i++)
+			series_publish(&values[i].series);
+		last_publish_t = now;
+	}
+	if (log_interval > 0 && now - last_log_t >= SEC2USEC(log_interval)) {
+		stats_log();
+		last_log_t = now;
+	}
+}
+
+void
+stats_begin(stats_section_t section)
+{
+	section_t *sect;
+
+	if (!enabled)
+		return;
+	ASSERT3U(section, <, NUM_STATS_SECTIONS);
+	sect = &sections[section];
+	ASSERT(!sect->active);
+	sect->active = true;
+	sect->cpu_start = microclock();
+	sect->cur_query = NULL;
+	if (queries_created && !sect->queries[sect->q_head].busy) {
+		sect->cur_query = &sect->queries[sect->q_head];
+		glQueryCounter(sect->cur_query->q[0], GL_TIMESTAMP);
+	}
+}
+
+/*
+ * Returns the currently published average CPU and GPU time of a
+ * section, or false if stats are off or there's nothing to report yet.
+ * Without timer queries, the GPU time is reported as 0.
+ */
+bool
+stats_get_avg(stats_section_t section, float *cpu_us, float *gpu_us)
+{
+	const section_t *sect;
+
+	ASSERT3U(section, <, NUM_STATS_SECTIONS);
+	ASSERT(cpu_us != NULL);
+	ASSERT(gpu_us != NULL);
+
+	sect = &sections[section];
+	if (!enabled || sect->cpu.n_samples == 0)
+		return (false);
+	*cpu_us = sect->cpu.pub[1];
+	*gpu_us = sect->gpu.pub[1];
+	return (true);
+}
+
+void
+stats_end(stats_section_t section)
+{
+	section_t *sect;
+
+	ASSERT3U(section, <, NUM_STATS_SECTIONS);
+	sect = &sections[section];
+	/*
+	 * Stats could've been toggled in the middle of the section, so
+	 * look at whether we actually started it.
+	 */
+	if (!sect->active)
+		return;
+	sect->active = false;
+	series_add(&sect->cpu, microclock() - sect->cpu_start);
+	if (sect->cur_query != NULL) {
+		glQueryCounter(sect->cur_query->q[1], GL_TIMESTAMP);
+		sect->cur_query->busy = true;
+		sect->cur_query = NULL;
+		sect->q_head = (sect->q_head + 1) % STATS_QUERY_RING;
+	}
+}
+
+/*
+ * Adds a sample of a value measured by the caller, in microseconds.
+ */
+void
+stats_value(stats_value_t value, float us)
+{
+	if (!enabled)
+		return;
+	ASSERT3U(value, <, NUM_STATS_VALUES);
+	series_add(&values[value].series, us);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_STATS_H_
+#define	_STATS_H_
+
+#include <stdbool.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Lightweight per-frame timing instrumentation. Each section collects
+ * CPU wall time via microclock() and GPU time via timestamp queries,
+ * which are kept in a small ring and only read back once the GPU
+ * reports them available, so we never stall on them.
+ *
+ * Rolling min/avg/p99 over the last STATS_WINDOW samples are published
+ * in microseconds as read-only float[3] datarefs named
+ * manipdraw/stats/<section>/cpu_us and manipdraw/stats/<section>/gpu_us.
+ * Collection is off by default and enabled by setting the
+ * manipdraw/stats/enable dataref to 1. Setting manipdraw/stats/log_interval
+ * to a number of seconds periodically dumps the stats to the log.
+ *
+ * Sections can nest, but each one may only be entered once per frame.
+ *
+ * Besides sections, there are values, which are measured by the caller
+ * and reported via stats_value(). These are published the same way, as
+ * manipdraw/stats/<value>_us.
+ */
+typedef enum {
+    STATS_DRAW,
+    STATS_RESOLVE,
+    STATS_PAINT,
+    NUM_STATS_SECTIONS
+} stats_section_t;
+
+typedef enum {
+    STATS_HOVER_LATENCY,	/* mouse sampled -> highlight painted */
+    NUM_STATS_VALUES
+} stats_value_t;
+
+void stats_init(void);
+void stats_fini(void);
+
+void stats_frame(void);
+void stats_begin(stats_section_t section);
+void stats_end(stats_section_t section);
+void stats_value(stats_value_t value, float us);
+
+bool stats_get_avg(stats_section_t section, float *cpu_us, float *gpu_us);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _STATS_H_ */
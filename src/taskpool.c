@@ -0,0 +1,344 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if	IBM
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+#include <acfutils/time.h>
+
+#include "taskpool.h"
+
+#define	TASKPOOL_MAX_WORKERS	8
+#define	DEQUE_INIT_CAP		64
+/*
+ * How long a waiter sleeps before looking for tasks to help with again.
+ * Finishing a group wakes it up right away, this only bounds how long
+ * newly submitted tasks can sit there while it could be running them.
+ */
+#define	WAIT_POLL_US		1000
+
+typedef struct {
+	taskpool_func_t		func;
+	void			*arg;
+	taskpool_group_t	*grp;
+} task_t;
+
+/*
+ * Ring buffer of tasks. The owner pushes and pops at the bottom, thieves
+ * take from the top, so the owner keeps working on what's hot in its
+ * cache, while thieves get the oldest, usually biggest pieces of work.
+ */
+typedef struct {
+	mutex_t		lock;
+	task_t		*tasks;
+	unsigned	cap;
+	unsigned	top;		/* oldest task */
+	unsigned	n;
+} deque_t;
+
+typedef struct {
+	taskpool_t	*tp;
+	unsigned	idx;
+	thread_t	thr;
+} worker_t;
+
+struct taskpool_s {
+	unsigned	n_workers;
+	worker_t	workers[TASKPOOL_MAX_WORKERS];
+	/* one per worker, plus one shared by all other threads */
+	deque_t		queues[TASKPOOL_MAX_WORKERS + 1];
+	atomic_uint	n_queued;
+	mutex_t		lock;
+	condvar_t	work_cv;	/* tasks got queued, or stop */
+	condvar_t	done_cv;	/* a group finished */
+	bool		stop;		/* protected by lock */
+};
+
+static _Thread_local const worker_t *self = NULL;
+
+static unsigned
+num_cpus(void)
+{
+#if	IBM
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (MAX(si.dwNumberOfProcessors, 1));
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0 ? n : 1);
+#endif
+}
+
+static void
+deque_push(deque_t *dq, const task_t *task)
+{
+	mutex_enter(&dq->lock);
+	if (dq->n == dq->cap) {
+		unsigned cap = MAX(2 * dq->cap, DEQUE_INIT_CAP);
+		task_t *tasks = safe_calloc(cap, sizeof (*tasks));
+
+		for (unsigned i = 0; i < dq->n; i++)
+			tasks[i] = dq->tasks[(dq->top + i) % dq->cap];
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->cap = cap;
+		dq->top = 0;
+	}
+	dq->tasks[(dq->top + dq->n) % dq->cap] = *task;
+	dq->n++;
+	mutex_exit(&dq->lock);
+}
+
+static bool
+deque_pop(deque_t *dq, task_t *task)
+{
+	bool found = false;
+
+	mutex_enter(&dq->lock);
+	if (dq->n != 0) {
+		dq->n--;
+		*task = dq->tasks[(dq->top + dq->n) % dq->cap];
+		found = true;
+	}
+	mutex_exit(&dq->lock);
+
+	return (found);
+}
+
+static bool
+deque_steal(deque_t *dq, task_t *task)
+{
+	bool found = false;
+
+	mutex_enter(&dq->lock);
+	if (dq->n != 0) {
+		*task = dq->tasks[dq->top];
+		dq->top = (dq->top + 1) % dq->cap;
+		dq->n--;
+		found = true;
+	}
+	mutex_exit(&dq->lock);
+
+	return (found);
+}
+
+/*
+ * The queue the calling thread owns in `tp'.
+ */
+static unsigned
+my_queue(const taskpool_t *tp)
+{
+	if (self != NULL && self->tp == tp)
+		return (self->idx);
+	return (tp->n_workers);
+}
+
+static bool
+take(taskpool_t *tp, task_t *task)
+{
+	unsigned my = my_queue(tp), n_queues = tp->n_workers + 1;
+
+	if (atomic_load_explicit(&tp->n_queued, memory_order_relaxed) == 0)
+		return (false);
+	for (unsigned i = 0; i < n_queues; i++) {
+		deque_t *dq = &tp->queues[(my + i) % n_queues];
+
+		if (i == 0 ? deque_pop(dq, task) : deque_steal(dq, task)) {
+			atomic_fetch_sub(&tp->n_queued, 1);
+			return (true);
+		}
+	}
+	return (false);
+}
+
+static void
+run(taskpool_t *tp, const task_t *task)
+{
+	task->func(task->arg);
+	if (atomic_fetch_sub(&task->grp->pending, 1) == 1) {
+		mutex_enter(&tp->lock);
+		cv_broadcast(&tp->done_cv);
+		mutex_exit(&tp->lock);
+	}
+}
+
+static void
+worker_main(void *arg)
+{
+	worker_t *w = arg;
+	taskpool_t *tp = w->tp;
+
+	thread_set_name("manipdraw_task");
+	self = w;
+
+	for (;;) {
+		task_t task;
+
+		if (take(tp, &task)) {
+			run(tp, &task);
+			continue;
+		}
+		mutex_enter(&tp->lock);
+		while (!tp->stop && atomic_load(&tp->n_queued) == 0)
+			cv_wait(&tp->work_cv, &tp->lock);
+		if (tp->stop) {
+			mutex_exit(&tp->lock);
+			break;
+		}
+		mutex_exit(&tp->lock);
+	}
+	self = NULL;
+}
+
+/*
+ * Starts a pool with `n_workers' threads. Passing 0 picks one worker
+ * per CPU core, minus one for the submitting thread, which does its
+ * share of the work while it waits.
+ */
+taskpool_t *
+taskpool_new(unsigned n_workers)
+{
+	taskpool_t *tp = safe_calloc(1, sizeof (*tp));
+
+	if (n_workers == 0)
+		n_workers = MAX(num_cpus(), 2) - 1;
+	tp->n_workers = MIN(n_workers, TASKPOOL_MAX_WORKERS);
+	for (unsigned i = 0; i <= tp->n_workers; i++)
+		mutex_init(&tp->queues[i].lock);
+	atomic_init(&tp->n_queued, 0);
+	mutex_init(&tp->lock);
+	cv_init(&tp->work_cv);
+	cv_init(&tp->done_cv);
+	for (unsigned i = 0; i < tp->n_workers; i++) {
+		worker_t *w = &tp->workers[i];
+
+		w->tp = tp;
+		w->idx = i;
+		VERIFY(thread_create(&w->thr, worker_main, w));
+	}
+
+	return (tp);
+}
+
+/*
+ * Stops the workers. All submitted tasks must have been waited for.
+ */
+void
+taskpool_destroy(taskpool_t *tp)
+{
+	if (tp == NULL)
+		return;
+	ASSERT0(atomic_load(&tp->n_queued));
+	mutex_enter(&tp->lock);
+	tp->stop = true;
+	cv_broadcast(&tp->work_cv);
+	mutex_exit(&tp->lock);
+	for (unsigned i = 0; i < tp->n_workers; i++)
+		thread_join(&tp->workers[i].thr);
+	for (unsigned i = 0; i <= tp->n_workers; i++) {
+		free(tp->queues[i].tasks);
+		mutex_destroy(&tp->queues[i].lock);
+	}
+	cv_destroy(&tp->done_cv);
+	cv_destroy(&tp->work_cv);
+	mutex_destroy(&tp->lock);
+	free(tp);
+}
+
+unsigned
+taskpool_num_workers(const taskpool_t *tp)
+{
+	return (tp != NULL ? tp->n_workers : 0);
+}
+
+void
+taskpool_group_init(taskpool_group_t *grp)
+{
+	ASSERT(grp != NULL);
+	atomic_init(&grp->pending, 0);
+}
+
+/*
+ * Queues `func(arg)' to run as part of `grp'. Without a pool, it runs
+ * right away, so callers don't need a separate serial code path.
+ */
+void
+taskpool_submit(taskpool_t *tp, taskpool_group_t *grp,
+    taskpool_func_t func, void *arg)
+{
+	task_t task = { .func = func, .arg = arg, .grp = grp };
+
+	ASSERT(grp != NULL);
+	ASSERT(func != NULL);
+
+	if (tp == NULL) {
+		func(arg);
+		return;
+	}
+	atomic_fetch_add(&grp->pending, 1);
+	deque_push(&tp->queues[my_queue(tp)], &task);
+	atomic_fetch_add(&tp->n_queued, 1);
+	mutex_enter(&tp->lock);
+	cv_signal(&tp->work_cv);
+	mutex_exit(&tp->lock);
+}
+
+/*
+ * Returns once all tasks in `grp' have finished, running queued tasks
+ * (of any group) in the meantime.
+ */
+void
+taskpool_wait(taskpool_t *tp, taskpool_group_t *grp)
+{
+	ASSERT(grp != NULL);
+
+	if (tp == NULL)
+		return;
+	while (atomic_load(&grp->pending) != 0) {
+		task_t task;
+
+		if (take(tp, &task)) {
+			run(tp, &task);
+			continue;
+		}
+		mutex_enter(&tp->lock);
+		if (atomic_load(&grp->pending) != 0) {
+			cv_timedwait(&tp->done_cv, &tp->lock,
+			    microclock() + WAIT_POLL_US);
+		}
+		mutex_exit(&tp->lock);
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_TASKPOOL_H_
+#define	_TASKPOOL_H_
+
+#include <stdatomic.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Small work-stealing thread pool for splitting up CPU-heavy jobs, such
+ * as BVH builds. Every worker has its own queue, which it runs newest
+ * task first, and steals the oldest tasks from the other queues when
+ * its own runs dry. Tasks submitted from outside the pool go to a
+ * queue of their own, which all workers steal from. A thread waiting
+ * for a group of tasks to finish helps run queued tasks in the
+ * meantime, so tasks may submit and wait for subtasks of their own.
+ */
+typedef struct taskpool_s taskpool_t;
+typedef void (*taskpool_func_t)(void *arg);
+
+/* A set of tasks which can be waited for together. */
+typedef struct {
+	atomic_uint	pending;
+} taskpool_group_t;
+
+taskpool_t *taskpool_new(unsigned n_workers);
+void taskpool_destroy(taskpool_t *tp);
+unsigned taskpool_num_workers(const taskpool_t *tp);
+
+void taskpool_group_init(taskpool_group_t *grp);
+void taskpool_submit(taskpool_t *tp, taskpool_group_t *grp,
+    taskpool_func_t func, void *arg);
+void taskpool_wait(taskpool_t *tp, taskpool_group_t *grp);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _TASKPOOL_H_ */
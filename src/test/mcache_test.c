@@ -0,0 +1,172 @@
+/*
+ * Copyright 2023 Saso Kiselkov. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * “Software”), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Round-trips manipulator geometry through the binary cache and checks
+ * that what comes back out matches what mgeom_parse() produced.
+ *
+ * Usage: mcache_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/crc64.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+
+#include "mcache.h"
+#include "mgeom.h"
+
+/*
+ * One manipulator drawn under three animations: one bound to a sim
+ * dataref, one to an array element and one with no dataref at all,
+ * which mgeom stores as MGEOM_DR_NONE.
+ */
+static const char *test_obj =
+    "I\n"
+    "800\n"
+    "OBJ\n"
+    "\n"
+    "POINT_COUNTS 4 0 0 6\n"
+    "VT 0 0 0 0 0 1 0 0\n"
+    "VT 1 0 0 0 0 1 0 0\n"
+    "VT 0 1 0 0 0 1 0 0\n"
+    "VT 1 1 0 0 0 1 0 0\n"
+    "IDX10 0 1 2 1 3 2\n"
+    "ATTR_manip_command hand test/cmd Test\n"
+    "ANIM_begin\n"
+    "ANIM_trans 0 0 0 0 0 1 0 1 sim/test/value\n"
+    "TRIS 0 3\n"
+    "ANIM_begin\n"
+    "ANIM_rotate 0 0 1 0 90 0 1 none\n"
+    "ANIM_hide 0.5 1 sim/test/array[3]\n"
+    "TRIS 3 3\n"
+    "ANIM_end\n"
+    "ANIM_end\n";
+
+static void
+log_dbg_string(const char *str)
+{
+	fputs(str, stderr);
+}
+
+static void
+check_equal(const mgeom_t *a, const mgeom_t *b)
+{
+	VERIFY3U(a->n_vtx, ==, b->n_vtx);
+	VERIFY0(memcmp(a->vtx, b->vtx, a->n_vtx * sizeof (*a->vtx)));
+	VERIFY3U(a->n_idx, ==, b->n_idx);
+	VERIFY0(memcmp(a->idx, b->idx, a->n_idx * sizeof (*a->idx)));
+
+	VERIFY3U(a->n_spans, ==, b->n_spans);
+	for (unsigned i = 0; i < a->n_spans; i++) {
+		const mgeom_span_t *sa = &a->spans[i], *sb = &b->spans[i];
+
+		VERIFY3U(sa->manip, ==, sb->manip);
+		VERIFY3U(sa->anim, ==, sb->anim);
+		VERIFY3U(sa->off, ==, sb->off);
+		VERIFY3U(sa->len, ==, sb->len);
+		VERIFY0(memcmp(&sa->bounds, &sb->bounds, sizeof (sa->bounds)));
+	}
+	VERIFY3U(a->n_manips, ==, b->n_manips);
+	for (unsigned i = 0; i < a->n_manips; i++) {
+		const mgeom_manip_t *ma = &a->manips[i], *mb = &b->manips[i];
+
+		VERIFY3U(ma->type, ==, mb->type);
+		VERIFY3U(ma->first_span, ==, mb->first_span);
+		VERIFY3U(ma->n_spans, ==, mb->n_spans);
+		VERIFY3U(ma->animated, ==, mb->animated);
+	}
+	VERIFY3U(a->n_anims, ==, b->n_anims);
+	for (unsigned i = 0; i < a->n_anims; i++) {
+		const mgeom_anim_t *aa = &a->anims[i], *ab = &b->anims[i];
+
+		VERIFY3U(aa->parent, ==, ab->parent);
+		VERIFY3U(aa->type, ==, ab->type);
+		VERIFY3U(aa->dr, ==, ab->dr);
+		VERIFY0(memcmp(aa->axis, ab->axis, sizeof (aa->axis)));
+		VERIFY(aa->loop == ab->loop);
+		VERIFY3U(aa->n_keys, ==, ab->n_keys);
+		VERIFY0(memcmp(aa->keys, ab->keys,
+		    aa->n_keys * sizeof (*aa->keys)));
+	}
+	VERIFY3U(a->n_drs, ==, b->n_drs);
+	for (unsigned i = 0; i < a->n_drs; i++) {
+		const mgeom_dr_t *da = &a->drs[i], *db = &b->drs[i];
+
+		VERIFY0(strcmp(da->name, db->name));
+		VERIFY3U(da->arr_idx, ==, db->arr_idx);
+		VERIFY3U(da->is_array, ==, db->is_array);
+	}
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/mcache_test.XXXXXX";
+	char *src_path, *cache_path;
+	mgeom_t *parsed, *cached;
+	bool have_unbound = false;
+	FILE *fp;
+
+	log_init(log_dbg_string, "mcache_test");
+	crc64_init();
+
+	VERIFY(mkdtemp(dir) != NULL);
+	src_path = mkpathname(dir, "test.obj", NULL);
+	cache_path = mkpathname(dir, "cache", "test.mcache", NULL);
+	fp = fopen(src_path, "wb");
+	VERIFY(fp != NULL);
+	VERIFY(fputs(test_obj, fp) >= 0);
+	VERIFY0(fclose(fp));
+
+	parsed = mgeom_parse(src_path);
+	VERIFY(parsed != NULL);
+	VERIFY3U(parsed->n_anims, ==, 3);
+	VERIFY3U(parsed->n_drs, ==, 2);
+	for (unsigned i = 0; i < parsed->n_anims; i++) {
+		if (parsed->anims[i].dr == MGEOM_DR_NONE)
+			have_unbound = true;
+	}
+	VERIFY(have_unbound);
+
+	VERIFY(mcache_write(cache_path, src_path, parsed));
+	cached = mcache_load(cache_path, src_path);
+	VERIFY(cached != NULL);
+	check_equal(parsed, cached);
+
+	mgeom_free(cached);
+	mgeom_free(parsed);
+	remove_directory(dir);
+	lacf_free(cache_path);
+	lacf_free(src_path);
+	log_fini();
+
+	printf("mcache_test: OK\n");
+
+	return (0);
+}